@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Scheduler load balancing test application.
+ *
+ * Usage: test-balance [<thread count> [<seconds>]]
+ *
+ * Starts a number of threads which spin for the given time, and reports the
+ * utilisation of each CPU over that time, along with how much work each thread
+ * got done. With the thread count equal to the CPU count, all CPUs should be
+ * close to 100% utilised.
+ */
+
+#include <core/time.h>
+
+#include <kernel/object.h>
+#include <kernel/status.h>
+#include <kernel/system.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_SECONDS     10
+
+static volatile bool exiting;
+
+static int thread_func(void *arg) {
+    volatile uint64_t *count = arg;
+
+    while (!exiting)
+        (*count)++;
+
+    return 0;
+}
+
+static bool get_usage(cpu_usage_t *usage, nstime_t *_time) {
+    status_t ret = kern_system_info(SYSTEM_INFO_CPU_USAGE, usage);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to get CPU usage: %" PRId32 "\n", ret);
+        return false;
+    }
+
+    kern_time_get(TIME_SYSTEM, _time);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    status_t ret;
+
+    size_t cpu_count;
+    ret = kern_system_info(SYSTEM_INFO_CPU_COUNT, &cpu_count);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to get CPU count: %" PRId32 "\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    size_t thread_count = (argc > 1) ? strtoul(argv[1], NULL, 0) : cpu_count;
+    unsigned seconds    = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_SECONDS;
+
+    if (!thread_count || !seconds) {
+        fprintf(stderr, "Usage: %s [<thread count> [<seconds>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("Running %zu threads on %zu CPUs for %u seconds\n", thread_count, cpu_count, seconds);
+
+    cpu_usage_t *start_usage    = malloc(sizeof(cpu_usage_t) * cpu_count);
+    cpu_usage_t *end_usage      = malloc(sizeof(cpu_usage_t) * cpu_count);
+    object_event_t *events      = malloc(sizeof(object_event_t) * thread_count);
+    volatile uint64_t *counts   = calloc(thread_count, sizeof(uint64_t));
+
+    if (!start_usage || !end_usage || !events || !counts) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    nstime_t start_time, end_time;
+    if (!get_usage(start_usage, &start_time))
+        return EXIT_FAILURE;
+
+    for (size_t i = 0; i < thread_count; i++) {
+        ret = kern_thread_create(
+            "test_balance", thread_func, (void *)&counts[i], NULL, 0,
+            &events[i].handle);
+        if (ret != STATUS_SUCCESS) {
+            fprintf(stderr, "Failed to create thread: %" PRId32 "\n", ret);
+            return EXIT_FAILURE;
+        }
+
+        events[i].event = THREAD_EVENT_DEATH;
+        events[i].flags = 0;
+    }
+
+    kern_thread_sleep(core_secs_to_nsecs(seconds), NULL);
+
+    if (!get_usage(end_usage, &end_time))
+        return EXIT_FAILURE;
+
+    exiting = true;
+
+    ret = kern_object_wait(events, thread_count, OBJECT_WAIT_ALL, -1);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to wait for threads: %" PRId32 "\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    nstime_t elapsed = end_time - start_time;
+    uint64_t total_util = 0;
+
+    printf("CPU  Utilisation\n");
+    printf("===  ===========\n");
+
+    for (size_t i = 0; i < cpu_count; i++) {
+        nstime_t idle  = end_usage[i].idle_time - start_usage[i].idle_time;
+        nstime_t busy  = (idle < elapsed) ? elapsed - idle : 0;
+        uint64_t util  = (busy * 1000) / elapsed;
+
+        printf("%-3" PRIu32 "  %" PRIu64 ".%" PRIu64 "%%\n", end_usage[i].id, util / 10, util % 10);
+        total_util += util;
+    }
+
+    printf("Average utilisation: %" PRIu64 ".%" PRIu64 "%%\n",
+        (total_util / cpu_count) / 10, (total_util / cpu_count) % 10);
+
+    uint64_t min_count = UINT64_MAX, max_count = 0;
+    for (size_t i = 0; i < thread_count; i++) {
+        if (counts[i] < min_count)
+            min_count = counts[i];
+        if (counts[i] > max_count)
+            max_count = counts[i];
+    }
+
+    printf("Thread iterations: min %" PRIu64 ", max %" PRIu64 "\n", min_count, max_count);
+    return EXIT_SUCCESS;
+}
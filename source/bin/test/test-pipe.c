@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Pipe throughput test application.
+ *
+ * Usage: test-pipe [<transfer size> [<MiB to transfer>]]
+ *
+ * Creates a pipe, and has a second thread write the requested amount of data
+ * to it in chunks of the given transfer size while the main thread reads it
+ * back in the same size chunks. Reports the time taken and the throughput.
+ */
+
+#include <core/time.h>
+
+#include <kernel/file.h>
+#include <kernel/object.h>
+#include <kernel/pipe.h>
+#include <kernel/status.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_TRANSFER_SIZE   4096
+#define DEFAULT_TOTAL_MIB       64
+
+static handle_t write_handle;
+static size_t transfer_size;
+static uint64_t total_size;
+
+static int writer_thread(void *arg) {
+    char *buf = malloc(transfer_size);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(buf, 0xaa, transfer_size);
+
+    uint64_t remaining = total_size;
+    while (remaining) {
+        size_t size = (remaining < transfer_size) ? remaining : transfer_size;
+
+        size_t bytes;
+        status_t ret = kern_file_write(write_handle, buf, size, -1, &bytes);
+        if (ret != STATUS_SUCCESS) {
+            fprintf(stderr, "Failed to write pipe: %" PRId32 "\n", ret);
+            return EXIT_FAILURE;
+        }
+
+        remaining -= bytes;
+    }
+
+    /* Closing the write end signals the end of the data to the reader. */
+    kern_handle_close(write_handle);
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    status_t ret;
+
+    transfer_size      = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_TRANSFER_SIZE;
+    uint64_t total_mib = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_TOTAL_MIB;
+
+    if (!transfer_size || !total_mib) {
+        fprintf(stderr, "Usage: %s [<transfer size> [<MiB to transfer>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    total_size = total_mib * 1024 * 1024;
+
+    char *buf = malloc(transfer_size);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    handle_t handles[2];
+    ret = kern_pipe_create(handles);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to create pipe: %" PRId32 "\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    write_handle = handles[1];
+
+    printf("Transferring %" PRIu64 " MiB in %zu byte chunks\n", total_mib, transfer_size);
+
+    nstime_t start_time;
+    kern_time_get(TIME_SYSTEM, &start_time);
+
+    handle_t thread;
+    ret = kern_thread_create("writer", writer_thread, NULL, NULL, 0, &thread);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to create thread: %" PRId32 "\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t received = 0;
+    while (true) {
+        size_t bytes;
+        ret = kern_file_read(handles[0], buf, transfer_size, -1, &bytes);
+        if (ret != STATUS_SUCCESS) {
+            fprintf(stderr, "Failed to read pipe: %" PRId32 "\n", ret);
+            return EXIT_FAILURE;
+        } else if (!bytes) {
+            break;
+        }
+
+        received += bytes;
+    }
+
+    nstime_t end_time;
+    kern_time_get(TIME_SYSTEM, &end_time);
+
+    object_event_t event;
+    event.handle = thread;
+    event.event  = THREAD_EVENT_DEATH;
+    event.flags  = 0;
+
+    kern_object_wait(&event, 1, 0, -1);
+
+    if (received != total_size) {
+        fprintf(stderr, "Received %" PRIu64 " bytes, expected %" PRIu64 "\n", received, total_size);
+        return EXIT_FAILURE;
+    }
+
+    nstime_t elapsed = end_time - start_time;
+    uint64_t usecs   = core_nsecs_to_usecs(elapsed);
+    uint64_t rate    = (usecs) ? (total_size * 1000000) / usecs : 0;
+
+    printf("Took %" PRIu64 " us, %" PRIu64 " MiB/s\n", usecs, rate / (1024 * 1024));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Timer stress test application.
+ *
+ * Usage: test-timers [<thread count> [<iterations>]]
+ *
+ * Starts a large number of threads which repeatedly sleep for varying short
+ * periods, so that there are many concurrently running kernel timers, and
+ * reports how late the sleeps woke up compared to the requested time. Each
+ * running thread holds a handle, so only up to MAX_RUNNING_THREADS run at once
+ * and a new one is started whenever one exits.
+ */
+
+#include <core/time.h>
+#include <core/utility.h>
+
+#include <kernel/object.h>
+#include <kernel/status.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_THREADS     2000
+#define DEFAULT_ITERATIONS  20
+
+/** Limit on running threads, to stay within the process' handle table. */
+#define MAX_RUNNING_THREADS 256
+
+/** Sleep lengths range from 1 to this many milliseconds. */
+#define MAX_SLEEP_MSECS     20
+
+typedef struct thread_result {
+    unsigned index;
+    nstime_t total_late;
+    nstime_t max_late;
+} thread_result_t;
+
+static unsigned iterations;
+static thread_result_t *results;
+static handle_t *handles;
+static handle_t waitset;
+
+static int thread_func(void *arg) {
+    thread_result_t *result = arg;
+    uint32_t seed = result->index + 1;
+
+    for (unsigned i = 0; i < iterations; i++) {
+        seed = (seed * 1103515245) + 12345;
+        nstime_t length = core_msecs_to_nsecs(1 + ((seed >> 16) % MAX_SLEEP_MSECS));
+
+        nstime_t start, end;
+        kern_time_get(TIME_SYSTEM, &start);
+        kern_thread_sleep(length, NULL);
+        kern_time_get(TIME_SYSTEM, &end);
+
+        nstime_t late = (end - start) - length;
+        if (late < 0) {
+            fprintf(stderr, "Thread %u woke %" PRId64 " ns early\n", result->index, -late);
+            late = 0;
+        }
+
+        result->total_late += late;
+        if (late > result->max_late)
+            result->max_late = late;
+    }
+
+    return 0;
+}
+
+static bool start_thread(size_t index) {
+    status_t ret;
+
+    results[index].index = index;
+
+    object_event_t event;
+    ret = kern_thread_create("test_timers", thread_func, &results[index], NULL, 0, &event.handle);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to create thread %zu: %" PRId32 "\n", index, ret);
+        return false;
+    }
+
+    event.event = THREAD_EVENT_DEATH;
+    event.flags = OBJECT_EVENT_ONESHOT;
+    event.udata = (void *)index;
+
+    ret = kern_waitset_add(waitset, &event);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to add thread %zu to wait set: %" PRId32 "\n", index, ret);
+        return false;
+    }
+
+    /* Keep the handle open until the thread has died, so that its ID is not
+     * reused while the event is registered. */
+    handles[index] = event.handle;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    status_t ret;
+
+    size_t thread_count = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_THREADS;
+    iterations          = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_ITERATIONS;
+
+    if (!thread_count || !iterations) {
+        fprintf(stderr, "Usage: %s [<thread count> [<iterations>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    results = calloc(thread_count, sizeof(thread_result_t));
+    handles = calloc(thread_count, sizeof(handle_t));
+    if (!results || !handles) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    /* There are too many threads for kern_object_wait(), use a wait set. */
+    ret = kern_waitset_create(&waitset);
+    if (ret != STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to create wait set: %" PRId32 "\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    size_t running = core_min(thread_count, MAX_RUNNING_THREADS);
+
+    printf("Running %zu threads (%zu at a time) for %u iterations\n", thread_count, running, iterations);
+
+    nstime_t start_time, end_time;
+    kern_time_get(TIME_SYSTEM, &start_time);
+
+    size_t started = 0;
+    while (started < running) {
+        if (!start_thread(started++))
+            return EXIT_FAILURE;
+    }
+
+    size_t remaining = thread_count;
+    while (remaining) {
+        object_event_t events[64];
+        size_t count;
+
+        ret = kern_waitset_wait(waitset, events, core_array_size(events), -1, &count);
+        if (ret != STATUS_SUCCESS) {
+            fprintf(stderr, "Failed to wait for threads: %" PRId32 "\n", ret);
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            size_t index = (size_t)events[i].udata;
+            kern_handle_close(handles[index]);
+
+            if (started < thread_count && !start_thread(started++))
+                return EXIT_FAILURE;
+        }
+
+        remaining -= count;
+    }
+
+    kern_time_get(TIME_SYSTEM, &end_time);
+
+    nstime_t total_late = 0, max_late = 0;
+    for (size_t i = 0; i < thread_count; i++) {
+        total_late += results[i].total_late;
+        if (results[i].max_late > max_late)
+            max_late = results[i].max_late;
+    }
+
+    uint64_t sleeps = (uint64_t)thread_count * iterations;
+
+    printf("Completed %" PRIu64 " sleeps in %" PRId64 " ms\n", sleeps, core_nsecs_to_msecs(end_time - start_time));
+    printf("Wakeup latency: average %" PRId64 " us, max %" PRId64 " us\n",
+        core_nsecs_to_usecs(total_late / sleeps), core_nsecs_to_usecs(max_late));
+
+    kern_handle_close(waitset);
+    return EXIT_SUCCESS;
+}
@@ -74,6 +74,9 @@ void cpu_dump(cpu_t *cpu) {
         kprintf(LOG_NOTICE, "  lapic_freq:  %" PRIu64 "MHz\n", cpu->arch.lapic_freq / 1000000);
 
     kprintf(LOG_NOTICE, "  cache_align: %d\n", cpu->arch.cache_alignment);
+    kprintf(LOG_NOTICE, "  topology:    package %" PRIu32 ", cache %" PRIu32 ", core %" PRIu32 "\n",
+        cpu->topology_id[CPU_TOPOLOGY_PACKAGE], cpu->topology_id[CPU_TOPOLOGY_CACHE],
+        cpu->topology_id[CPU_TOPOLOGY_CORE]);
     kprintf(LOG_NOTICE, "  phys_bits:   %d\n", cpu->arch.max_phys_bits);
     kprintf(LOG_NOTICE, "  virt_bits:   %d\n", cpu->arch.max_virt_bits);
 }
@@ -171,6 +174,15 @@ static __init_text void detect_cpu_features(cpu_t *cpu, x86_features_t *features
     if (features->clfsh)
         cpu->arch.cache_alignment = ((ebx >> 8) & 0xff) * 8;
 
+    /* Get structured extended feature information. */
+    if (features->highest_standard >= X86_CPUID_STRUCT_FEATURE) {
+        x86_cpuid_subleaf(
+            X86_CPUID_STRUCT_FEATURE, 0,
+            &eax, &features->structured_ebx, &ecx, &edx);
+    } else {
+        features->structured_ebx = 0;
+    }
+
     /* Get the highest supported extended level. */
     x86_cpuid(X86_CPUID_EXT_MAX, &features->highest_extended, &ebx, &ecx, &edx);
     if (features->highest_extended & (1<<31)) {
@@ -228,6 +240,103 @@ static __init_text void detect_cpu_features(cpu_t *cpu, x86_features_t *features
         cpu->arch.max_virt_bits = 48;
 }
 
+/** Get the number of APIC ID bits needed to represent a number of IDs. */
+static inline unsigned topology_bits(uint32_t count) {
+    return (count > 1) ? highbit(count - 1) : 0;
+}
+
+/**
+ * Detect the topology of the current CPU. This determines the shift to apply
+ * to the CPU's APIC ID to get an ID for each topology level, using the x2APIC
+ * topology leaf (0xb) if available, and falling back on the legacy logical
+ * processor counts otherwise. The deterministic cache parameters leaf (0x4) is
+ * used to determine the set of CPUs sharing the last level cache. Where
+ * information is not available, we assume that each CPU is its own core, and
+ * that the last level cache covers the whole package.
+ *
+ * @param cpu           Pointer to CPU structure for this CPU.
+ * @param features      Features for the CPU.
+ */
+static __init_text void detect_cpu_topology(cpu_t *cpu, x86_features_t *features) {
+    uint32_t eax, ebx, ecx, edx;
+
+    x86_cpuid(X86_CPUID_FEATURE_INFO, &eax, &ebx, &ecx, &edx);
+    uint32_t apic_id = ebx >> 24;
+
+    unsigned smt_bits     = 0;
+    unsigned package_bits = 0;
+    unsigned cache_bits   = 0;
+    bool have_cache_info  = false;
+
+    bool have_x2apic_topology = false;
+    if (features->highest_standard >= X86_CPUID_X2APIC) {
+        x86_cpuid_subleaf(X86_CPUID_X2APIC, 0, &eax, &ebx, &ecx, &edx);
+        have_x2apic_topology = ebx != 0;
+    }
+
+    if (have_x2apic_topology) {
+        apic_id = edx;
+
+        /* Each sub-leaf describes a level and gives the shift to get the ID of
+         * the next level up. The last valid level gives the package shift. */
+        for (uint32_t i = 0; ; i++) {
+            x86_cpuid_subleaf(X86_CPUID_X2APIC, i, &eax, &ebx, &ecx, &edx);
+
+            unsigned type = (ecx >> 8) & 0xff;
+            if (!type)
+                break;
+
+            if (type == X86_TOPOLOGY_LEVEL_SMT)
+                smt_bits = eax & 0x1f;
+
+            package_bits = eax & 0x1f;
+        }
+    } else if (features->htt) {
+        x86_cpuid(X86_CPUID_FEATURE_INFO, &eax, &ebx, &ecx, &edx);
+        uint32_t logical_count = (ebx >> 16) & 0xff;
+        uint32_t core_count    = 1;
+
+        if (features->highest_standard >= X86_CPUID_CACHE_PARMS) {
+            x86_cpuid_subleaf(X86_CPUID_CACHE_PARMS, 0, &eax, &ebx, &ecx, &edx);
+            if (eax & 0x1f)
+                core_count = (eax >> 26) + 1;
+        }
+
+        package_bits = topology_bits(logical_count);
+        smt_bits     = topology_bits(max(logical_count / core_count, 1u));
+    }
+
+    /* Find the highest level cache, and the number of CPUs sharing it. */
+    if (features->highest_standard >= X86_CPUID_CACHE_PARMS) {
+        unsigned highest_level = 0;
+
+        for (uint32_t i = 0; ; i++) {
+            x86_cpuid_subleaf(X86_CPUID_CACHE_PARMS, i, &eax, &ebx, &ecx, &edx);
+
+            if (!(eax & 0x1f))
+                break;
+
+            unsigned level = (eax >> 5) & 0x7;
+            if (level > highest_level) {
+                highest_level   = level;
+                cache_bits      = topology_bits(((eax >> 14) & 0xfff) + 1);
+                have_cache_info = true;
+            }
+        }
+    }
+
+    /* The cache must lie between the core and the package. */
+    if (!have_cache_info || cache_bits > package_bits) {
+        cache_bits = package_bits;
+    } else if (cache_bits < smt_bits) {
+        cache_bits = smt_bits;
+    }
+
+    cpu->topology_id[CPU_TOPOLOGY_CORE]    = apic_id >> smt_bits;
+    cpu->topology_id[CPU_TOPOLOGY_CACHE]   = apic_id >> cache_bits;
+    cpu->topology_id[CPU_TOPOLOGY_PACKAGE] = apic_id >> package_bits;
+}
+
 /** Initialize SYSCALL/SYSRET MSRs. */
 static __init_text void syscall_init(void) {
     /* Disable interrupts and clear direction flag upon entry. */
@@ -270,6 +379,7 @@ __init_text void arch_cpu_early_init_percpu(cpu_t *cpu) {
     /* Detect CPU features and information. */
     x86_features_t features;
     detect_cpu_features(cpu, &features);
+    detect_cpu_topology(cpu, &features);
 
     /* If this is the boot CPU, copy features to the global features structure.
      * Otherwise, check that the feature set matches the global features. We do
@@ -295,6 +405,7 @@ __init_text void arch_cpu_early_init_percpu(cpu_t *cpu) {
             cpu_features.highest_extended != features.highest_extended ||
             cpu_features.standard_edx != features.standard_edx ||
             cpu_features.standard_ecx != features.standard_ecx ||
+            cpu_features.structured_ebx != features.structured_ebx ||
             cpu_features.extended_edx != features.extended_edx ||
             cpu_features.extended_ecx != features.extended_ecx)
         {
@@ -311,8 +422,15 @@ __init_text void arch_cpu_early_init_percpu(cpu_t *cpu) {
         cpu->arch.cpu_freq = boot_cpu.arch.cpu_freq;
     }
 
-    /* Work out the cycles per µs. */
-    cpu->arch.cycles_per_us = cpu->arch.cpu_freq / 1000000;
+    /* Work out the TSC conversion factors. The frequency is scaled down for
+     * the reverse factor so that shifting it does not overflow. */
+    cpu->arch.tsc_to_ns_cv = (1000000000ull << TSC_CV_SHIFT) / cpu->arch.cpu_freq;
+    cpu->arch.ns_to_tsc_cv = ((cpu->arch.cpu_freq / 1000) << TSC_CV_SHIFT) / 1000000;
+
+    /* Store the CPU ID for RDTSCP, so that user mode can find the right time
+     * conversion parameters in the time page. */
+    if (cpu_features.rdtscp)
+        x86_write_msr(X86_MSR_TSC_AUX, cpu->id);
 
     /* Enable PGE/OSFXSR. */
     x86_write_cr4(x86_read_cr4() | X86_CR4_PGE | X86_CR4_OSFXSR);
@@ -339,17 +457,21 @@ static kdb_status_t kdb_cmd_cpus(int argc, char **argv, kdb_filter_t *filter) {
         return KDB_SUCCESS;
     }
 
-    kdb_printf("ID   Freq (MHz) LAPIC Freq (MHz) Cache Align Model Name\n");
-    kdb_printf("==   ========== ================ =========== ==========\n");
+    kdb_printf("ID   Freq (MHz) LAPIC Freq (MHz) Cache Align Pkg  LLC  Core Model Name\n");
+    kdb_printf("==   ========== ================ =========== ===  ===  ==== ==========\n");
 
     for (size_t i = 0; i <= highest_cpu_id; i++) {
         if (!cpus[i])
             continue;
 
         kdb_printf(
-            "%-4" PRIu32 " %-10" PRIu64 " %-16" PRIu64 " %-11d %s\n",
+            "%-4" PRIu32 " %-10" PRIu64 " %-16" PRIu64 " %-11d %-4" PRIu32
+                " %-4" PRIu32 " %-4" PRIu32 " %s\n",
             cpus[i]->id, cpus[i]->arch.cpu_freq / 1000000,
             cpus[i]->arch.lapic_freq / 1000000, cpus[i]->arch.cache_alignment,
+            cpus[i]->topology_id[CPU_TOPOLOGY_PACKAGE],
+            cpus[i]->topology_id[CPU_TOPOLOGY_CACHE],
+            cpus[i]->topology_id[CPU_TOPOLOGY_CORE],
             (cpus[i]->arch.model_name[0]) ? cpus[i]->arch.model_name : "Unknown");
     }
 
@@ -38,10 +38,15 @@ typedef struct arch_cpu {
     struct thread *thread;              /**< Current thread pointer. */
 
     /** Time conversion factors. */
-    uint64_t cycles_per_us;             /**< CPU cycles per µs. */
+    uint64_t tsc_to_ns_cv;              /**< TSC to nanoseconds factor (32.32 fixed point). */
+    uint64_t ns_to_tsc_cv;              /**< Nanoseconds to TSC factor (32.32 fixed point). */
     uint64_t lapic_timer_cv;            /**< LAPIC timer conversion factor. */
     int64_t system_time_offset;         /**< Value to subtract from TSC value for system_time(). */
 
+    /** PCID allocation state. */
+    uint64_t pcid_generation;           /**< Current PCID generation. */
+    uint16_t next_pcid;                 /**< Next PCID to allocate. */
+
     /** Per-CPU CPU structures. */
     gdt_entry_t gdt[GDT_ENTRY_COUNT];   /**< Array of GDT descriptors. */
     tss_t tss;                          /**< Task State Segment (TSS). */
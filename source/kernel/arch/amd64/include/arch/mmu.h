@@ -26,16 +26,32 @@
 /** Size of TLB flush array. */
 #define INVALIDATE_ARRAY_SIZE   128
 
+/** Maximum number of pages in a range to invalidate individually. */
+#define INVALIDATE_RANGE_MAX    512
+
+/** Per-CPU PCID allocation for an MMU context. */
+typedef struct arch_mmu_pcid {
+    uint64_t generation;            /**< CPU PCID generation allocated in (0 if none). */
+    uint16_t pcid;                  /**< Allocated PCID. */
+} arch_mmu_pcid_t;
+
 /** AMD64 MMU context structure. */
 typedef struct arch_mmu_context {
     phys_ptr_t pml4;                /**< Physical address of the PML4. */
 
+    /** Per-CPU PCID allocations (NULL if PCIDs are not in use). */
+    arch_mmu_pcid_t *pcids;
+
     /**
      * Array of TLB entries to flush when unlocking context.
      *
-     * If the count becomes greater than the array size, then the entire TLB
-     * will be flushed.
+     * If the count becomes greater than the array size, then the range of
+     * addresses covering all of the entries is invalidated instead, or the
+     * entire TLB is flushed if that range is larger than INVALIDATE_RANGE_MAX
+     * pages. This is shared with all CPUs that the invalidation is sent to.
      */
     ptr_t pages_to_invalidate[INVALIDATE_ARRAY_SIZE];
     size_t invalidate_count;
+    ptr_t invalidate_start;         /**< Start of range to invalidate. */
+    ptr_t invalidate_end;           /**< End of range to invalidate (inclusive). */
 } arch_mmu_context_t;
@@ -32,3 +32,32 @@
 
 /** Mask to clear page offset and unsupported bits from a physical address. */
 #define PHYS_PAGE_MASK      0x000000fffffff000l
+
+#ifndef __ASM__
+
+#include <types.h>
+
+/**
+ * Zeroes a page using non-temporal stores. This bypasses the CPU cache, so it
+ * is used for zeroing pages in advance of them being needed, where we do not
+ * want to evict useful data from the cache.
+ *
+ * @param addr          Virtual address of the page.
+ */
+static inline void arch_page_zero_nocache(void *addr) {
+    for (uint64_t *ptr = addr; ptr < (uint64_t *)((ptr_t)addr + PAGE_SIZE); ptr += 4) {
+        __asm__ volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :: "r"(ptr), "r"(0ul)
+            : "memory");
+    }
+
+    /* Non-temporal stores are weakly ordered, make sure they are globally
+     * visible before the page is handed out. */
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+#endif /* __ASM__ */
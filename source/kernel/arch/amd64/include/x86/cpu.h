@@ -48,6 +48,20 @@
 #define X86_CR4_OSXMMEXCPT      (1<<10)     /**< OS Support for Unmasked SIMD FPU Exceptions. */
 #define X86_CR4_VMXE            (1<<13)     /**< VMX-Enable Bit. */
 #define X86_CR4_SMXE            (1<<14)     /**< SMX-Enable Bit. */
+#define X86_CR4_PCIDE           (1<<17)     /**< PCID Enable. */
+
+/** Fields in the CR3 Control Register (when CR4.PCIDE is set). */
+#define X86_CR3_PCID_MASK       0xfffull    /**< Process-Context Identifier. */
+#define X86_CR3_NOFLUSH         (1ull<<63)  /**< Do not flush TLB entries for the PCID on load. */
+
+/** Maximum PCID value. */
+#define X86_PCID_MAX            0xfff
+
+/** INVPCID invalidation types. */
+#define X86_INVPCID_ADDRESS     0           /**< Individual-address invalidation. */
+#define X86_INVPCID_SINGLE      1           /**< Single-context invalidation. */
+#define X86_INVPCID_ALL_GLOBAL  2           /**< All-context invalidation, including globals. */
+#define X86_INVPCID_ALL         3           /**< All-context invalidation, retaining globals. */
 
 /** Flags in the debug status register (DR6). */
 #define X86_DR6_B0              (1<<0)      /**< Breakpoint 0 condition detected. */
@@ -97,6 +111,7 @@
 #define X86_MSR_FS_BASE         0xc0000100  /**< FS segment base register. */
 #define X86_MSR_GS_BASE         0xc0000101  /**< GS segment base register. */
 #define X86_MSR_KERNEL_GS_BASE  0xc0000102  /**< GS base to switch to with SWAPGS. */
+#define X86_MSR_TSC_AUX         0xc0000103  /**< TSC auxiliary value (returned by RDTSCP). */
 
 /** EFER MSR flags. */
 #define X86_EFER_SCE            (1<<0)      /**< System Call Enable. */
@@ -112,11 +127,16 @@
 #define X86_CPUID_CACHE_PARMS   0x00000004  /**< Deterministic Cache Parameters. */
 #define X86_CPUID_MONITOR_MWAIT 0x00000005  /**< MONITOR/MWAIT Parameters. */
 #define X86_CPUID_DTS_POWER     0x00000006  /**< Digital Thermal Sensor and Power Management Parameters. */
+#define X86_CPUID_STRUCT_FEATURE 0x00000007 /**< Structured Extended Feature Flags. */
 #define X86_CPUID_DCA           0x00000009  /**< Direct Cache Access (DCA) Parameters. */
 #define X86_CPUID_PERFMON       0x0000000a  /**< Architectural Performance Monitor Features. */
 #define X86_CPUID_X2APIC        0x0000000b  /**< x2APIC Features/Processor Topology. */
 #define X86_CPUID_XSAVE         0x0000000d  /**< XSAVE Features. */
 
+/** x2APIC topology leaf level types. */
+#define X86_TOPOLOGY_LEVEL_SMT  1           /**< SMT (logical processors in a core). */
+#define X86_TOPOLOGY_LEVEL_CORE 2           /**< Cores in a package. */
+
 /** Extended CPUID function definitions. */
 #define X86_CPUID_EXT_MAX       0x80000000  /**< Largest Extended Function. */
 #define X86_CPUID_EXT_FEATURE   0x80000001  /**< Extended Feature Bits. */
@@ -212,6 +232,25 @@ typedef struct x86_features {
         uint32_t standard_ecx;
     };
 
+    /** Structured Extended Features (EBX). */
+    union {
+        struct {
+            unsigned fsgsbase : 1;
+            unsigned tsc_adjust : 1;
+            unsigned sgx : 1;
+            unsigned bmi1 : 1;
+            unsigned hle : 1;
+            unsigned avx2 : 1;
+            unsigned : 1;
+            unsigned smep : 1;
+            unsigned bmi2 : 1;
+            unsigned erms : 1;
+            unsigned invpcid : 1;
+            unsigned : 21;
+        };
+        uint32_t structured_ebx;
+    };
+
     /** Extended CPUID Features (EDX). */
     union {
         struct {
@@ -219,7 +258,10 @@ typedef struct x86_features {
             unsigned syscall : 1;
             unsigned : 8;
             unsigned xd : 1;
-            unsigned : 8;
+            unsigned : 5;
+            unsigned pdpe1gb : 1;
+            unsigned rdtscp : 1;
+            unsigned : 1;
             unsigned lmode : 1;
         };
         uint32_t extended_edx;
@@ -369,12 +411,35 @@ static inline void x86_cpuid(uint32_t level, uint32_t *a, uint32_t *b, uint32_t
     __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "0"(level));
 }
 
+/** Execute the CPUID instruction with a sub-leaf.
+ * @param level         CPUID level.
+ * @param subleaf       Sub-leaf index (passed in ECX).
+ * @param a             Where to store EAX value.
+ * @param b             Where to store EBX value.
+ * @param c             Where to store ECX value.
+ * @param d             Where to store EDX value. */
+static inline void x86_cpuid_subleaf(
+    uint32_t level, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c,
+    uint32_t *d)
+{
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "0"(level), "2"(subleaf));
+}
+
 /** Invalidate a TLB entry.
  * @param addr          Address to invalidate. */
 static inline void x86_invlpg(ptr_t addr) {
     __asm__ volatile("invlpg (%0)" :: "r"(addr));
 }
 
+/** Invalidate TLB entries by PCID.
+ * @param type          Type of invalidation (X86_INVPCID_*).
+ * @param pcid          PCID to invalidate for (if applicable to type).
+ * @param addr          Address to invalidate (if applicable to type). */
+static inline void x86_invpcid(unsigned long type, uint16_t pcid, ptr_t addr) {
+    struct { uint64_t pcid; uint64_t addr; } desc = { pcid, addr };
+    __asm__ volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
 extern uint64_t calculate_frequency(uint64_t (*func)());
 
 #endif /* __ASM__ */
@@ -21,6 +21,11 @@
 
 #pragma once
 
+#include <types.h>
+
+/** Number of fractional bits in TSC conversion factors. */
+#define TSC_CV_SHIFT    32
+
 /** Read the Time Stamp Counter.
  * @return              Value of the TSC. */
 static inline uint64_t x86_rdtsc(void) {
@@ -30,5 +35,23 @@ static inline uint64_t x86_rdtsc(void) {
     return ((uint64_t)high << 32) | low;
 }
 
+/**
+ * Converts between TSC ticks and nanoseconds using a 32.32 fixed point
+ * conversion factor. The multiplication uses a 128-bit intermediate result,
+ * so the full 64-bit range of the input value is usable.
+ *
+ * @param value         Value to convert.
+ * @param cv            Conversion factor.
+ *
+ * @return              Converted value.
+ */
+static inline uint64_t x86_tsc_convert(uint64_t value, uint64_t cv) {
+    uint64_t low, high;
+
+    __asm__("mulq %3" : "=a"(low), "=d"(high) : "a"(value), "rm"(cv) : "cc");
+    __asm__("shrdq %2, %1, %0" : "+r"(low) : "r"(high), "i"(TSC_CV_SHIFT) : "cc");
+    return low;
+}
+
 extern void tsc_init_target(void);
 extern void tsc_init_source(void);
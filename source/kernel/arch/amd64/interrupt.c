@@ -295,9 +295,19 @@ void interrupt_handler(frame_t *frame) {
         thread_at_kernel_entry();
     }
 
+    /* Exceptions are handled in the context of the thread that caused them,
+     * anything else is an interrupt. */
+    bool irq = frame->num >= 32;
+
     /* Call the handler. */
+    if (irq)
+        curr_cpu->interrupt_depth++;
+
     interrupt_table[frame->num](frame);
 
+    if (irq)
+        curr_cpu->interrupt_depth--;
+
     /* Preempt if required. */
     if (curr_cpu->should_preempt)
         sched_preempt();
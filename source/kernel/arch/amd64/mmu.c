@@ -18,9 +18,26 @@
  * @file
  * @brief               AMD64 MMU context implementation.
  *
- * TODO:
- *  - Proper large page support, and 1GB pages for the physical map.
- *  - PCID (ASID) support.
+ * The physical map area is mapped using 1GB pages where supported, or 2MB
+ * pages otherwise. Contexts can also contain 2MB large page mappings created
+ * with mmu_context_map_large(). If part of a large page is unmapped or has its
+ * access flags changed, it is split into a page table first.
+ *
+ * Where supported, user MMU contexts are tagged with a PCID so that switching
+ * address space does not flush the TLB. PCIDs are allocated to contexts
+ * separately on each CPU, from a per-CPU counter. When the counter runs out,
+ * the CPU's generation number is incremented, which invalidates all existing
+ * allocations on that CPU, and the whole TLB is flushed. The kernel context
+ * always uses PCID 0, and all of its mappings are global.
+ *
+ * A CPU which is not currently using a context may still have TLB entries for
+ * it tagged with its PCID. When entries are invalidated from a context, the
+ * context's PCID allocation is dropped on all other CPUs, so that they will
+ * flush it when they next switch to it.
+ *
+ * Remote invalidations are batched up while a context is locked, and sent as
+ * a single multicast call to the CPUs that have the context loaded when it is
+ * unlocked.
  */
 
 #include <arch/barrier.h>
@@ -53,6 +70,10 @@ KBOOT_LOAD(0, 0x1000000, 0x200000, KERNEL_KMEM_BASE, KERNEL_KMEM_SIZE);
 /* Map in 8GB initially, arch_mmu_init() will map all available RAM. */
 KBOOT_MAPPING(KERNEL_PMAP_BASE, 0, 0x200000000);
 
+/** Masks for the physical address in large (2MB) and huge (1GB) page entries. */
+#define LARGE_PAGE_PHYS_MASK    0x000000ffffe00000ul
+#define HUGE_PAGE_PHYS_MASK     0x000000ffc0000000ul
+
 /** Table mapping memory types to page table flags. */
 static uint64_t memory_type_flags[] = {
     /** Normal Memory - Standard behaviour. */
@@ -74,6 +95,9 @@ static uint64_t memory_type_flags[] = {
     [MEMORY_TYPE_WB] = 0,
 };
 
+/** Whether PCIDs are in use. */
+static bool pcid_enabled;
+
 /** Check if a context is the kernel context. */
 static inline bool is_kernel_context(mmu_context_t *ctx) {
     return ctx == &kernel_mmu_context;
@@ -164,14 +188,14 @@ static phys_ptr_t alloc_structure(unsigned mmflag) {
     }
 }
 
-/** Get the page directory containing a virtual address.
+/** Get the page directory pointer table containing a virtual address.
  * @param ctx           Context to get from.
  * @param virt          Virtual address.
  * @param alloc         Whether new entries should be allocated if non-existant.
  * @param mmflag        Allocation behaviour flags.
- * @return              Pointer to mapped page directory, NULL if not found or
- *                      on allocation failure. */
-static uint64_t *get_pdir(mmu_context_t *ctx, ptr_t virt, bool alloc, unsigned mmflag) {
+ * @return              Pointer to mapped PDP, NULL if not found or on
+ *                      allocation failure. */
+static uint64_t *get_pdp(mmu_context_t *ctx, ptr_t virt, bool alloc, unsigned mmflag) {
     /* Get the virtual address of the PML4. */
     uint64_t *pml4 = map_structure(ctx->arch.pml4);
 
@@ -192,7 +216,21 @@ static uint64_t *get_pdir(mmu_context_t *ctx, ptr_t virt, bool alloc, unsigned m
     }
 
     /* Get the PDP from the PML4. */
-    uint64_t *pdp = map_structure(pml4[pml4e] & PHYS_PAGE_MASK);
+    return map_structure(pml4[pml4e] & PHYS_PAGE_MASK);
+}
+
+/** Get the page directory containing a virtual address.
+ * @param ctx           Context to get from.
+ * @param virt          Virtual address.
+ * @param alloc         Whether new entries should be allocated if non-existant.
+ * @param mmflag        Allocation behaviour flags.
+ * @return              Pointer to mapped page directory, NULL if not found or
+ *                      on allocation failure. */
+static uint64_t *get_pdir(mmu_context_t *ctx, ptr_t virt, bool alloc, unsigned mmflag) {
+    /* Get hold of the PDP. */
+    uint64_t *pdp = get_pdp(ctx, virt, alloc, mmflag);
+    if (!pdp)
+        return NULL;
 
     /* Get the page directory number. A page directory covers 1GB. */
     unsigned pdpe = (virt % 0x8000000000) / 0x40000000;
@@ -210,7 +248,8 @@ static uint64_t *get_pdir(mmu_context_t *ctx, ptr_t virt, bool alloc, unsigned m
         }
     }
 
-    /* Return the page directory address. */
+    /* If this function is being used it should not be a huge page. */
+    assert(!(pdp[pdpe] & X86_PTE_LARGE));
     return map_structure(pdp[pdpe] & PHYS_PAGE_MASK);
 }
 
@@ -248,14 +287,63 @@ static uint64_t *get_ptbl(mmu_context_t *ctx, ptr_t virt, bool alloc, unsigned m
     return map_structure(pdir[pde] & PHYS_PAGE_MASK);
 }
 
+/**
+ * Splits a large page mapping into a page table containing the equivalent
+ * small page mappings. The new entries map the same pages with the same flags
+ * as the large page, so existing TLB entries for the large page remain valid
+ * until the caller modifies an entry and invalidates it.
+ *
+ * @param ctx           Context to split in.
+ * @param pdir          Page directory containing the large page.
+ * @param pde           Index of the large page in the page directory.
+ *
+ * @return              Pointer to mapped page table.
+ */
+static uint64_t *split_large_page(mmu_context_t *ctx, uint64_t *pdir, unsigned pde) {
+    /* Callers cannot fail, so we must wait for memory. */
+    phys_ptr_t table = alloc_structure(MM_KERNEL);
+    uint64_t *ptbl   = map_structure(table);
+
+    /* Swap atomically so that accessed/dirty bit updates on the large page
+     * carry over to the new entries. */
+    while (true) {
+        uint64_t entry = pdir[pde];
+        assert(entry & X86_PTE_LARGE);
+
+        phys_ptr_t phys = entry & LARGE_PAGE_PHYS_MASK;
+        uint64_t flags  = entry & ~(LARGE_PAGE_PHYS_MASK | X86_PTE_LARGE);
+
+        for (unsigned i = 0; i < 512; i++)
+            ptbl[i] = (phys + (i * PAGE_SIZE)) | flags;
+
+        if (test_and_set_pte(&pdir[pde], entry, calc_table_pte(ctx, table)))
+            break;
+    }
+
+    return ptbl;
+}
+
 /** Invalidate a TLB entry for an MMU context.
  * @param ctx           Context to invalidate for.
  * @param virt          Virtual address to invalidate.
  * @param shared        Whether the mapping was shared between multiple CPUs. */
 static void invalidate_page(mmu_context_t *ctx, ptr_t virt, bool shared) {
-    /* Invalidate on the current CPU if we're using this context. */
-    if (is_current_context(ctx))
+    if (is_current_context(ctx)) {
+        /* Invalidate on the current CPU if we're using this context. */
         x86_invlpg(virt);
+    } else if (pcid_enabled) {
+        /* We may still have entries for the context tagged with its PCID.
+         * Invalidate the address in that PCID if we can, otherwise drop the
+         * PCID so that it gets flushed next time the context is loaded. */
+        arch_mmu_pcid_t *pcid = &ctx->arch.pcids[curr_cpu->id];
+        if (pcid->generation == curr_cpu->arch.pcid_generation) {
+            if (cpu_features.invpcid) {
+                x86_invpcid(X86_INVPCID_ADDRESS, pcid->pcid, virt);
+            } else {
+                pcid->generation = 0;
+            }
+        }
+    }
 
     if (shared) {
         /* Record the address to invalidate on other CPUs when the context is
@@ -263,6 +351,11 @@ static void invalidate_page(mmu_context_t *ctx, ptr_t virt, bool shared) {
         if (ctx->arch.invalidate_count < INVALIDATE_ARRAY_SIZE)
             ctx->arch.pages_to_invalidate[ctx->arch.invalidate_count] = virt;
 
+        if (!ctx->arch.invalidate_count || virt < ctx->arch.invalidate_start)
+            ctx->arch.invalidate_start = virt;
+        if (!ctx->arch.invalidate_count || virt > ctx->arch.invalidate_end)
+            ctx->arch.invalidate_end = virt;
+
         /* Increment the count regardless. If it is found to be greater than the
          * array size when unlocking, the entire TLB will be flushed. */
         ctx->arch.invalidate_count++;
@@ -275,10 +368,19 @@ static void invalidate_page(mmu_context_t *ctx, ptr_t virt, bool shared) {
  * @return              Status code describing result of the operation. */
 static status_t amd64_mmu_init(mmu_context_t *ctx, unsigned mmflag) {
     ctx->arch.invalidate_count = 0;
+    ctx->arch.pcids            = NULL;
+
+    if (pcid_enabled) {
+        ctx->arch.pcids = kcalloc(highest_cpu_id + 1, sizeof(*ctx->arch.pcids), mmflag);
+        if (!ctx->arch.pcids)
+            return STATUS_NO_MEMORY;
+    }
 
     ctx->arch.pml4 = alloc_structure(mmflag);
-    if (!ctx->arch.pml4)
+    if (!ctx->arch.pml4) {
+        kfree(ctx->arch.pcids);
         return STATUS_NO_MEMORY;
+    }
 
     /* Get the kernel mappings into the new PML4. */
     uint64_t *kpml4 = map_structure(kernel_mmu_context.arch.pml4);
@@ -305,11 +407,10 @@ static void amd64_mmu_destroy(mmu_context_t *ctx) {
 
             uint64_t *pdir = map_structure(pdp[j] & PHYS_PAGE_MASK);
             for (unsigned k = 0; k < 512; k++) {
-                if (!(pdir[k] & X86_PTE_PRESENT))
+                /* Large pages are not owned by us. */
+                if (!(pdir[k] & X86_PTE_PRESENT) || pdir[k] & X86_PTE_LARGE)
                     continue;
 
-                assert(!(pdir[k] & X86_PTE_LARGE));
-
                 phys_free(pdir[k] & PHYS_PAGE_MASK, PAGE_SIZE);
             }
 
@@ -320,6 +421,7 @@ static void amd64_mmu_destroy(mmu_context_t *ctx) {
     }
 
     phys_free(ctx->arch.pml4, PAGE_SIZE);
+    kfree(ctx->arch.pcids);
 }
 
 /** Map a page in a context.
@@ -348,6 +450,71 @@ static status_t amd64_mmu_map(
     return STATUS_SUCCESS;
 }
 
+/** Map a large page in a context.
+ * @param ctx           Context to map in.
+ * @param virt          Virtual address to map.
+ * @param phys          Physical address to map to.
+ * @param access        Mapping access flags.
+ * @param mmflag        Allocation behaviour flags.
+ * @return              Status code describing result of the operation. */
+static status_t amd64_mmu_map_large(
+    mmu_context_t *ctx, ptr_t virt, phys_ptr_t phys, uint32_t access,
+    unsigned mmflag)
+{
+    /* Find the page directory for the entry. */
+    uint64_t *pdir = get_pdir(ctx, virt, true, mmflag);
+    if (!pdir)
+        return STATUS_NO_MEMORY;
+
+    unsigned pde = (virt % 0x40000000) / LARGE_PAGE_SIZE;
+    if (pdir[pde] & X86_PTE_PRESENT) {
+        if (unlikely(pdir[pde] & X86_PTE_LARGE))
+            fatal("Mapping %p which is already mapped", virt);
+
+        /* There is a page table covering the range. It may still contain
+         * mappings, and even if not, freeing it would require a TLB shootdown
+         * first. Let the caller map it with small pages instead. */
+        return STATUS_IN_USE;
+    }
+
+    set_pte(&pdir[pde], calc_page_pte(ctx, phys, access) | X86_PTE_LARGE);
+    return STATUS_SUCCESS;
+}
+
+/** Check whether a large page could be mapped in a context.
+ * @param ctx           Context to check.
+ * @param virt          Virtual address to check.
+ * @return              Whether a large page could be mapped. */
+static bool amd64_mmu_can_map_large(mmu_context_t *ctx, ptr_t virt) {
+    /* If there is no page directory yet, one will be allocated. */
+    uint64_t *pdir = get_pdir(ctx, virt, false, 0);
+    if (!pdir)
+        return true;
+
+    unsigned pde = (virt % 0x40000000) / LARGE_PAGE_SIZE;
+    return !(pdir[pde] & X86_PTE_PRESENT);
+}
+
+/** Atomically change the access flags on a page table entry.
+ * @param pte           Entry to modify.
+ * @param access        New access flags.
+ * @return              Previous value of the entry. */
+static uint64_t remap_pte(uint64_t *pte, uint32_t access) {
+    /* Do this atomically to avoid losing accessed or dirty bit modifications. */
+    while (true) {
+        uint64_t prev = *pte;
+
+        uint64_t entry = (prev & ~X86_PTE_PROTECT_MASK);
+        if (access & VM_ACCESS_WRITE)
+            entry |= X86_PTE_WRITE;
+        if (!(access & VM_ACCESS_EXECUTE) && cpu_features.xd)
+            entry |= X86_PTE_NOEXEC;
+
+        if (test_and_set_pte(pte, prev, entry))
+            return prev;
+    }
+}
+
 /** Remap a range with different access flags.
  * @param ctx           Context to modify.
  * @param virt          Start of range to update.
@@ -361,32 +528,38 @@ static void amd64_mmu_remap(mmu_context_t *ctx, ptr_t virt, size_t size, uint32_
         /* If this is the first address or we have crossed a 2MB boundary we
          * must look up a new page table. */
         if (!ptbl || !(virt % 0x200000)) {
-            ptbl = get_ptbl(ctx, virt, false, 0);
-            if (!ptbl) {
+            uint64_t *pdir = get_pdir(ctx, virt, false, 0);
+            unsigned pde   = (virt % 0x40000000) / 0x200000;
+            if (!pdir || !(pdir[pde] & X86_PTE_PRESENT)) {
                 /* No page table here, skip to the next one. */
                 virt = (virt - (virt % 0x200000)) + 0x200000;
+                ptbl = NULL;
                 continue;
             }
+
+            if (pdir[pde] & X86_PTE_LARGE) {
+                /* If the whole large page is covered, update it in place,
+                 * otherwise we must split it. */
+                if (!(virt % 0x200000) && end - virt >= 0x200000 - 1) {
+                    uint64_t prev = remap_pte(&pdir[pde], access);
+                    if (prev & X86_PTE_ACCESSED)
+                        invalidate_page(ctx, virt, true);
+
+                    virt += 0x200000;
+                    ptbl = NULL;
+                    continue;
+                }
+
+                ptbl = split_large_page(ctx, pdir, pde);
+            } else {
+                ptbl = map_structure(pdir[pde] & PHYS_PAGE_MASK);
+            }
         }
 
         /* If the mapping doesn't exist we don't need to do anything. */
         unsigned pte = (virt % 0x200000) / PAGE_SIZE;
         if (ptbl[pte] & X86_PTE_PRESENT) {
-            /* Update the entry. Do this atomically to avoid losing accessed or
-             * dirty bit modifications. */
-            uint64_t prev;
-            while (true) {
-                prev = ptbl[pte];
-
-                uint64_t entry = (prev & X86_PTE_PROTECT_MASK);
-                if (access & VM_ACCESS_WRITE)
-                    entry |= X86_PTE_WRITE;
-                if (!(access & VM_ACCESS_EXECUTE) && cpu_features.xd)
-                    entry |= X86_PTE_NOEXEC;
-
-                if (test_and_set_pte(&ptbl[pte], prev, entry))
-                    break;
-            }
+            uint64_t prev = remap_pte(&ptbl[pte], access);
 
             /* Clear TLB entries if necessary (see note in unmap()). */
             if (prev & X86_PTE_ACCESSED)
@@ -407,10 +580,19 @@ static void amd64_mmu_remap(mmu_context_t *ctx, ptr_t virt, size_t size, uint32_
  * @return              Whether a page was mapped at the virtual address. */
 static bool amd64_mmu_unmap(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_page) {
     /* Find the page table for the entry. */
-    uint64_t *ptbl = get_ptbl(ctx, virt, false, 0);
-    if (!ptbl)
+    uint64_t *pdir = get_pdir(ctx, virt, false, 0);
+    if (!pdir)
+        return false;
+
+    unsigned pde = (virt % 0x40000000) / 0x200000;
+    if (!(pdir[pde] & X86_PTE_PRESENT))
         return false;
 
+    /* If this is part of a large page, only unmap the requested page. */
+    uint64_t *ptbl = (pdir[pde] & X86_PTE_LARGE)
+        ? split_large_page(ctx, pdir, pde)
+        : map_structure(pdir[pde] & PHYS_PAGE_MASK);
+
     /* If the mapping doesn't exist we don't need to do anything. */
     unsigned pte = (virt % 0x200000) / PAGE_SIZE;
     if (!(ptbl[pte] & X86_PTE_PRESENT))
@@ -437,6 +619,44 @@ static bool amd64_mmu_unmap(mmu_context_t *ctx, ptr_t virt, bool shared, page_t
     return true;
 }
 
+/** Unmap a large page in a context.
+ * @param ctx           Context to unmap in.
+ * @param virt          Virtual address to unmap.
+ * @param shared        Whether the mapping was shared across multiple CPUs.
+ * @param _page         Where to pointer to first page that was unmapped.
+ * @return              Whether a large page was mapped at the address. */
+static bool amd64_mmu_unmap_large(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_page) {
+    uint64_t *pdir = get_pdir(ctx, virt, false, 0);
+    if (!pdir)
+        return false;
+
+    unsigned pde = (virt % 0x40000000) / LARGE_PAGE_SIZE;
+    if ((pdir[pde] & (X86_PTE_PRESENT | X86_PTE_LARGE)) != (X86_PTE_PRESENT | X86_PTE_LARGE))
+        return false;
+
+    uint64_t entry  = clear_pte(&pdir[pde]);
+    phys_ptr_t phys = entry & LARGE_PAGE_PHYS_MASK;
+
+    /* We don't know which parts were written, so mark them all. */
+    if (entry & X86_PTE_DIRTY) {
+        for (phys_ptr_t i = 0; i < LARGE_PAGE_SIZE; i += PAGE_SIZE) {
+            page_t *page = page_lookup(phys + i);
+            if (page)
+                page->modified = true;
+        }
+    }
+
+    /* Invalidating any address within the page invalidates the whole TLB
+     * entry for it. */
+    if (entry & X86_PTE_ACCESSED)
+        invalidate_page(ctx, virt, shared);
+
+    if (_page)
+        *_page = page_lookup(phys);
+
+    return true;
+}
+
 /** Query details about a mapping.
  * @param ctx           Context to query.
  * @param virt          Virtual address to query.
@@ -448,26 +668,32 @@ static bool amd64_mmu_query(mmu_context_t *ctx, ptr_t virt, phys_ptr_t *_phys, u
     phys_ptr_t phys;
     bool ret = false;
 
-    /* Find the page directory for the entry. */
-    uint64_t *pdir = get_pdir(ctx, virt, false, 0);
-    if (pdir) {
-        /* Get the page table number. A page table covers 2MB. */
-        unsigned pde = (virt % 0x40000000) / 0x200000;
-        if (pdir[pde] & X86_PTE_PRESENT) {
-            /* Handle large pages: parts of the kernel address space may be
-             * mapped with large pages, so we must be able to handle queries on
-             * these parts. */
-            if (pdir[pde] & X86_PTE_LARGE) {
-                entry = pdir[pde];
-                phys = (pdir[pde] & 0x000000fffff00000ul) + (virt % 0x200000);
-                ret = true;
-            } else {
-                uint64_t *ptbl = map_structure(pdir[pde] & PHYS_PAGE_MASK);
-                unsigned pte = (virt % 0x200000) / PAGE_SIZE;
-                if (ptbl[pte] & X86_PTE_PRESENT) {
-                    entry = ptbl[pte];
-                    phys = ptbl[pte] & PHYS_PAGE_MASK;
+    /* Find the PDP for the entry. Large and huge pages are handled by
+     * returning the address of the page within them. */
+    uint64_t *pdp = get_pdp(ctx, virt, false, 0);
+    unsigned pdpe = (virt % 0x8000000000) / 0x40000000;
+    if (pdp && pdp[pdpe] & X86_PTE_PRESENT) {
+        if (pdp[pdpe] & X86_PTE_LARGE) {
+            entry = pdp[pdpe];
+            phys = (entry & HUGE_PAGE_PHYS_MASK) + (virt % 0x40000000);
+            ret = true;
+        } else {
+            /* Get the page table number. A page table covers 2MB. */
+            uint64_t *pdir = map_structure(pdp[pdpe] & PHYS_PAGE_MASK);
+            unsigned pde = (virt % 0x40000000) / 0x200000;
+            if (pdir[pde] & X86_PTE_PRESENT) {
+                if (pdir[pde] & X86_PTE_LARGE) {
+                    entry = pdir[pde];
+                    phys = (entry & LARGE_PAGE_PHYS_MASK) + (virt % 0x200000);
                     ret = true;
+                } else {
+                    uint64_t *ptbl = map_structure(pdir[pde] & PHYS_PAGE_MASK);
+                    unsigned pte = (virt % 0x200000) / PAGE_SIZE;
+                    if (ptbl[pte] & X86_PTE_PRESENT) {
+                        entry = ptbl[pte];
+                        phys = ptbl[pte] & PHYS_PAGE_MASK;
+                        ret = true;
+                    }
                 }
             }
         }
@@ -493,20 +719,33 @@ static status_t tlb_invalidate_func(void *_ctx) {
      * switched address space between the modifying CPU sending the interrupt
      * and us receiving it. */
     if (is_current_context(ctx)) {
+        size_t range_pages = ((ctx->arch.invalidate_end - ctx->arch.invalidate_start) / PAGE_SIZE) + 1;
+
         /* If the number of pages to invalidate is larger than the size of the
-         * address array, perform a complete TLB flush. */
-        if (ctx->arch.invalidate_count > INVALIDATE_ARRAY_SIZE) {
-            /* For the kernel context, we must disable PGE and reenable it to
-             * perform a complete TLB flush. */
+         * address array, invalidate the whole range that they cover, unless
+         * that is large enough that a complete TLB flush is cheaper. */
+        if (ctx->arch.invalidate_count <= INVALIDATE_ARRAY_SIZE) {
+            for (size_t i = 0; i < ctx->arch.invalidate_count; i++)
+                x86_invlpg(ctx->arch.pages_to_invalidate[i]);
+        } else if (range_pages <= INVALIDATE_RANGE_MAX) {
+            for (size_t i = 0; i < range_pages; i++)
+                x86_invlpg(ctx->arch.invalidate_start + (i * PAGE_SIZE));
+        } else {
+            /* For the kernel context, global entries must be flushed too. If
+             * we can't use INVPCID, we must disable PGE and reenable it. */
             if (is_kernel_context(ctx)) {
-                x86_write_cr4(x86_read_cr4() & ~X86_CR4_PGE);
-                x86_write_cr4(x86_read_cr4() | X86_CR4_PGE);
+                if (cpu_features.invpcid) {
+                    x86_invpcid(X86_INVPCID_ALL_GLOBAL, 0, 0);
+                } else {
+                    x86_write_cr4(x86_read_cr4() & ~X86_CR4_PGE);
+                    x86_write_cr4(x86_read_cr4() | X86_CR4_PGE);
+                }
+            } else if (pcid_enabled && cpu_features.invpcid) {
+                x86_invpcid(X86_INVPCID_SINGLE, x86_read_cr3() & X86_CR3_PCID_MASK, 0);
             } else {
+                /* With PCIDs enabled, this flushes the current PCID. */
                 x86_write_cr3(x86_read_cr3());
             }
-        } else {
-            for (size_t i = 0; i < ctx->arch.invalidate_count; i++)
-                x86_invlpg(ctx->arch.pages_to_invalidate[i]);
         }
     }
 
@@ -523,20 +762,26 @@ static void amd64_mmu_flush(mmu_context_t *ctx) {
     }
 
     /* If this is the kernel context, perform changes on all other CPUs, else
-     * perform it on each CPU using the map. */
+     * perform it on each CPU using the context. */
     if (is_kernel_context(ctx)) {
         smp_call_broadcast(tlb_invalidate_func, ctx, 0);
     } else {
-        /* TODO: Multicast. */
-        list_foreach(&running_cpus, iter) {
-            cpu_t *cpu = list_entry(iter, cpu_t, header);
-            if (cpu == curr_cpu || !cpu->aspace || ctx != cpu->aspace->mmu)
-                continue;
+        /* Drop the context's PCID on other CPUs so it is flushed when they
+         * next load the context. This must be done before checking which CPUs
+         * are currently using the context: this pairs with the barrier in
+         * amd64_mmu_load() to ensure that either we see that a CPU is using the
+         * context and invalidate the entries on it, or it sees that its PCID
+         * has been dropped. */
+        if (pcid_enabled) {
+            for (cpu_id_t i = 0; i <= highest_cpu_id; i++) {
+                if (i != curr_cpu->id)
+                    ctx->arch.pcids[i].generation = 0;
+            }
 
-            /* CPU is using this address space. */
-            if (smp_call_single(cpu->id, tlb_invalidate_func, ctx, 0) != STATUS_SUCCESS)
-                fatal("Could not perform remote TLB invalidation");
+            memory_barrier();
         }
+
+        smp_call_multicast(ctx->cpus, tlb_invalidate_func, ctx, 0);
     }
 
     ctx->arch.invalidate_count = 0;
@@ -545,19 +790,59 @@ static void amd64_mmu_flush(mmu_context_t *ctx) {
 /** Switch to another MMU context.
  * @param ctx           Context to switch to. */
 static void amd64_mmu_load(mmu_context_t *ctx) {
-    x86_write_cr3(ctx->arch.pml4);
+    /* The kernel context only has global mappings under PCID 0. */
+    if (!pcid_enabled || is_kernel_context(ctx)) {
+        x86_write_cr3(ctx->arch.pml4);
+        return;
+    }
+
+    arch_cpu_t *cpu = &curr_cpu->arch;
+    arch_mmu_pcid_t *pcid = &ctx->arch.pcids[curr_cpu->id];
+
+    /* Pairs with the barrier in amd64_mmu_flush(). This CPU has already been
+     * marked as using the context by mmu_context_load(). */
+    memory_barrier();
+
+    if (pcid->generation == cpu->pcid_generation) {
+        /* TLB entries tagged with our PCID are still valid. */
+        x86_write_cr3(ctx->arch.pml4 | pcid->pcid | X86_CR3_NOFLUSH);
+    } else {
+        /* Start a new generation if we've run out of PCIDs. Nothing allocated
+         * in the previous generation can be used again, so flush everything
+         * apart from global (kernel) entries. */
+        if (cpu->next_pcid > X86_PCID_MAX) {
+            cpu->pcid_generation++;
+            cpu->next_pcid = 1;
+
+            if (cpu_features.invpcid) {
+                x86_invpcid(X86_INVPCID_ALL, 0, 0);
+            } else {
+                x86_write_cr4(x86_read_cr4() & ~X86_CR4_PGE);
+                x86_write_cr4(x86_read_cr4() | X86_CR4_PGE);
+            }
+        }
+
+        pcid->pcid       = cpu->next_pcid++;
+        pcid->generation = cpu->pcid_generation;
+
+        /* Flush anything left over for the PCID while loading. */
+        x86_write_cr3(ctx->arch.pml4 | pcid->pcid);
+    }
 }
 
 /** AMD64 MMU operations. */
 static mmu_ops_t amd64_mmu_ops = {
-    .init    = amd64_mmu_init,
-    .destroy = amd64_mmu_destroy,
-    .map     = amd64_mmu_map,
-    .remap   = amd64_mmu_remap,
-    .unmap   = amd64_mmu_unmap,
-    .query   = amd64_mmu_query,
-    .flush   = amd64_mmu_flush,
-    .load    = amd64_mmu_load,
+    .init          = amd64_mmu_init,
+    .destroy       = amd64_mmu_destroy,
+    .map           = amd64_mmu_map,
+    .map_large     = amd64_mmu_map_large,
+    .can_map_large = amd64_mmu_can_map_large,
+    .remap         = amd64_mmu_remap,
+    .unmap         = amd64_mmu_unmap,
+    .unmap_large   = amd64_mmu_unmap_large,
+    .query         = amd64_mmu_query,
+    .flush         = amd64_mmu_flush,
+    .load          = amd64_mmu_load,
 };
 
 static void map_kernel(const char *name, ptr_t start, ptr_t end, uint32_t access) {
@@ -629,12 +914,21 @@ __init_text void arch_mmu_init(void) {
     highest_phys = round_up(max(0x200000000ul, highest_phys), 0x40000000ul);
     kprintf(LOG_DEBUG, "mmu: mapping physical memory up to 0x%" PRIxPHYS "\n", highest_phys);
 
-    /* Create the physical map area. */
+    /* Create the physical map area. Use 1GB pages if we can, since phys_map()
+     * is used heavily and this greatly reduces TLB usage for it. */
     for (phys_ptr_t i = 0; i < highest_phys; i += 0x40000000) {
-        uint64_t *pdir = get_pdir(&kernel_mmu_context, i + KERNEL_PMAP_BASE, true, MM_BOOT);
-        for (phys_ptr_t j = 0; j < 0x40000000; j += LARGE_PAGE_SIZE) {
-            pdir[j / LARGE_PAGE_SIZE]
-                = (i + j) | X86_PTE_PRESENT | X86_PTE_WRITE | X86_PTE_GLOBAL | X86_PTE_LARGE;
+        ptr_t virt = i + KERNEL_PMAP_BASE;
+
+        if (cpu_features.pdpe1gb) {
+            uint64_t *pdp = get_pdp(&kernel_mmu_context, virt, true, MM_BOOT);
+            pdp[(virt % 0x8000000000) / 0x40000000]
+                = i | X86_PTE_PRESENT | X86_PTE_WRITE | X86_PTE_GLOBAL | X86_PTE_LARGE;
+        } else {
+            uint64_t *pdir = get_pdir(&kernel_mmu_context, virt, true, MM_BOOT);
+            for (phys_ptr_t j = 0; j < 0x40000000; j += LARGE_PAGE_SIZE) {
+                pdir[j / LARGE_PAGE_SIZE]
+                    = (i + j) | X86_PTE_PRESENT | X86_PTE_WRITE | X86_PTE_GLOBAL | X86_PTE_LARGE;
+            }
         }
     }
 
@@ -658,4 +952,14 @@ __init_text void arch_mmu_init_percpu(void) {
         pat_entry(4, 0x06) | pat_entry(5, 0x04) |
         pat_entry(6, 0x07) | pat_entry(7, 0x00);
     x86_write_msr(X86_MSR_CR_PAT, pat);
+
+    /* Enable PCIDs if supported. PCID 0 is reserved for the kernel context,
+     * which is what is currently loaded. */
+    if (cpu_features.pcid) {
+        curr_cpu->arch.pcid_generation = 1;
+        curr_cpu->arch.next_pcid       = 1;
+
+        x86_write_cr4(x86_read_cr4() | X86_CR4_PCIDE);
+        pcid_enabled = true;
+    }
 }
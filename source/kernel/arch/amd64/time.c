@@ -18,18 +18,18 @@
  * @file
  * @brief               AMD64 time handling functions.
  *
+ * The TSC is converted to nanoseconds by multiplying it by a 32.32 fixed point
+ * factor calculated from the CPU frequency, which avoids a division on every
+ * call to system_time(). The multiply produces a 128-bit result which is then
+ * shifted back down, so no precision is lost from the top of the TSC.
+ *
  * TODO:
  *  - Handle systems where the TSC is not invariant. We should use the HPET or
  *    PIT on such systems.
- *  - Because I'm lazy this is only microsecond resolution at the moment. Doing
- *    nanosecond resolution requires some fixed point maths fun. Something along
- *    the lines of:
- *        cv_factor = (cpu_freq << 32) / ns_per_sec;
- *        time = (tsc << 32) / ns_per_sec;
- *    The problem with this, however, is that you lose the top 32 bits of the
- *    TSC, which is really not very useful.
  */
 
+#include <arch/page.h>
+
 #include <x86/cpu.h>
 #include <x86/smp.h>
 #include <x86/tsc.h>
@@ -46,24 +46,23 @@ static volatile nstime_t system_time_sync __init_data;
  * @return              Number of nanoseconds since system was booted. */
 nstime_t system_time(void) {
     preempt_disable();
-    uint64_t usecs = (x86_rdtsc() - curr_cpu->arch.system_time_offset) / curr_cpu->arch.cycles_per_us;
+    uint64_t nsecs = x86_tsc_convert(
+        x86_rdtsc() - curr_cpu->arch.system_time_offset,
+        curr_cpu->arch.tsc_to_ns_cv);
     preempt_enable();
 
-    return usecs_to_nsecs(usecs);
+    return nsecs;
 }
 
 /** Spin for a certain amount of time.
  * @param nsecs         Nanoseconds to spin for. */
 void spin(nstime_t nsecs) {
-    uint64_t usecs = nsecs_to_usecs(nsecs);
-
     preempt_disable();
 
     while (true) {
-        cpu_id_t id            = curr_cpu->id;
-        uint64_t cycles_per_us = curr_cpu->arch.cycles_per_us;
-        uint64_t start         = x86_rdtsc();
-        uint64_t target        = start + (usecs * cycles_per_us);
+        cpu_id_t id     = curr_cpu->id;
+        uint64_t start  = x86_rdtsc();
+        uint64_t target = start + x86_tsc_convert(nsecs, curr_cpu->arch.ns_to_tsc_cv);
 
         while (true) {
             uint64_t current = x86_rdtsc();
@@ -80,7 +79,12 @@ void spin(nstime_t nsecs) {
              * target. This can lose accuracy, but we can only end up waiting
              * too long rather than not long enough. This is acceptable. */
             if (id != curr_cpu->id) {
-                usecs -= (current - start) / cycles_per_us;
+                nsecs -= x86_tsc_convert(current - start, cpus[id]->arch.tsc_to_ns_cv);
+                if (nsecs <= 0) {
+                    preempt_enable();
+                    return;
+                }
+
                 break;
             }
         }
@@ -106,10 +110,31 @@ __init_text void tsc_init_target(void) {
 
         /* Calculate the offset we need to use. */
         curr_cpu->arch.system_time_offset =
-            -((nsecs_to_usecs(system_time_sync) * curr_cpu->arch.cycles_per_us) - x86_rdtsc());
+            x86_rdtsc() - x86_tsc_convert(system_time_sync, curr_cpu->arch.ns_to_tsc_cv);
     }
 }
 
+/** Fill in the architecture-specific parts of the time page.
+ * @param page          Time page to fill in. */
+__init_text void arch_time_page_init(time_page_t *page) {
+    /* User mode needs RDTSCP to know which CPU's parameters to use. */
+    if (!cpu_features.rdtscp)
+        return;
+
+    size_t max = (PAGE_SIZE - sizeof(*page)) / sizeof(page->cpus[0]);
+    if (highest_cpu_id >= max)
+        return;
+
+    for (cpu_id_t i = 0; i <= highest_cpu_id; i++) {
+        if (cpus[i]) {
+            page->cpus[i].offset = cpus[i]->arch.system_time_offset;
+            page->cpus[i].cv     = cpus[i]->arch.tsc_to_ns_cv;
+        }
+    }
+
+    page->cpu_count = highest_cpu_id + 1;
+}
+
 /** Boot CPU side of TSC initialization. */
 __init_text void tsc_init_source(void) {
     /* Wait for the AP to get into tsc_init_target(). */
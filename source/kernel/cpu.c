@@ -23,6 +23,11 @@
  * thread. An architecture-specific method is used to store a pointer to
  * the current CPU's structure, and the curr_cpu macro expands to the
  * value of this pointer.
+ *
+ * The architecture code determines the position of each CPU in the system's
+ * topology (which physical core, last level cache and package it belongs to).
+ * This is used to build a tree describing the topology, which is used by the
+ * scheduler to make better decisions on where to run threads.
  */
 
 #include <lib/string.h>
@@ -46,6 +51,9 @@ cpu_t **cpus;                       /**< Array of CPU structure pointers (index
 /** Variable to wait on while waiting for a CPU to boot. */
 volatile int cpu_boot_wait;
 
+/** Top level of the CPU topology tree (list of packages). */
+static LIST_DEFINE(cpu_topology);
+
 /** Initialize a CPU structure. */
 static void cpu_ctor(cpu_t *cpu, cpu_id_t id, int state) {
     memset(cpu, 0, sizeof(cpu_t));
@@ -58,8 +66,14 @@ static void cpu_ctor(cpu_t *cpu, cpu_id_t id, int state) {
     spinlock_init(&cpu->call_lock, "cpu_call_lock");
 
     /* Initialize timer information. */
-    list_init(&cpu->timers);
+    avl_tree_init(&cpu->timers);
     spinlock_init(&cpu->timer_lock, "cpu_timer_lock");
+
+    /* Initialize RCU information. */
+    list_init(&cpu->rcu_callbacks);
+    spinlock_init(&cpu->rcu_lock, "cpu_rcu_lock");
+
+    list_init(&cpu->group_link);
 }
 
 /** Register a non-boot CPU.
@@ -127,7 +141,60 @@ __init_text void cpu_init(void) {
     cpu_init_percpu();
 }
 
+/** Find or create a topology group.
+ * @param list          List to search.
+ * @param parent        Parent group.
+ * @param level         Level of the group.
+ * @param id            ID of the group.
+ * @return              Pointer to group. */
+static __init_text cpu_group_t *get_topology_group(
+    list_t *list, cpu_group_t *parent, unsigned level, uint32_t id)
+{
+    list_foreach(list, iter) {
+        cpu_group_t *group = list_entry(iter, cpu_group_t, header);
+
+        if (group->id == id)
+            return group;
+    }
+
+    cpu_group_t *group = kmalloc(sizeof(*group), MM_BOOT);
+
+    list_init(&group->header);
+    list_init(&group->children);
+
+    group->parent    = parent;
+    group->level     = level;
+    group->id        = id;
+    group->cpu_count = 0;
+
+    atomic_store_explicit(&group->busy_count, 0, memory_order_relaxed);
+
+    list_append(list, &group->header);
+    return group;
+}
+
+/** Add the current CPU to the topology tree. */
+static __init_text void add_to_topology(void) {
+    /* Secondary CPUs are initialized one at a time so this needs no locking.
+     * New groups have a busy count of 0, which matches the CPU being idle once
+     * sched_init_percpu() has been called. The scheduler ignores the CPU until
+     * then. */
+    list_t *list        = &cpu_topology;
+    cpu_group_t *parent = NULL;
+
+    for (int level = CPU_TOPOLOGY_LEVELS - 1; level >= 0; level--) {
+        parent = get_topology_group(list, parent, level, curr_cpu->topology_id[level]);
+        parent->cpu_count++;
+        list = &parent->children;
+    }
+
+    list_append(list, &curr_cpu->group_link);
+    curr_cpu->group = parent;
+}
+
 /** Perform additional per-CPU initialization. */
 __init_text void cpu_init_percpu(void) {
     arch_cpu_init_percpu();
+
+    add_to_topology();
 }
@@ -18,13 +18,22 @@
  * @file
  * @brief               Deferred procedure call functions.
  *
- * TODO:
- *  - Per-CPU DPC thread.
+ * Each CPU has its own DPC queue and a worker thread wired to it. A request
+ * is queued on the CPU that makes it, so work deferred from an interrupt runs
+ * on the same CPU, while the data it touches is still likely to be in cache,
+ * and CPUs do not contend with each other on a single queue.
+ *
+ * Requests must be usable from interrupt context, so they cannot be allocated
+ * on demand. Instead, each CPU has a pool of free request structures. When
+ * the pool runs low, the worker thread grows it from thread context, where it
+ * is able to block on the allocation.
  */
 
 #include <lib/list.h>
+#include <lib/string.h>
 
 #include <mm/kmem.h>
+#include <mm/malloc.h>
 #include <mm/page.h>
 
 #include <proc/thread.h>
@@ -33,9 +42,17 @@
 #include <sync/spinlock.h>
 
 #include <assert.h>
+#include <cpu.h>
 #include <dpc.h>
+#include <kernel.h>
 #include <status.h>
 
+/** Number of requests that fit in a page. */
+#define DPC_REQUESTS_PER_PAGE   (PAGE_SIZE / sizeof(dpc_request_t))
+
+/** Number of free requests below which the worker will grow the pool. */
+#define DPC_POOL_LOW            (DPC_REQUESTS_PER_PAGE / 2)
+
 /** Structure describing a DPC request. */
 typedef struct dpc_request {
     list_t header;                  /**< Link to requests/free list. */
@@ -43,93 +60,149 @@ typedef struct dpc_request {
     void *arg;                      /**< Argument to pass to handler. */
 } dpc_request_t;
 
-/** Lists of free and pending DPC requests. */
-static LIST_DEFINE(dpc_free);
-static LIST_DEFINE(dpc_requests);
-static SPINLOCK_DEFINE(dpc_lock);
+/** Per-CPU DPC queue. */
+typedef struct dpc_cpu {
+    spinlock_t lock;                /**< Lock for the queue. */
+    list_t requests;                /**< Pending requests. */
+    list_t free;                    /**< Free request structures. */
+    size_t free_count;              /**< Number of free request structures. */
+    semaphore_t sem;                /**< Semaphore that the worker waits on. */
+    thread_t *thread;               /**< Worker thread. */
+} dpc_cpu_t;
+
+/** Adds a page of request structures to a CPU's free pool.
+ * @param dpc           DPC queue to add to.
+ * @param mmflag        Allocation flags.
+ * @return              Whether the allocation succeeded. */
+static bool dpc_pool_grow(dpc_cpu_t *dpc, unsigned mmflag) {
+    dpc_request_t *alloc = kmem_alloc(PAGE_SIZE, mmflag);
+    if (!alloc)
+        return false;
+
+    spinlock_lock(&dpc->lock);
+
+    for (size_t i = 0; i < DPC_REQUESTS_PER_PAGE; i++) {
+        list_init(&alloc[i].header);
+        list_append(&dpc->free, &alloc[i].header);
+    }
+
+    dpc->free_count += DPC_REQUESTS_PER_PAGE;
 
-/** Semaphore that the DPC thread waits on. */
-static SEMAPHORE_DEFINE(dpc_request_sem, 0);
+    spinlock_unlock(&dpc->lock);
+    return true;
+}
 
-/** DPC thread. */
-static thread_t *dpc_thread;
+static void dpc_thread_func(void *_dpc, void *arg2) {
+    dpc_cpu_t *dpc = _dpc;
 
-static void dpc_thread_func(void *arg1, void *arg2) {
     while (true) {
-        semaphore_down(&dpc_request_sem);
+        semaphore_down(&dpc->sem);
 
-        /* Get the next request in the list. */
-        spinlock_lock(&dpc_lock);
+        spinlock_lock(&dpc->lock);
 
-        assert(!list_empty(&dpc_requests));
+        /* Process everything that is queued. A request queued while we are
+         * working will be picked up here without another wakeup, so we may
+         * occasionally find the queue empty after being woken. */
+        while (!list_empty(&dpc->requests)) {
+            dpc_request_t *request = list_first(&dpc->requests, dpc_request_t, header);
+            list_remove(&request->header);
 
-        dpc_request_t *request = list_first(&dpc_requests, dpc_request_t, header);
-        list_remove(&request->header);
+            spinlock_unlock(&dpc->lock);
 
-        spinlock_unlock(&dpc_lock);
+            /* Call the function. */
+            request->function(request->arg);
 
-        /* Call the function. */
-        request->function(request->arg);
+            /* Return the structure to the free list. */
+            spinlock_lock(&dpc->lock);
+            list_prepend(&dpc->free, &request->header);
+            dpc->free_count++;
+        }
 
-        /* Return the structure to the free list. */
-        spinlock_lock(&dpc_lock);
-        list_prepend(&dpc_free, &request->header);
-        spinlock_unlock(&dpc_lock);
-    }
-}
+        bool grow = dpc->free_count < DPC_POOL_LOW;
 
-static dpc_request_t *dpc_request_alloc(void) {
-    if (list_empty(&dpc_free)) {
-        /* TODO: Allocate more before we run out. */
-        fatal("Out of DPC request structures");
-    }
+        spinlock_unlock(&dpc->lock);
 
-    dpc_request_t *request = list_first(&dpc_free, dpc_request_t, header);
-    list_remove(&request->header);
-    return request;
+        /* Grow the pool now that we are able to block, so that there are
+         * structures available for when interrupt handlers need them. */
+        if (grow)
+            dpc_pool_grow(dpc, MM_KERNEL);
+    }
 }
 
 /**
- * Adds a function to the DPC queue to be called by the DPC thread. This
- * function is safe to use from interrupt context.
+ * Adds a function to the DPC queue to be called by the DPC thread. The
+ * function will be called on the current CPU. This function is safe to use
+ * from interrupt context.
  *
  * @param function      Function to call.
  * @param arg           Argument to pass to the function.
  */
 void dpc_request(dpc_function_t function, void *arg) {
-    spinlock_lock(&dpc_lock);
+    /* Prevent curr_cpu from changing underneath us. */
+    bool irq_state = local_irq_disable();
+
+    /* If this CPU's worker has not been created yet, queue to the boot CPU. */
+    dpc_cpu_t *dpc = (curr_cpu->dpc) ? curr_cpu->dpc : boot_cpu.dpc;
+
+    spinlock_lock_noirq(&dpc->lock);
+
+    if (unlikely(list_empty(&dpc->free)))
+        fatal("Out of DPC request structures");
+
+    dpc_request_t *request = list_first(&dpc->free, dpc_request_t, header);
+    list_remove(&request->header);
+    dpc->free_count--;
 
-    dpc_request_t *request = dpc_request_alloc();
     request->function = function;
     request->arg      = arg;
 
-    /* Add it to the queue and wake up the DPC thread. */
-    list_append(&dpc_requests, &request->header);
-    semaphore_up(&dpc_request_sem, 1);
+    /* Add it to the queue and wake up the worker. If the queue was not empty,
+     * the worker has already been woken and will get to this request. */
+    bool was_empty = list_empty(&dpc->requests);
+    list_append(&dpc->requests, &request->header);
+    if (was_empty || dpc->free_count < DPC_POOL_LOW)
+        semaphore_up(&dpc->sem, 1);
 
-    spinlock_unlock(&dpc_lock);
+    spinlock_unlock_noirq(&dpc->lock);
+    local_irq_restore(irq_state);
 }
 
 /** Check whether the DPC system has been initialized. */
 bool dpc_inited(void) {
-    return dpc_thread != NULL;
+    return boot_cpu.dpc != NULL;
 }
 
-/** Initialize the DPC thread. */
-__init_text void dpc_init(void) {
-    /* Allocate a chunk of DPC structures. We do not allocate a new structure
-     * upon every dpc_request() call to make it usable from interrupt context. */
-    dpc_request_t *alloc = kmem_alloc(PAGE_SIZE, MM_BOOT);
+/** Initialize the DPC queue for the current CPU. */
+__init_text void dpc_init_percpu(void) {
+    dpc_cpu_t *dpc = kmalloc(sizeof(*dpc), MM_BOOT);
 
-    for (size_t i = 0; i < (PAGE_SIZE / sizeof(dpc_request_t)); i++) {
-        list_init(&alloc[i].header);
-        list_append(&dpc_free, &alloc[i].header);
-    }
+    spinlock_init(&dpc->lock, "dpc_lock");
+    list_init(&dpc->requests);
+    list_init(&dpc->free);
+    semaphore_init(&dpc->sem, "dpc_sem", 0);
 
-    /* Create the DPC thread */
-    status_t ret = thread_create("dpc", NULL, 0, dpc_thread_func, NULL, NULL, &dpc_thread);
+    dpc->free_count = 0;
+
+    /* Allocate an initial chunk of DPC structures. We do not allocate a new
+     * structure upon every dpc_request() call to make it usable from interrupt
+     * context. */
+    dpc_pool_grow(dpc, MM_BOOT);
+
+    char name[THREAD_NAME_MAX];
+    snprintf(name, sizeof(name), "dpc-%" PRIu32, curr_cpu->id);
+
+    status_t ret = thread_create(name, NULL, 0, dpc_thread_func, dpc, NULL, &dpc->thread);
     if (ret != STATUS_SUCCESS)
-        fatal("Failed to create DPC thread: %d\n", ret);
+        fatal("Failed to create DPC thread for CPU %" PRIu32 ": %d\n", curr_cpu->id, ret);
+
+    thread_wire(dpc->thread);
+    thread_run(dpc->thread);
 
-    thread_run(dpc_thread);
+    /* Only publish once the worker exists. */
+    curr_cpu->dpc = dpc;
+}
+
+/** Initialize the DPC system. */
+__init_text void dpc_init(void) {
+    dpc_init_percpu();
 }
@@ -22,14 +22,44 @@
 #pragma once
 
 #include <arch/cpu.h>
+#include <lib/avl_tree.h>
 #include <lib/list.h>
 #include <sync/spinlock.h>
 
+struct dpc_cpu;
+struct page;
 struct sched_cpu;
 struct smp_call;
 struct thread;
 struct vm_aspace;
 
+/** CPU topology levels, from innermost to outermost. */
+#define CPU_TOPOLOGY_CORE       0   /**< Logical CPUs sharing a physical core. */
+#define CPU_TOPOLOGY_CACHE      1   /**< Cores sharing a last level cache. */
+#define CPU_TOPOLOGY_PACKAGE    2   /**< Caches within a physical package. */
+#define CPU_TOPOLOGY_LEVELS     3   /**< Number of topology levels. */
+
+/** Maximum number of free pages held in a CPU's page cache. */
+#define CPU_PAGE_CACHE_SIZE     32
+
+/**
+ * CPU topology group.
+ *
+ * The CPU topology is described by a tree of these structures. The top level
+ * of the tree is a list of packages, each of which contains a list of groups
+ * of cores that share a last level cache, each of which contains a list of
+ * cores. Each core contains a list of the logical CPUs that it runs.
+ */
+typedef struct cpu_group {
+    list_t header;                  /**< Link to parent group. */
+    list_t children;                /**< Child groups, or CPUs for a core. */
+    struct cpu_group *parent;       /**< Parent group (NULL for a package). */
+    unsigned level;                 /**< Topology level of the group. */
+    uint32_t id;                    /**< ID of the group (unique within a level). */
+    size_t cpu_count;               /**< Number of logical CPUs within the group. */
+    atomic_uint busy_count;         /**< Number of CPUs within the group that are not idle. */
+} cpu_group_t;
+
 /** Structure describing a CPU. */
 typedef struct cpu {
     list_t header;                  /**< Link to running CPUs list. */
@@ -43,23 +73,50 @@ typedef struct cpu {
         CPU_RUNNING,                /**< Running. */
     } state;
 
+    /**
+     * Topology information. The IDs are filled in by the architecture during
+     * early initialization, and the CPU is added to the topology tree based
+     * on them in cpu_init_percpu().
+     */
+    uint32_t topology_id[CPU_TOPOLOGY_LEVELS];
+    cpu_group_t *group;             /**< Core that the CPU belongs to. */
+    list_t group_link;              /**< Link to core CPU list. */
+
     /** Scheduler information. */
     struct sched_cpu *sched;        /**< Scheduler run queues/timers. */
     struct thread *thread;          /**< Currently executing thread. */
     struct vm_aspace *aspace;       /**< Address space currently in use. */
     bool should_preempt;            /**< Whether the CPU should be preempted. */
     bool idle;                      /**< Whether the CPU is idle. */
+    unsigned interrupt_depth;       /**< Interrupt handler nesting depth. */
+    struct dpc_cpu *dpc;            /**< DPC queue. */
 
     /** Timer information. */
-    list_t timers;                  /**< List of active timers. */
+    avl_tree_t timers;              /**< Active timers, keyed by target time. */
     bool timer_enabled;             /**< Whether the timer device is enabled. */
-    spinlock_t timer_lock;          /**< Timer list lock. */
+    spinlock_t timer_lock;          /**< Timer tree lock. */
 
     /** SMP call information. */
     list_t call_queue;              /**< List of calls queued to this CPU. */
     bool ipi_sent;                  /**< Whether an IPI has been sent to the CPU. */
     struct smp_call *curr_call;     /**< SMP call currently being handled. */
     spinlock_t call_lock;           /**< Lock to protect call queue. */
+
+    /**
+     * Cache of free pages. This is only accessed by the CPU that owns it,
+     * with interrupts disabled (see mm/page.c).
+     */
+    struct page *page_cache[CPU_PAGE_CACHE_SIZE];
+    unsigned page_cache_count;      /**< Number of pages in the cache. */
+
+    /** RCU information (see sync/rcu.c). */
+    atomic_bool rcu_qs_pending;     /**< Whether a quiescent state is needed for the current grace period. */
+    list_t rcu_callbacks;           /**< RCU callbacks queued on this CPU. */
+    spinlock_t rcu_lock;            /**< Lock to protect RCU callback list. */
+
+    /** Spinlock queue nodes (see sync/spinlock.c). */
+    spinlock_node_t spinlock_nodes[SPINLOCK_NODE_COUNT];
+    unsigned spinlock_node_depth;   /**< Number of nodes currently in use. */
 } cpu_t;
 
 /**
@@ -72,6 +129,25 @@ typedef struct cpu {
  */
 #define curr_cpu        (arch_curr_cpu())
 
+/** Check whether the current CPU is handling an interrupt.
+ * @return              Whether the current CPU is handling an interrupt. */
+static inline bool in_interrupt(void) {
+    return curr_cpu->interrupt_depth != 0;
+}
+
+/** Get the topology group containing a CPU at a certain level.
+ * @param cpu           CPU to get group for.
+ * @param level         Topology level to get.
+ * @return              Group containing the CPU at the specified level. */
+static inline cpu_group_t *cpu_topology_group(cpu_t *cpu, unsigned level) {
+    cpu_group_t *group = cpu->group;
+
+    while (group && group->level < level)
+        group = group->parent;
+
+    return group;
+}
+
 extern cpu_t boot_cpu;
 extern size_t highest_cpu_id;
 extern size_t cpu_count;
@@ -27,4 +27,5 @@ typedef void (*dpc_function_t)(void *arg);
 
 extern void dpc_request(dpc_function_t func, void *arg);
 extern bool dpc_inited(void);
+extern void dpc_init_percpu(void);
 extern void dpc_init(void);
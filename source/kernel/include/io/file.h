@@ -23,6 +23,8 @@
 
 #include <kernel/file.h>
 
+#include <mm/vm_cache.h>
+
 #include <sync/mutex.h>
 
 #include <object.h>
@@ -140,6 +142,7 @@ typedef struct file_handle {
     mutex_t lock;                       /**< Lock to protect offset. */
     offset_t offset;                    /**< Current file offset. */
     struct fs_dentry *entry;            /**< Directory entry used to open the node. */
+    vm_cache_readahead_t readahead;     /**< Read-ahead state for cached files. */
 } file_handle_t;
 
 /**
@@ -30,6 +30,7 @@
 #include <lib/refcount.h>
 
 #include <sync/mutex.h>
+#include <sync/rcu.h>
 
 #include <object.h>
 
@@ -302,6 +303,8 @@ typedef struct fs_node {
 
     avl_tree_node_t tree_link;      /**< Link to node tree. */
     list_t unused_link;             /**< Link to global unused node list. */
+    list_t walk_entries;            /**< Entries with this as walk_node (see fs_dentry_t). */
+    rcu_head_t rcu;                 /**< RCU head for deferred freeing. */
 } fs_node_t;
 
 /** Flags for a filesystem node. */
@@ -363,6 +366,29 @@ typedef struct fs_dentry {
     fs_mount_t *mounted;            /**< Filesystem mounted on this entry. */
     list_t mount_link;              /**< Link to mount unused entry list. */
     list_t unused_link;             /**< Link to global unused entry list. */
+
+    /**
+     * Sequence count for lockless lookups.
+     *
+     * This is odd while the fields used by lockless lookups are being changed
+     * (i.e. while something is mounted on or unmounted from the entry), and is
+     * left odd permanently once the entry is removed from its parent. It is
+     * only modified with the entry locked.
+     */
+    atomic_uint32_t seq;
+
+    /**
+     * Node last attached to the entry. Unlike the node pointer, this remains
+     * set while the entry is unused, until the node is freed. It is protected
+     * by the mount lock, and the entry is on the node's walk_entries list
+     * while it is set.
+     */
+    fs_node_t *walk_node;
+    list_t walk_link;               /**< Link to node's walk_entries list. */
+
+    struct fs_dentry *hash_next;    /**< Next entry in hash chain. */
+    bool hashed;                    /**< Whether the entry is in the hash table. */
+    rcu_head_t rcu;                 /**< RCU head for deferred freeing. */
 } fs_dentry_t;
 
 /** Flags for a directory entry. */
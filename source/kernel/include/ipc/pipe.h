@@ -23,8 +23,8 @@
 
 #include <lib/notifier.h>
 
+#include <sync/condvar.h>
 #include <sync/mutex.h>
-#include <sync/semaphore.h>
 
 struct io_request;
 
@@ -35,14 +35,17 @@ struct io_request;
 typedef struct pipe {
     mutex_t lock;                   /**< Lock to protect buffer. */
 
-    semaphore_t space_sem;          /**< Semaphore counting available space. */
+    condvar_t space_cvar;           /**< Condition to wait for space on. */
     notifier_t space_notifier;      /**< Notifier for space availability. */
-    semaphore_t data_sem;           /**< Semaphore counting available data. */
+    condvar_t data_cvar;            /**< Condition to wait for data on. */
     notifier_t data_notifier;       /**< Notifier for data availability. */
 
     char *buf;                      /**< Circular data buffer. */
-    size_t start;                   /**< Start position of buffer. */
-    size_t end;                     /**< End position of buffer. */
+    size_t start;                   /**< Start position of data in the buffer. */
+    size_t count;                   /**< Number of bytes of data in the buffer. */
+
+    bool read_closed;               /**< Whether the read end has been closed. */
+    bool write_closed;              /**< Whether the write end has been closed. */
 } pipe_t;
 
 extern status_t pipe_read(pipe_t *pipe, char *buf, size_t count, bool nonblock, size_t *_bytes);
@@ -50,6 +53,7 @@ extern status_t pipe_write(pipe_t *pipe, const char *buf, size_t count, bool non
 extern status_t pipe_io(pipe_t *pipe, struct io_request *request, bool nonblock);
 extern void pipe_wait(pipe_t *pipe, bool write, object_event_t *event);
 extern void pipe_unwait(pipe_t *pipe, bool write, object_event_t *event);
+extern void pipe_close(pipe_t *pipe, bool write);
 
 extern pipe_t *pipe_create(void);
 extern void pipe_destroy(pipe_t *pipe);
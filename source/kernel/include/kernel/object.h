@@ -47,6 +47,7 @@ struct thread_context;
 #define OBJECT_TYPE_PORT        8       /**< Port (transferrable). */
 #define OBJECT_TYPE_CONNECTION  9       /**< Connection (non-transferrable). */
 #define OBJECT_TYPE_SEMAPHORE   10      /**< Semaphore (transferrable). */
+#define OBJECT_TYPE_WAITSET     11      /**< Wait set (non-transferrable). */
 
 /** Flags for a handle table entry. */
 #define HANDLE_INHERITABLE      (1<<0)  /**< Handle will be inherited by child processes. */
@@ -87,6 +88,13 @@ extern status_t kern_object_type(handle_t handle, unsigned *_type);
 extern status_t kern_object_wait(object_event_t *events, size_t count, uint32_t flags, nstime_t timeout);
 extern status_t kern_object_callback(object_event_t *event, object_callback_t callback, unsigned priority);
 
+extern status_t kern_waitset_create(handle_t *_handle);
+extern status_t kern_waitset_add(handle_t handle, const object_event_t *event);
+extern status_t kern_waitset_remove(handle_t handle, handle_t target, unsigned event);
+extern status_t kern_waitset_wait(
+    handle_t handle, object_event_t *events, size_t count, nstime_t timeout,
+    size_t *_count);
+
 extern status_t kern_handle_flags(handle_t handle, uint32_t *_flags);
 extern status_t kern_handle_set_flags(handle_t handle, uint32_t flags);
 extern status_t kern_handle_duplicate(handle_t handle, handle_t dest, handle_t *_new);
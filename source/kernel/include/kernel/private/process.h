@@ -35,6 +35,7 @@ typedef struct process_args {
     size_t arg_count;               /**< Number of entries in argument array (excluding NULL). */
     size_t env_count;               /**< Number of entries in environment array (excluding NULL). */
     void *load_base;                /**< Load base of libkernel. */
+    void *time_page;                /**< Time information page (can be NULL). */
 } process_args_t;
 
 /** Actions for kern_process_control(). */
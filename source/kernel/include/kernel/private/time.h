@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Internal time functions/definitions.
+ */
+
+#pragma once
+
+#include <kernel/time.h>
+
+__KERNEL_EXTERN_C_BEGIN
+
+#ifdef __KERNEL_PRIVATE
+
+/** Per-CPU time conversion parameters. */
+typedef struct time_page_cpu {
+    uint64_t offset;                /**< Counter value at system time 0. */
+    uint64_t cv;                    /**< Counter to nanoseconds factor (32.32 fixed point). */
+} time_page_cpu_t;
+
+/**
+ * Time information page. This is mapped read-only into every process, and
+ * allows libkernel to get the current time without a kernel call. The
+ * sequence count is incremented before and after each update, so it is odd
+ * while an update is in progress. Readers must check that it is even, and
+ * unchanged after reading the page, otherwise they must retry.
+ */
+typedef struct time_page {
+    uint32_t seq;                   /**< Sequence count. */
+    uint32_t cpu_count;             /**< Number of CPU entries (0 if unusable). */
+    nstime_t boot_unix_time;        /**< UNIX time at which the system booted. */
+    time_page_cpu_t cpus[];         /**< Per-CPU parameters, indexed by CPU ID. */
+} time_page_t;
+
+#ifdef __LIBKERNEL
+
+extern status_t _kern_time_get(unsigned source, nstime_t *_time);
+
+#endif /* __LIBKERNEL */
+#endif /* __KERNEL_PRIVATE */
+
+__KERNEL_EXTERN_C_END
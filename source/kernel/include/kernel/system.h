@@ -27,6 +27,14 @@ __KERNEL_EXTERN_C_BEGIN
 
 /** System information values. */
 #define SYSTEM_INFO_PAGE_SIZE   1   /**< System page size (unsigned long). */
+#define SYSTEM_INFO_CPU_COUNT   2   /**< Number of running CPUs (unsigned long). */
+#define SYSTEM_INFO_CPU_USAGE   3   /**< Per-CPU usage (array of cpu_usage_t, one per CPU). */
+
+/** CPU usage information. */
+typedef struct cpu_usage {
+    uint32_t id;                    /**< ID of the CPU. */
+    nstime_t idle_time;             /**< Total time the CPU has spent idle. */
+} cpu_usage_t;
 
 extern status_t kern_system_info(unsigned what, void *buf);
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Integer-keyed radix tree.
+ */
+
+#pragma once
+
+#include <types.h>
+
+/** Number of key bits handled by each level of an index tree. */
+#define INDEX_TREE_BITS     6
+#define INDEX_TREE_SLOTS    (1 << INDEX_TREE_BITS)
+
+/** Index tree node structure. */
+typedef struct index_tree_node {
+    /** Child nodes, or entries if this is a leaf node. */
+    _Atomic(void *) slots[INDEX_TREE_SLOTS];
+
+    /** Number of key bits below this level (0 for leaf nodes). */
+    unsigned shift;
+} index_tree_node_t;
+
+/** Index tree structure. */
+typedef struct index_tree {
+    _Atomic(index_tree_node_t *) root;
+} index_tree_t;
+
+/**
+ * Iterates over entries in an index tree with keys in the range [start, end).
+ * Entries may be removed from the tree during iteration.
+ *
+ * @param tree          Tree to iterate over.
+ * @param type          Type of the entries.
+ * @param vname         Name of the entry variable to declare.
+ * @param key           Name of a uint64_t variable to store each entry's key
+ *                      in. Must be declared by the caller.
+ * @param start         Start of the key range.
+ * @param end           End of the key range.
+ */
+#define index_tree_foreach(tree, type, vname, key, start, end) \
+    for ( \
+        type *vname = ((key) = (start), index_tree_next((tree), &(key))); \
+        vname && (key) < (end); \
+        (key)++, vname = index_tree_next((tree), &(key)))
+
+extern void index_tree_insert(index_tree_t *tree, uint64_t key, void *value);
+extern void *index_tree_remove(index_tree_t *tree, uint64_t key);
+extern void *index_tree_lookup(index_tree_t *tree, uint64_t key);
+extern void *index_tree_next(index_tree_t *tree, uint64_t *_key);
+
+extern void index_tree_init(index_tree_t *tree);
+extern void index_tree_destroy(index_tree_t *tree);
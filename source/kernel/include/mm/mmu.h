@@ -65,6 +65,28 @@ typedef struct mmu_ops {
         struct mmu_context *ctx, ptr_t virt, phys_ptr_t phys, uint32_t access,
         unsigned mmflag);
 
+    /** Map a large page in a context (optional).
+     * @param ctx           Context to map in.
+     * @param virt          Virtual address to map.
+     * @param phys          Physical address to map to.
+     * @param access        Mapping access flags.
+     * @param mmflag        Allocation behaviour flags.
+     * @return              Status code describing result of the operation.
+     *                      STATUS_IN_USE should be returned if the range
+     *                      cannot be mapped with a large page because of
+     *                      existing page tables. */
+    status_t (*map_large)(
+        struct mmu_context *ctx, ptr_t virt, phys_ptr_t phys, uint32_t access,
+        unsigned mmflag);
+
+    /** Check whether a large page could be mapped (required if map_large is
+     * implemented).
+     * @param ctx           Context to check.
+     * @param virt          Virtual address to check.
+     * @return              Whether map_large would not fail with
+     *                      STATUS_IN_USE. */
+    bool (*can_map_large)(struct mmu_context *ctx, ptr_t virt);
+
     /** Remap a range with different access flags.
      * @param ctx           Context to modify.
      * @param virt          Start of range to update.
@@ -85,6 +107,17 @@ typedef struct mmu_ops {
      * @return              Whether a page was mapped at the virtual address. */
     bool (*unmap)(struct mmu_context *ctx, ptr_t virt, bool shared, page_t **_page);
 
+    /** Unmap a large page in a context (optional).
+     * @param ctx           Context to unmap in.
+     * @param virt          Virtual address to unmap.
+     * @param shared        Whether the mapping was shared across multiple
+     *                      CPUs.
+     * @param _page         Where to pointer to the first page that was
+     *                      unmapped.
+     * @return              Whether a large page was mapped at the virtual
+     *                      address. */
+    bool (*unmap_large)(struct mmu_context *ctx, ptr_t virt, bool shared, page_t **_page);
+
     /** Query details about a mapping.
      * @param ctx           Context to query.
      * @param virt          Virtual address to query.
@@ -109,6 +142,13 @@ typedef struct mmu_ops {
 /** Structure containing an MMU context. */
 typedef struct mmu_context {
     mutex_t lock;                   /**< Lock to protect context. */
+
+    /**
+     * Bitmap of IDs of CPUs that currently have the context loaded. This is
+     * NULL for the kernel context, which is loaded on all CPUs.
+     */
+    unsigned long *cpus;
+
     arch_mmu_context_t arch;        /**< Architecture implementation details. */
 } mmu_context_t;
 
@@ -123,6 +163,11 @@ extern status_t mmu_context_map(
     unsigned mmflag);
 extern void mmu_context_remap(mmu_context_t *ctx, ptr_t virt, size_t size, uint32_t access);
 extern bool mmu_context_unmap(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_page);
+extern status_t mmu_context_map_large(
+    mmu_context_t *ctx, ptr_t virt, phys_ptr_t phys, uint32_t access,
+    unsigned mmflag);
+extern bool mmu_context_can_map_large(mmu_context_t *ctx, ptr_t virt);
+extern bool mmu_context_unmap_large(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_page);
 extern bool mmu_context_query(mmu_context_t *ctx, ptr_t virt, phys_ptr_t *_phys, uint32_t *_access);
 
 extern void mmu_context_load(mmu_context_t *ctx);
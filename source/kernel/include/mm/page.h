@@ -46,6 +46,14 @@ typedef struct page_ops {
      * @param page          Page to release.
      * @param phys          Physical address of page that was unmapped. */
     void (*release_page)(struct page *page);
+
+    /** Evict an unused, unmodified page so that it can be freed. This is
+     * called with the page's queue locked, so must not block.
+     * @param page          Page to evict.
+     * @return              Whether the page was evicted. If true, the owner
+     *                      must no longer refer to the page, and it will be
+     *                      freed by the caller. */
+    bool (*evict_page)(struct page *page);
 } page_ops_t;
 
 /** Structure describing a page in memory. */
@@ -57,7 +65,8 @@ typedef struct page {
     unsigned range;                 /**< Memory range that the page belongs to. */
     unsigned state;                 /**< State of the page. */
     bool modified : 1;              /**< Whether the page has been modified. */
-    uint8_t unused: 7;
+    bool busy : 1;                  /**< Whether I/O to fill the page is in progress. */
+    uint8_t unused: 6;
 
     /** Information about how the page is being used. */
     page_ops_t *ops;                /**< Operations for the page. */
@@ -72,6 +81,8 @@ typedef struct page {
 #define PAGE_STATE_MODIFIED     1   /**< Modified. */
 #define PAGE_STATE_CACHED       2   /**< Cached. */
 #define PAGE_STATE_FREE         3   /**< Free. */
+#define PAGE_STATE_FREE_CPU     4   /**< Free, held in a per-CPU page cache. */
+#define PAGE_STATE_FREE_ZERO    5   /**< Free, zeroed and held in the zeroed pool. */
 
 /** Structure containing physical memory usage statistics. */
 typedef struct page_stats {
@@ -82,6 +93,18 @@ typedef struct page_stats {
     uint64_t free;                  /**< Amount of free memory. */
 } page_stats_t;
 
+/** Structure describing a shrinker, which frees cached data when memory is
+ * low. */
+typedef struct page_shrinker {
+    list_t header;                  /**< Link to shrinker list. */
+    const char *name;               /**< Name of the shrinker. */
+
+    /** Free cached data that is not currently in use.
+     * @param count         Number of objects to try to free.
+     * @return              Number of objects freed. */
+    size_t (*shrink)(size_t count);
+} page_shrinker_t;
+
 extern bool page_init_done;
 
 extern void page_set_state(page_t *page, unsigned state);
@@ -90,8 +113,13 @@ extern page_t *page_alloc(unsigned mmflag);
 extern void page_free(page_t *page);
 extern page_t *page_copy(page_t *page, unsigned mmflag);
 
+extern bool page_zero_idle(void);
+
 extern void page_stats_get(page_stats_t *stats);
 
+extern void page_shrinker_register(page_shrinker_t *shrinker);
+extern void page_daemon_wake(void);
+
 extern void page_add_memory_range(phys_ptr_t start, phys_ptr_t end, unsigned freelist);
 
 extern phys_ptr_t page_early_alloc(void);
@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include <arch/aspace.h>
 #include <arch/page.h>
 
 #include <mm/mm.h>
@@ -33,6 +34,25 @@
 #define MEMORY_TYPE_WT          4   /**< Write-through. */
 #define MEMORY_TYPE_WB          5   /**< Write-back. */
 
+/**
+ * Checks whether a physical address range lies within the physical map area.
+ * phys_map() on such a range will never need to allocate, so can be used in
+ * any context.
+ *
+ * @param addr          Start of range.
+ * @param size          Size of range.
+ *
+ * @return              Whether the range lies within the physical map area.
+ */
+static inline bool phys_pmap_contains(phys_ptr_t addr, size_t size) {
+    #if KERNEL_PMAP_OFFSET > 0
+        if (addr < KERNEL_PMAP_OFFSET)
+            return false;
+    #endif
+
+    return ((addr + size) <= (KERNEL_PMAP_OFFSET + KERNEL_PMAP_SIZE));
+}
+
 extern void *phys_map(phys_ptr_t addr, size_t size, unsigned mmflag);
 extern void phys_unmap(void *addr, size_t size, bool shared);
 
@@ -34,7 +34,8 @@ struct slab_bufctl;
 
 /** Allocator limitations/settings. */
 #define SLAB_NAME_MAX           25      /**< Maximum slab cache name length. */
-#define SLAB_MAGAZINE_SIZE      16      /**< Initial magazine size (resizing currently not supported). */
+#define SLAB_MAGAZINE_SIZE      16      /**< Initial magazine size. */
+#define SLAB_MAGAZINE_MAX       128     /**< Maximum magazine size. */
 #define SLAB_HASH_SIZE          64      /**< Allocation hash table size. */
 #define SLAB_ALIGN_MIN          8       /**< Minimum alignment. */
 #define SLAB_LARGE_FRACTION     8       /**< Minimum fraction of the source quantum for large objects. */
@@ -54,6 +55,9 @@ typedef struct slab_cache {
     mutex_t depot_lock;                 /**< Magazine depot lock. */
     list_t magazine_full;               /**< List of full magazines. */
     list_t magazine_empty;              /**< List of empty magazines. */
+    size_t magazine_size;               /**< Size of newly allocated magazines. */
+    nstime_t contention_start;          /**< Start of current contention interval. */
+    unsigned contention_count;          /**< Depot lock contention in current interval. */
 
     /** Statistics. */
     #if CONFIG_SLAB_STATS
@@ -64,8 +64,34 @@ typedef struct vm_region_ops {
      * @param _page         Where to store pointer to page structure.
      * @return              Status code describing result of the operation. */
     status_t (*get_page)(struct vm_region *region, offset_t offset, page_t **_page);
+
+    /** Get a page for the region only if it is already resident (optional).
+     * This must not perform any I/O or allocate a new page. It is used to map
+     * pages surrounding a faulting page.
+     * @param region        Region to get page for.
+     * @param offset        Offset into object to get page from.
+     * @param _page         Where to store pointer to page structure.
+     * @return              Status code describing result of the operation,
+     *                      STATUS_NOT_FOUND if the page is not resident. */
+    status_t (*lookup_page)(struct vm_region *region, offset_t offset, page_t **_page);
 } vm_region_ops_t;
 
+/** Number of pages covered by each block of an anonymous map. */
+#define VM_AMAP_BLOCK_PAGES     512
+
+/** Block of pages within an anonymous map. */
+typedef struct vm_amap_block {
+    size_t count;                   /**< Number of pages present in the block. */
+    page_t *pages[VM_AMAP_BLOCK_PAGES];
+    uint16_t rref[VM_AMAP_BLOCK_PAGES];
+} vm_amap_block_t;
+
+/** Entry in an anonymous map's block table. */
+typedef struct vm_amap_entry {
+    vm_amap_block_t *block;         /**< Block, or NULL if not allocated. */
+    uint16_t rref;                  /**< Region reference count for all pages if no block. */
+} vm_amap_entry_t;
+
 /** Structure containing an anonymous memory map. */
 typedef struct vm_amap {
     refcount_t count;               /**< Count of regions referring to this object. */
@@ -73,8 +99,7 @@ typedef struct vm_amap {
 
     size_t curr_size;               /**< Number of pages currently contained in object. */
     size_t max_size;                /**< Maximum number of pages in object. */
-    page_t **pages;                 /**< Array of pages currently in object. */
-    uint16_t *rref;                 /**< Region reference count array. */
+    vm_amap_entry_t *blocks;        /**< Table of blocks of pages. */
 } vm_amap_t;
 
 /** Structure representing a region in an address space. */
@@ -128,6 +153,9 @@ typedef struct vm_aspace {
 
     /** Sorted list of all (including unused) regions. */
     list_t regions;
+
+    /** Number of page faults avoided by mapping pages around a fault. */
+    uint64_t faults_saved;
 } vm_aspace_t;
 
 /** Page fault reason codes. */
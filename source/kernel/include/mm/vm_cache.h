@@ -21,12 +21,14 @@
 
 #pragma once
 
-#include <lib/avl_tree.h>
+#include <lib/index_tree.h>
 
 #include <mm/page.h>
 #include <mm/vm.h>
 
+#include <sync/condvar.h>
 #include <sync/mutex.h>
+#include <sync/spinlock.h>
 
 struct io_request;
 struct vm_cache;
@@ -63,16 +65,27 @@ typedef struct vm_cache_ops {
 /** Structure containing a page-based data cache. */
 typedef struct vm_cache {
     mutex_t lock;                   /**< Lock protecting cache. */
-    avl_tree_t pages;               /**< Tree of pages. */
+    spinlock_t page_lock;           /**< Lock for page references and removal. */
+    index_tree_t pages;             /**< Tree of pages, keyed by page number. */
     offset_t size;                  /**< Size of the cache. */
     vm_cache_ops_t *ops;            /**< Pointer to operations structure. */
     void *data;                     /**< Cache data pointer. */
     bool deleted;                   /**< Whether the cache is destroyed. */
+    condvar_t io_cvar;              /**< Condition to wait on for page I/O to complete. */
+    size_t io_count;                /**< Number of pages with I/O in progress. */
 } vm_cache_t;
 
+/** Sequential access tracking state for cache read-ahead. */
+typedef struct vm_cache_readahead {
+    offset_t next;                  /**< Offset that a sequential read would start at. */
+    offset_t issued;                /**< End of the last range read ahead. */
+    size_t window;                  /**< Current read-ahead window (in pages). */
+} vm_cache_readahead_t;
+
 extern vm_region_ops_t vm_cache_region_ops;
 
-extern status_t vm_cache_io(vm_cache_t *cache, struct io_request *request);
+extern status_t vm_cache_io(
+    vm_cache_t *cache, struct io_request *request, vm_cache_readahead_t *ra);
 extern void vm_cache_resize(vm_cache_t *cache, offset_t size);
 extern status_t vm_cache_flush(vm_cache_t *cache);
 
@@ -28,6 +28,8 @@ extern void sched_post_switch(bool state);
 extern void sched_preempt(void);
 extern void sched_insert_thread(thread_t *thread);
 
+extern nstime_t sched_cpu_idle_time(struct cpu *cpu);
+
 extern void sched_init(void);
 extern void sched_init_percpu(void);
 extern void sched_enter(void) __noreturn;
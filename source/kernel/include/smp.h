@@ -42,7 +42,7 @@ extern void smp_ipi_handler(void);
 
 extern status_t smp_call_single(cpu_id_t dest, smp_call_func_t func, void *arg, unsigned flags);
 extern void smp_call_broadcast(smp_call_func_t func, void *arg, unsigned flags);
-//extern void smp_call_multicast(cpu_set_t *cpus, smp_call_func_t func, void *arg, unsigned flags);
+extern void smp_call_multicast(const unsigned long *mask, smp_call_func_t func, void *arg, unsigned flags);
 extern void smp_call_acknowledge(status_t status);
 
 /** Values for smp_boot_status (arch can use anything > 3). */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Big-reader lock implementation.
+ */
+
+#pragma once
+
+#include <lib/list.h>
+
+#include <sync/mutex.h>
+
+/** Per-CPU reader count for a big-reader lock. */
+typedef struct brlock_percpu {
+    atomic_long readers;            /**< Readers that entered on this CPU. */
+} __cacheline_aligned brlock_percpu_t;
+
+/**
+ * Structure containing a big-reader lock.
+ *
+ * This is a readers-writer lock for read-mostly data. Readers only modify a
+ * count for the current CPU, which makes read locking cheap and avoids all
+ * CPUs contending on a single cache line, at the expense of writers, which
+ * must wait for the counts on all CPUs to drain.
+ *
+ * The per-CPU counts are allocated at initialization, so big-reader locks
+ * cannot be statically initialized and must be initialized with brlock_init()
+ * once SMP initialization has detected all CPUs.
+ */
+typedef struct brlock {
+    brlock_percpu_t *percpu;        /**< Per-CPU reader counts. */
+    atomic_bool writer;             /**< Whether a writer holds or is waiting for the lock. */
+    mutex_t write_lock;             /**< Lock serializing writers and blocked readers. */
+    spinlock_t lock;                /**< Lock to protect the thread list. */
+    list_t threads;                 /**< Writer waiting for readers to drain. */
+    const char *name;               /**< Name of the lock. */
+} brlock_t;
+
+extern void brlock_read_lock(brlock_t *lock);
+extern void brlock_read_unlock(brlock_t *lock);
+extern void brlock_write_lock(brlock_t *lock);
+extern void brlock_write_unlock(brlock_t *lock);
+
+extern void brlock_init(brlock_t *lock, const char *name);
@@ -25,6 +25,7 @@
 
 #include <sync/spinlock.h>
 
+struct cpu;
 struct thread;
 
 /** Structure containing a mutex. */
@@ -34,6 +35,7 @@ typedef struct mutex {
     spinlock_t lock;                /**< Lock to protect the thread list. */
     list_t threads;                 /**< List of waiting threads. */
     struct thread *holder;          /**< Thread holding the lock. */
+    struct cpu *holder_cpu;         /**< CPU that the holder acquired the lock on. */
     const char *name;               /**< Name of the lock. */
     #if CONFIG_DEBUG
         void *caller;               /**< Return address of lock call. */
@@ -48,6 +50,7 @@ typedef struct mutex {
         .lock = SPINLOCK_INITIALIZER("mutex_lock"), \
         .threads = LIST_INITIALIZER(_var.threads), \
         .holder = NULL, \
+        .holder_cpu = NULL, \
         .name = _name, \
     }
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Read-copy-update (RCU) implementation.
+ */
+
+#pragma once
+
+#include <lib/list.h>
+
+#include <assert.h>
+#include <cpu.h>
+#include <kernel.h>
+
+struct rcu_head;
+
+/** Type of an RCU callback function.
+ * @param head          Head structure that was passed to call_rcu(). */
+typedef void (*rcu_func_t)(struct rcu_head *head);
+
+/**
+ * RCU callback head. This should be embedded in a structure which is to be
+ * freed after a grace period, and passed to call_rcu().
+ */
+typedef struct rcu_head {
+    list_t header;                  /**< Link to callback list. */
+    rcu_func_t func;                /**< Function to call. */
+} rcu_head_t;
+
+/**
+ * Reads an RCU-protected pointer. This must be used to read pointers that may
+ * be concurrently updated with rcu_assign_pointer(), within an RCU read-side
+ * critical section.
+ */
+#define rcu_dereference(ptr) \
+    __atomic_load_n(&(ptr), __ATOMIC_CONSUME)
+
+/**
+ * Updates an RCU-protected pointer. This ensures that the initialization of
+ * the structure being pointed to is visible to readers before the pointer.
+ */
+#define rcu_assign_pointer(ptr, val) \
+    __atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+
+/**
+ * Begins an RCU read-side critical section. Structures that are protected by
+ * RCU will not be freed until after all read-side critical sections that were
+ * active when they were removed have ended. Read-side critical sections can be
+ * nested, and must not block, as preemption is disabled while they are active.
+ * They can only be entered from thread context, not from interrupt handlers,
+ * since an idle CPU is treated as being in a quiescent state.
+ */
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+    assert(!in_interrupt());
+}
+
+/** Ends an RCU read-side critical section. */
+static inline void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+extern void rcu_quiescent_state(void);
+
+extern void call_rcu(rcu_head_t *head, rcu_func_t func);
+extern void synchronize_rcu(void);
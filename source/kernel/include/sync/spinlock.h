@@ -23,9 +23,22 @@
 
 #include <types.h>
 
+/** Number of queue nodes per CPU (maximum nesting of contended acquisitions). */
+#define SPINLOCK_NODE_COUNT     4
+
+/**
+ * Spinlock queue node. Each CPU has a small array of these, and one is used by
+ * the CPU while it is waiting for a contended spinlock.
+ */
+typedef struct spinlock_node {
+    _Atomic(struct spinlock_node *) next;   /**< Next waiter in the queue. */
+    atomic_bool wait;                       /**< Whether the waiter must keep waiting. */
+} spinlock_node_t;
+
 /** Structure containing a spinlock. */
 typedef struct spinlock {
-    atomic_int value;           /**< Value of lock (1 == free, 0 == held, others == held with waiters). */
+    atomic_bool locked;         /**< Whether the lock is held. */
+    atomic_uint tail;           /**< Encoded node at the tail of the waiter queue (0 == no waiters). */
     volatile bool state;        /**< Interrupt state prior to locking. */
     const char *name;           /**< Name of the spinlock. */
 } spinlock_t;
@@ -33,7 +46,8 @@ typedef struct spinlock {
 /** Initializes a statically defined spinlock. */
 #define SPINLOCK_INITIALIZER(_name) \
     { \
-        .value = 1, \
+        .locked = false, \
+        .tail = 0, \
         .state = 0, \
         .name = _name, \
     }
@@ -46,11 +60,12 @@ typedef struct spinlock {
  * @param lock          Spinlock to check.
  * @return              True if lock is locked, false otherwise. */
 static inline bool spinlock_held(spinlock_t *lock) {
-    return atomic_load_explicit(&lock->value, memory_order_relaxed) != 1;
+    return atomic_load_explicit(&lock->locked, memory_order_relaxed);
 }
 
 extern void spinlock_lock(spinlock_t *lock);
 extern void spinlock_lock_noirq(spinlock_t *lock);
+extern bool spinlock_trylock_noirq(spinlock_t *lock);
 extern void spinlock_unlock(spinlock_t *lock);
 extern void spinlock_unlock_noirq(spinlock_t *lock);
 
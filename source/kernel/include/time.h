@@ -21,11 +21,13 @@
 
 #pragma once
 
+#include <kernel/private/time.h>
 #include <kernel/time.h>
-#include <lib/list.h>
+#include <lib/avl_tree.h>
 #include <types.h>
 
 struct cpu;
+struct vm_aspace;
 
 /** Convert seconds to nanoseconds.
  * @param secs          Seconds value to convert.
@@ -107,10 +109,10 @@ typedef bool (*timer_func_t)(void *data);
 
 /** Structure containing details of a timer. */
 typedef struct timer {
-    list_t header;                  /**< Link to timers list. */
+    avl_tree_node_t link;           /**< Link to CPU timer tree. */
 
     nstime_t target;                /**< Time at which the timer will fire. */
-    struct cpu *cpu;                /**< CPU that the timer was started on. */
+    struct cpu *cpu;                /**< CPU that the timer is running on (NULL if not running). */
     timer_func_t func;              /**< Function to call when the timer expires. */
     void *data;                     /**< Argument to pass to timer handler. */
     uint32_t flags;                 /**< Behaviour flags. */
@@ -138,11 +140,21 @@ extern void timer_init(
 extern void timer_start(timer_t *timer, nstime_t length, unsigned mode);
 extern void timer_stop(timer_t *timer);
 
+/** Check whether a timer is running.
+ * @param timer         Timer to check.
+ * @return              Whether the timer is running. */
+static inline bool timer_running(timer_t *timer) {
+    return timer->cpu != NULL;
+}
+
 extern status_t delay_etc(nstime_t nsecs, int flags);
 extern void delay(nstime_t nsecs);
 extern void spin(nstime_t nsecs);
 
 extern nstime_t platform_time_from_hardware(void);
 
+extern void arch_time_page_init(time_page_t *page);
+extern status_t time_page_map(struct vm_aspace *as, ptr_t *_addr);
+
 extern void time_init(void);
 extern void time_init_percpu(void);
@@ -23,11 +23,33 @@
 
 #include <kernel/system.h>
 
+#include <mm/malloc.h>
 #include <mm/safe.h>
 
+#include <proc/sched.h>
+
+#include <cpu.h>
 #include <kernel.h>
 #include <status.h>
 
+static status_t get_cpu_usage(cpu_usage_t *buf) {
+    /* The CPU list does not change once secondary CPUs have been booted. */
+    cpu_usage_t *usage = kmalloc(sizeof(*usage) * cpu_count, MM_KERNEL);
+
+    size_t i = 0;
+    list_foreach(&running_cpus, iter) {
+        cpu_t *cpu = list_entry(iter, cpu_t, header);
+
+        usage[i].id        = cpu->id;
+        usage[i].idle_time = sched_cpu_idle_time(cpu);
+        i++;
+    }
+
+    status_t ret = memcpy_to_user(buf, usage, sizeof(*usage) * i);
+    kfree(usage);
+    return ret;
+}
+
 /**
  * Retrieves information about the system. The what argument specifies the
  * information to get, which will be stored in the given buffer. The buffer
@@ -46,6 +68,10 @@ status_t kern_system_info(unsigned what, void *buf) {
     switch (what) {
         case SYSTEM_INFO_PAGE_SIZE:
             return write_user((size_t *)buf, PAGE_SIZE);
+        case SYSTEM_INFO_CPU_COUNT:
+            return write_user((size_t *)buf, cpu_count);
+        case SYSTEM_INFO_CPU_USAGE:
+            return get_cpu_usage(buf);
         default:
             return STATUS_INVALID_ARG;
     }
@@ -138,6 +138,8 @@ file_handle_t *file_handle_alloc(file_t *file, uint32_t access, uint32_t flags)
     fhandle->private = NULL;
     fhandle->offset  = 0;
 
+    memset(&fhandle->readahead, 0, sizeof(fhandle->readahead));
+
     return fhandle;
 }
 
@@ -37,7 +37,21 @@
  * in LRU order. Filesystem implementations can override this behaviour, to
  * either never free unused entries, or never keep them. The former behaviour
  * is used by ramfs, for example - it exists entirely within the filesystem
- * caches therefore must not free unused entries.
+ * caches therefore must not free unused entries. Freeing a node may require
+ * I/O to flush it, which the page daemon cannot wait for, so unused nodes are
+ * freed by a separate reclaim thread at the page daemon's request.
+ *
+ * Path lookups first try to walk the directory cache without taking any locks
+ * other than on the entry found, under RCU. Directory entries are additionally
+ * kept in a hash table by parent and name which can be searched locklessly,
+ * and each entry has a sequence count which changes whenever it is detached
+ * from its parent or has something mounted on it, so a lookup can detect that
+ * an entry it has passed through has changed. Unused entries do not have a
+ * valid node pointer, so each entry also records the node it was last attached
+ * to, which is cleared when that node is freed. Directory entry and node
+ * structures are freed after an RCU grace period. If the lockless lookup reaches an entry
+ * that is not cached, a mount crossing or a symbolic link, or something
+ * changes under it, the lookup is redone with locking.
  *
  * Locking order:
  *  - Lock down the directory entry tree (i.e. parent before child).
@@ -53,18 +67,23 @@
 #include <io/fs.h>
 #include <io/request.h>
 
+#include <lib/fnv.h>
 #include <lib/string.h>
 
 #include <mm/malloc.h>
+#include <mm/page.h>
 #include <mm/safe.h>
 #include <mm/slab.h>
 #include <mm/vm.h>
 #include <mm/vm_cache.h>
 
 #include <proc/process.h>
+#include <proc/thread.h>
 
 #include <security/security.h>
 
+#include <sync/semaphore.h>
+
 #include <assert.h>
 #include <kboot.h>
 #include <kdb.h>
@@ -103,11 +122,24 @@ static LIST_DEFINE(unused_entries);
 static SPINLOCK_DEFINE(unused_entries_lock);
 static size_t unused_entry_count;
 
+/** Maximum number of unused entries to scan with the list locked. */
+#define FS_SHRINK_SCAN_BATCH    32
+
 /** Unused nodes. */
 static LIST_DEFINE(unused_nodes);
 static SPINLOCK_DEFINE(unused_nodes_lock);
 static size_t unused_node_count;
 
+/** Thread which frees unused nodes on behalf of the page daemon. */
+static thread_t *fs_reclaim_thread;
+static SEMAPHORE_DEFINE(fs_reclaim_sem, 0);
+static atomic_size_t fs_reclaim_count;
+
+/** Hash table of directory entries by parent and name, for lockless lookups. */
+#define FS_DENTRY_HASH_SIZE 1024
+static fs_dentry_t *fs_dentry_hash[FS_DENTRY_HASH_SIZE];
+static SPINLOCK_DEFINE(fs_dentry_hash_lock);
+
 /** Mount at the root of the filesystem. */
 fs_mount_t *root_mount;
 
@@ -194,6 +226,7 @@ static fs_node_t *fs_node_alloc(fs_mount_t *mount) {
 
     refcount_set(&node->count, 1);
     list_init(&node->unused_link);
+    list_init(&node->walk_entries);
 
     node->file.ops = &fs_file_ops;
     node->flags    = 0;
@@ -202,6 +235,13 @@ static fs_node_t *fs_node_alloc(fs_mount_t *mount) {
     return node;
 }
 
+/** RCU callback to free a node structure. */
+static void fs_node_free_rcu(rcu_head_t *head) {
+    fs_node_t *node = container_of(head, fs_node_t, rcu);
+
+    slab_cache_free(fs_node_cache, node);
+}
+
 /**
  * Frees an unused node structure. The node's mount must be locked. If the node
  * is not marked as removed, the node's flush operation will be called, and the
@@ -228,6 +268,16 @@ static status_t fs_node_free(fs_node_t *node) {
         }
     }
 
+    /* Clear any directory entries' record of the node for lockless lookups.
+     * These may still be using the node, so the structure itself is not freed
+     * until they have finished. */
+    while (!list_empty(&node->walk_entries)) {
+        fs_dentry_t *entry = list_first(&node->walk_entries, fs_dentry_t, walk_link);
+
+        list_remove(&entry->walk_link);
+        rcu_assign_pointer(entry->walk_node, NULL);
+    }
+
     /* May still be on the unused list if freeing via fs_unmount(). */
     if (!list_empty(&node->unused_link)) {
         spinlock_lock(&unused_nodes_lock);
@@ -242,7 +292,7 @@ static status_t fs_node_free(fs_node_t *node) {
     avl_tree_remove(&mount->nodes, &node->tree_link);
 
     dprintf("fs: freed node %" PRIu16 ":%" PRIu64 " (%p)\n", mount->id, node->id, node);
-    slab_cache_free(fs_node_cache, node);
+    call_rcu(&node->rcu, fs_node_free_rcu);
     return STATUS_SUCCESS;
 }
 
@@ -305,6 +355,7 @@ static void fs_dentry_ctor(void *obj, void *data) {
     radix_tree_init(&entry->entries);
     list_init(&entry->mount_link);
     list_init(&entry->unused_link);
+    list_init(&entry->walk_link);
 }
 
 /** Allocate a new directory entry structure (reference count will be set to 0). */
@@ -320,14 +371,158 @@ static fs_dentry_t *fs_dentry_alloc(const char *name, fs_mount_t *mount, fs_dent
     entry->parent  = parent;
     entry->mounted = NULL;
 
+    entry->seq       = 0;
+    entry->walk_node = NULL;
+    entry->hash_next = NULL;
+    entry->hashed    = false;
+
     return entry;
 }
 
+/** Begin changing the lockless lookup state of a locked entry. */
+static inline void fs_dentry_write_begin(fs_dentry_t *entry) {
+    atomic_fetch_add(&entry->seq, 1);
+}
+
+/** Finish changing the lockless lookup state of a locked entry. */
+static inline void fs_dentry_write_end(fs_dentry_t *entry) {
+    atomic_fetch_add(&entry->seq, 1);
+}
+
+/** Get the sequence count of an entry before reading it without locking.
+ * @param entry         Entry to read.
+ * @return              Sequence count (odd if the entry cannot be used). */
+static inline uint32_t fs_dentry_read_begin(fs_dentry_t *entry) {
+    return atomic_load_explicit(&entry->seq, memory_order_acquire);
+}
+
+/** Check whether an entry has changed since fs_dentry_read_begin().
+ * @param entry         Entry that was read.
+ * @param seq           Sequence count returned by fs_dentry_read_begin().
+ * @return              Whether the entry has changed. */
+static inline bool fs_dentry_read_retry(fs_dentry_t *entry, uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq;
+}
+
+/** Get the hash table bucket for a name within a directory. */
+static uint32_t fs_dentry_hash_bucket(fs_dentry_t *parent, const char *name, size_t len) {
+    uint32_t hash = fnv_hash_integer((ptr_t)parent);
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash * FNV_PRIME) ^ (uint8_t)name[i];
+
+    return hash % FS_DENTRY_HASH_SIZE;
+}
+
+/** Add an entry to the hash table. */
+static void fs_dentry_hash_insert(fs_dentry_t *entry) {
+    uint32_t bucket = fs_dentry_hash_bucket(entry->parent, entry->name, strlen(entry->name));
+
+    spinlock_lock(&fs_dentry_hash_lock);
+
+    entry->hash_next = fs_dentry_hash[bucket];
+    entry->hashed    = true;
+    rcu_assign_pointer(fs_dentry_hash[bucket], entry);
+
+    spinlock_unlock(&fs_dentry_hash_lock);
+}
+
+/** Remove an entry from the hash table, if it is in it. */
+static void fs_dentry_hash_remove(fs_dentry_t *entry) {
+    uint32_t bucket = fs_dentry_hash_bucket(entry->parent, entry->name, strlen(entry->name));
+
+    spinlock_lock(&fs_dentry_hash_lock);
+
+    if (entry->hashed) {
+        fs_dentry_t **prev = &fs_dentry_hash[bucket];
+        while (*prev != entry)
+            prev = &(*prev)->hash_next;
+
+        /* The entry's own next pointer is left alone, as lockless lookups may
+         * currently be on the entry and need to continue along the chain. */
+        rcu_assign_pointer(*prev, entry->hash_next);
+        entry->hashed = false;
+    }
+
+    spinlock_unlock(&fs_dentry_hash_lock);
+}
+
+/** Look up an entry in the hash table. Must be in an RCU read-side critical
+ * section, and the entry returned is only safe to use within it.
+ * @param parent        Parent entry.
+ * @param name          Name to look up (need not be null-terminated).
+ * @param len           Length of the name.
+ * @return              Entry found, or NULL if not found. */
+static fs_dentry_t *fs_dentry_hash_lookup(fs_dentry_t *parent, const char *name, size_t len) {
+    uint32_t bucket = fs_dentry_hash_bucket(parent, name, len);
+
+    fs_dentry_t *entry = rcu_dereference(fs_dentry_hash[bucket]);
+    while (entry) {
+        if (entry->parent == parent && strncmp(entry->name, name, len) == 0 && !entry->name[len])
+            return entry;
+
+        entry = rcu_dereference(entry->hash_next);
+    }
+
+    return NULL;
+}
+
+/** Attach a new entry to a locked parent. */
+static void fs_dentry_attach(fs_dentry_t *parent, fs_dentry_t *entry) {
+    radix_tree_insert(&parent->entries, entry->name, entry);
+    fs_dentry_hash_insert(entry);
+}
+
+/** Detach a locked entry from its locked parent. */
+static void fs_dentry_detach(fs_dentry_t *parent, fs_dentry_t *entry) {
+    /* The entry is never attached again, so leave the sequence count odd to
+     * stop lockless lookups from using it. */
+    fs_dentry_write_begin(entry);
+
+    radix_tree_remove(&parent->entries, entry->name, NULL);
+    fs_dentry_hash_remove(entry);
+}
+
+/** Record the node of an entry for lockless lookups (mount must be locked). */
+static void fs_dentry_set_walk_node(fs_dentry_t *entry, fs_node_t *node) {
+    assert(mutex_held(&entry->mount->lock));
+
+    /* Only a freed node is cleared, and only an unused entry can have a freed
+     * node, so the entry either has this node already or none at all. */
+    if (!entry->walk_node) {
+        list_append(&node->walk_entries, &entry->walk_link);
+        rcu_assign_pointer(entry->walk_node, node);
+    }
+
+    assert(entry->walk_node == node);
+}
+
+/** Clear the node of an entry for lockless lookups (mount must be locked). */
+static void fs_dentry_clear_walk_node(fs_dentry_t *entry) {
+    assert(mutex_held(&entry->mount->lock));
+
+    list_remove(&entry->walk_link);
+    rcu_assign_pointer(entry->walk_node, NULL);
+}
+
+/** RCU callback to free a directory entry structure. */
+static void fs_dentry_free_rcu(rcu_head_t *head) {
+    fs_dentry_t *entry = container_of(head, fs_dentry_t, rcu);
+
+    kfree(entry->name);
+    slab_cache_free(fs_dentry_cache, entry);
+}
+
 /** Free a directory entry structure. */
 static void fs_dentry_free(fs_dentry_t *entry) {
+    assert(!entry->walk_node);
+
+    fs_dentry_hash_remove(entry);
     radix_tree_clear(&entry->entries, NULL);
-    kfree(entry->name);
-    slab_cache_free(fs_dentry_cache, entry);
+
+    /* Lockless lookups may still be using the entry. */
+    call_rcu(&entry->rcu, fs_dentry_free_rcu);
 }
 
 /** Increase the reference count of a directory entry.
@@ -360,6 +555,10 @@ static void fs_dentry_release_locked(fs_dentry_t *entry) {
             "fs: freed entry '%s' (%p) on mount %" PRIu16 "\n",
             entry->name, entry, entry->mount->id);
 
+        mutex_lock(&entry->mount->lock);
+        fs_dentry_clear_walk_node(entry);
+        mutex_unlock(&entry->mount->lock);
+
         mutex_unlock(&entry->lock);
         fs_dentry_free(entry);
         return;
@@ -391,14 +590,14 @@ void fs_dentry_release(fs_dentry_t *entry) {
     fs_dentry_release_locked(entry);
 }
 
-/** Instantiate a directory entry.
- * @param entry         Entry to instantiate. Will be locked upon return if
- *                      successful.
+/** Instantiate a locked directory entry.
+ * @param entry         Entry to instantiate. Will remain locked upon return
+ *                      if successful, and be unlocked otherwise.
  * @return              Status code describing result of the operation. */
-static status_t fs_dentry_instantiate(fs_dentry_t *entry) {
+static status_t fs_dentry_instantiate_locked(fs_dentry_t *entry) {
     status_t ret;
 
-    mutex_lock(&entry->lock);
+    assert(mutex_held(&entry->lock));
 
     if (refcount_inc(&entry->count) != 1) {
         assert(entry->node);
@@ -466,11 +665,22 @@ static status_t fs_dentry_instantiate(fs_dentry_t *entry) {
         spinlock_unlock(&unused_entries_lock);
     }
 
+    fs_dentry_set_walk_node(entry, node);
+
     mutex_unlock(&mount->lock);
     entry->node = node;
     return STATUS_SUCCESS;
 }
 
+/** Instantiate a directory entry.
+ * @param entry         Entry to instantiate. Will be locked upon return if
+ *                      successful.
+ * @return              Status code describing result of the operation. */
+static status_t fs_dentry_instantiate(fs_dentry_t *entry) {
+    mutex_lock(&entry->lock);
+    return fs_dentry_instantiate_locked(entry);
+}
+
 /**
  * Looks up a child entry in a directory, looking it up on the filesystem if it
  * cannot be found. This function does not handle '.' and '..' entries, an
@@ -504,14 +714,182 @@ static status_t fs_dentry_lookup(fs_dentry_t *parent, const char *name, fs_dentr
             return ret;
         }
 
-        radix_tree_insert(&parent->entries, name, entry);
+        fs_dentry_attach(parent, entry);
     }
 
     *_entry = entry;
     return STATUS_SUCCESS;
 }
 
-/** Look up an entry in the filesystem.
+/** Attempts to lock an unused directory entry so that it can be freed.
+ * @param entry         Entry to lock. The unused entry list must be locked.
+ * @return              Whether the entry, its parent and its mount were
+ *                      locked. Entries that have children cannot be freed. */
+static bool fs_dentry_trylock_unused(fs_dentry_t *entry) {
+    fs_dentry_t *parent = entry->parent;
+
+    /* We hold a spinlock, and the locking order is the opposite way round to
+     * what we want anyway, so we can only try to lock. */
+    if (!parent || mutex_lock_etc(&parent->lock, 0, 0) != STATUS_SUCCESS)
+        return false;
+
+    if (mutex_lock_etc(&entry->lock, 0, 0) == STATUS_SUCCESS) {
+        if (refcount_get(&entry->count) == 0 && radix_tree_empty(&entry->entries)) {
+            if (mutex_lock_etc(&entry->mount->lock, 0, 0) == STATUS_SUCCESS)
+                return true;
+        }
+
+        mutex_unlock(&entry->lock);
+    }
+
+    mutex_unlock(&parent->lock);
+    return false;
+}
+
+/**
+ * Frees unused directory entries, least recently used first. Entries which
+ * cannot currently be freed are moved to the back of the list, and each entry
+ * is looked at no more than once, so that they are not rescanned every time.
+ * The list is scanned in batches to bound the time spent with the lock held.
+ *
+ * @param count         Maximum number of entries to free.
+ *
+ * @return              Number of entries freed.
+ */
+static size_t fs_dentry_shrink(size_t count) {
+    size_t freed     = 0;
+    size_t remaining = unused_entry_count;
+
+    while (freed < count && remaining) {
+        fs_dentry_t *entry = NULL;
+
+        spinlock_lock(&unused_entries_lock);
+
+        for (size_t i = 0; i < FS_SHRINK_SCAN_BATCH && remaining; i++, remaining--) {
+            if (list_empty(&unused_entries)) {
+                remaining = 0;
+                break;
+            }
+
+            fs_dentry_t *exist = list_first(&unused_entries, fs_dentry_t, unused_link);
+
+            if (fs_dentry_trylock_unused(exist)) {
+                entry = exist;
+                unused_entry_count--;
+                list_remove(&entry->unused_link);
+                remaining--;
+                break;
+            }
+
+            list_append(&unused_entries, &exist->unused_link);
+        }
+
+        spinlock_unlock(&unused_entries_lock);
+
+        if (!entry)
+            continue;
+
+        fs_dentry_t *parent = entry->parent;
+        fs_mount_t *mount   = entry->mount;
+
+        list_remove(&entry->mount_link);
+        fs_dentry_clear_walk_node(entry);
+        mutex_unlock(&mount->lock);
+
+        fs_dentry_detach(parent, entry);
+
+        dprintf(
+            "fs: reclaimed entry '%s' (%p) on mount %" PRIu16 "\n",
+            entry->name, entry, mount->id);
+
+        mutex_unlock(&entry->lock);
+        mutex_unlock(&parent->lock);
+        fs_dentry_free(entry);
+        freed++;
+    }
+
+    return freed;
+}
+
+/** Frees unused nodes, least recently used first.
+ * @param count         Maximum number of nodes to free.
+ * @return              Number of nodes freed. */
+static size_t fs_node_shrink(size_t count) {
+    size_t freed   = 0;
+    size_t scanned = 0;
+
+    while (freed < count && scanned++ < count * 2) {
+        fs_node_t *node = NULL;
+
+        spinlock_lock(&unused_nodes_lock);
+
+        list_foreach(&unused_nodes, iter) {
+            fs_node_t *exist = list_entry(iter, fs_node_t, unused_link);
+
+            if (mutex_lock_etc(&exist->mount->lock, 0, 0) == STATUS_SUCCESS) {
+                node = exist;
+                break;
+            }
+        }
+
+        spinlock_unlock(&unused_nodes_lock);
+
+        if (!node)
+            break;
+
+        /* Holding the mount lock prevents the node from being used again or
+         * freed by anything else. Freeing may fail if the node cannot be
+         * flushed, in which case move it to the back of the list. */
+        fs_mount_t *mount = node->mount;
+        if (fs_node_free(node) == STATUS_SUCCESS) {
+            freed++;
+        } else {
+            spinlock_lock(&unused_nodes_lock);
+            list_append(&unused_nodes, &node->unused_link);
+            spinlock_unlock(&unused_nodes_lock);
+        }
+
+        mutex_unlock(&mount->lock);
+    }
+
+    return freed;
+}
+
+/** Main function for the node reclaim thread.
+ * @param arg1          Unused.
+ * @param arg2          Unused. */
+static void fs_reclaim_thread_entry(void *arg1, void *arg2) {
+    while (true) {
+        semaphore_down(&fs_reclaim_sem);
+
+        size_t count = atomic_exchange(&fs_reclaim_count, 0);
+        if (count)
+            fs_node_shrink(count);
+    }
+}
+
+/** Frees unused entries from the directory and node caches. */
+static size_t fs_shrink(size_t count) {
+    /* Free entries first, since unused nodes may then have no entries which
+     * refer to them. */
+    size_t freed = fs_dentry_shrink(count);
+
+    /* Freeing a node can flush it and write back its cached data, which needs
+     * I/O and memory allocations that the page daemon must not wait for. Hand
+     * it off to the reclaim thread. Its semaphore is only raised when the
+     * pending count was previously zero, so it cannot build up. */
+    if (unused_node_count && !atomic_fetch_add(&fs_reclaim_count, count))
+        semaphore_up(&fs_reclaim_sem, 1);
+
+    return freed;
+}
+
+static page_shrinker_t fs_shrinker = {
+    .name   = "fs",
+    .shrink = fs_shrink,
+};
+
+/** Look up an entry in the filesystem, taking locks down the path.
  * @param path          Path string to look up (will be modified).
  * @param entry         Instantiated entry to begin lookup at (NULL for current
  *                      working directory). Will be released upon return.
@@ -664,6 +1042,11 @@ static status_t fs_lookup_internal(
             } else {
                 entry = entry->parent;
             }
+
+            /* The entry has a child so it cannot be reclaimed, it is safe to
+             * unlock the child before instantiating it. */
+            mutex_unlock(&prev->lock);
+            ret = fs_dentry_instantiate(entry);
         } else {
             /* Try to find the entry in the child. */
             ret = fs_dentry_lookup(entry, tok, &entry);
@@ -672,11 +1055,13 @@ static status_t fs_lookup_internal(
 
             if (entry->mounted)
                 entry = entry->mounted->root;
-        }
 
-        mutex_unlock(&prev->lock);
+            /* The entry may be unused and could be reclaimed once the parent
+             * is unlocked, so instantiate it first. */
+            ret = fs_dentry_instantiate(entry);
+            mutex_unlock(&prev->lock);
+        }
 
-        ret = fs_dentry_instantiate(entry);
         if (ret != STATUS_SUCCESS) {
             fs_dentry_release(prev);
             return ret;
@@ -696,6 +1081,135 @@ err_release:
     return ret;
 }
 
+/**
+ * Looks up an entry without locking, using only entries that are already in
+ * the directory cache and have been instantiated before. Each entry on the
+ * path is checked not to have changed after moving on to its child, and the
+ * entry found is locked and checked before it is instantiated. This does not
+ * handle uncached entries, mount crossings or symbolic links, and gives up if
+ * any entry changes during the lookup. The I/O context lock must be held.
+ *
+ * @param path          Path string to look up.
+ * @param flags         Lookup behaviour flags.
+ * @param _entry        Where to store pointer to entry found (referenced,
+ *                      and locked if FS_LOOKUP_LOCK is specified).
+ *
+ * @return              Whether the entry was found. If not, the lookup must
+ *                      be done again with fs_lookup_internal(), which gives
+ *                      the actual result.
+ */
+static bool fs_lookup_rcu(const char *path, unsigned flags, fs_dentry_t **_entry) {
+    fs_dentry_t *entry;
+
+    if (path[0] == '/') {
+        while (path[0] == '/')
+            path++;
+
+        entry = curr_proc->io.root_dir;
+    } else {
+        entry = curr_proc->io.curr_dir;
+    }
+
+    /* The starting entry is referenced by the I/O context, which keeps it and
+     * its mount alive. Since we never leave that mount, the mount cannot go
+     * away during the lookup. Entries are freed after an RCU grace period. */
+    rcu_read_lock();
+
+    uint32_t seq = fs_dentry_read_begin(entry);
+    while (true) {
+        if (seq & 1)
+            goto fail;
+
+        fs_node_t *node = rcu_dereference(entry->walk_node);
+        if (!node)
+            goto fail;
+
+        /* Split off the next path component in the same way as strsep(). */
+        const char *tok = path;
+        size_t len = 0;
+        if (tok) {
+            while (tok[len] && tok[len] != '/')
+                len++;
+
+            path = (tok[len]) ? &tok[len + 1] : NULL;
+        }
+
+        bool follow = tok || flags & FS_LOOKUP_FOLLOW;
+        if (node->file.type == FILE_TYPE_SYMLINK && follow) {
+            goto fail;
+        } else if (!tok) {
+            break;
+        } else if (node->file.type != FILE_TYPE_DIR) {
+            goto fail;
+        } else if (!len || (len == 1 && tok[0] == '.')) {
+            continue;
+        }
+
+        if (!file_access(&node->file, FILE_ACCESS_EXECUTE))
+            goto fail;
+
+        fs_dentry_t *next;
+        uint32_t next_seq;
+        if (len == 2 && tok[0] == '.' && tok[1] == '.') {
+            if (entry == curr_proc->io.root_dir)
+                continue;
+
+            /* Moving onto the mountpoint's parent is left to the locked walk. */
+            if (entry == entry->mount->root)
+                goto fail;
+
+            next     = entry->parent;
+            next_seq = fs_dentry_read_begin(next);
+        } else {
+            next = fs_dentry_hash_lookup(entry, tok, len);
+            if (!next)
+                goto fail;
+
+            /* Mount crossings are left to the locked walk. This is checked
+             * after getting the sequence count, so that a mount that happens
+             * after the check is seen when the count is checked in turn. */
+            next_seq = fs_dentry_read_begin(next);
+            if (next->mounted)
+                goto fail;
+        }
+
+        /* Check that the current entry is still valid now that we have got to
+         * its child. Changes to the child after this will change its sequence
+         * count, so will be detected when it is checked in turn. */
+        if (fs_dentry_read_retry(entry, seq))
+            goto fail;
+
+        entry = next;
+        seq   = next_seq;
+    }
+
+    /* An entry cannot be reclaimed or unlinked while it is locked, so once we
+     * have checked that it has not changed, it can be safely instantiated. We
+     * must only try to lock as we are within a read-side critical section. */
+    if (mutex_lock_etc(&entry->lock, 0, 0) != STATUS_SUCCESS)
+        goto fail;
+
+    if (fs_dentry_read_retry(entry, seq)) {
+        mutex_unlock(&entry->lock);
+        goto fail;
+    }
+
+    rcu_read_unlock();
+
+    if (fs_dentry_instantiate_locked(entry) != STATUS_SUCCESS)
+        return false;
+
+    if (!(flags & FS_LOOKUP_LOCK))
+        mutex_unlock(&entry->lock);
+
+    *_entry = entry;
+    return true;
+
+fail:
+    rcu_read_unlock();
+    return false;
+}
+
 /**
  * Looks up an entry in the filesystem. If the path is a relative path (one
  * that does not begin with a '/' character), then it will be looked up
@@ -721,6 +1235,13 @@ static status_t fs_lookup(const char *path, unsigned flags, fs_dentry_t **_entry
      * lookup is being performed. */
     rwlock_read_lock(&curr_proc->io.lock);
 
+    /* Try a lockless lookup first, which will succeed for most lookups of
+     * cached paths. */
+    if (fs_lookup_rcu(path, flags, _entry)) {
+        rwlock_unlock(&curr_proc->io.lock);
+        return STATUS_SUCCESS;
+    }
+
     /* Duplicate path so that fs_lookup_internal() can modify it. */
     char *dup = kstrdup(path, MM_KERNEL);
 
@@ -870,7 +1391,11 @@ static void fs_create_finish(fs_dentry_t *entry, fs_node_t *node) {
     /* Instantiate the directory entry and attach to the parent. */
     refcount_set(&entry->count, 1);
     entry->node = node;
-    radix_tree_insert(&parent->entries, entry->name, entry);
+    fs_dentry_attach(parent, entry);
+
+    mutex_lock(&entry->mount->lock);
+    fs_dentry_set_walk_node(entry, node);
+    mutex_unlock(&entry->mount->lock);
 
     fs_dentry_release_locked(parent);
 }
@@ -1414,8 +1939,13 @@ status_t fs_mount(
     mutex_unlock(&mount->root->lock);
 
     /* Make the mountpoint point to the new mount. */
-    if (mount->mountpoint)
+    if (mount->mountpoint) {
+        mutex_lock(&mount->mountpoint->lock);
+        fs_dentry_write_begin(mount->mountpoint);
         mount->mountpoint->mounted = mount;
+        fs_dentry_write_end(mount->mountpoint);
+        mutex_unlock(&mount->mountpoint->lock);
+    }
 
     refcount_inc(&mount->type->count);
     list_append(&fs_mount_list, &mount->header);
@@ -1497,9 +2027,11 @@ status_t fs_unmount(const char *path, unsigned flags) {
 
     /* Lock the entry containing the mountpoint. Once we have determined that
      * no entries on the mount are in use, this will ensure that no lookups
-     * will descend into the mount. */
+     * will descend into the mount. The mountpoint itself is locked to detach
+     * the mount from it. */
     fs_dentry_t *parent = mount->mountpoint->parent;
     mutex_lock(&parent->lock);
+    mutex_lock(&mount->mountpoint->lock);
     mutex_lock(&mount->lock);
 
     /* Check that we are the only user of the root, and whether any entries
@@ -1531,6 +2063,7 @@ status_t fs_unmount(const char *path, unsigned flags) {
         }
 
         list_remove(&entry->mount_link);
+        fs_dentry_clear_walk_node(entry);
         fs_dentry_free(entry);
     }
 
@@ -1569,7 +2102,10 @@ status_t fs_unmount(const char *path, unsigned flags) {
     fs_dentry_free(root);
 
     /* Detach from the mountpoint. */
+    fs_dentry_write_begin(mount->mountpoint);
     mount->mountpoint->mounted = NULL;
+    fs_dentry_write_end(mount->mountpoint);
+    mutex_unlock(&mount->mountpoint->lock);
     mutex_unlock(&parent->lock);
     fs_dentry_release(mount->mountpoint);
 
@@ -1589,6 +2125,7 @@ status_t fs_unmount(const char *path, unsigned flags) {
 
 err_unlock_mount:
     mutex_unlock(&mount->lock);
+    mutex_unlock(&mount->mountpoint->lock);
     mutex_unlock(&parent->lock);
     goto err_unlock;
 
@@ -1805,7 +2342,7 @@ status_t fs_unlink(const char *path) {
     if (ret != STATUS_SUCCESS)
         goto out_release_entry;
 
-    radix_tree_remove(&parent->entries, entry->name, NULL);
+    fs_dentry_detach(parent, entry);
     entry->parent = NULL;
 
 out_release_entry:
@@ -2163,6 +2700,16 @@ __init_text void fs_init(void) {
     fs_dentry_cache = object_cache_create(
         "fs_dentry_cache", fs_dentry_t, fs_dentry_ctor, NULL, NULL, 0, MM_BOOT);
 
+    page_shrinker_register(&fs_shrinker);
+
+    status_t ret = thread_create(
+        "fs_reclaim", NULL, 0, fs_reclaim_thread_entry, NULL, NULL,
+        &fs_reclaim_thread);
+    if (ret != STATUS_SUCCESS)
+        fatal("Failed to create filesystem reclaim thread: %d", ret);
+
+    thread_run(fs_reclaim_thread);
+
     /* Register the KDB commands. */
     kdb_register_command(
         "mount",
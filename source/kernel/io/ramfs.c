@@ -205,7 +205,7 @@ static status_t ramfs_node_io(file_handle_t *handle, io_request_t *request) {
             vm_cache_resize(node->cache, end);
     }
 
-    status_t ret = vm_cache_io(node->cache, request);
+    status_t ret = vm_cache_io(node->cache, request, &handle->readahead);
     if (ret != STATUS_SUCCESS)
         return ret;
 
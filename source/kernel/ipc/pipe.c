@@ -17,12 +17,27 @@
 /**
  * @file
  * @brief               Unidirectional data pipe implementation.
+ *
+ * A pipe is a circular buffer of PIPE_SIZE bytes. Transfers copy data in bulk
+ * between the buffer and the I/O request: a transfer that wraps around the end
+ * of the buffer is done as two copies. Waiters are only woken once for each
+ * copy rather than for each byte transferred.
+ *
+ * Writes of up to PIPE_SIZE bytes are atomic: they wait until the whole write
+ * can be performed at once, so that the data from multiple writers is never
+ * interleaved. Larger writes are split up into as many chunks as are needed.
+ * Reads return as soon as any data is available.
  */
 
+#include <io/file.h>
 #include <io/request.h>
 
 #include <ipc/pipe.h>
 
+#include <kernel/pipe.h>
+
+#include <lib/utility.h>
+
 #include <mm/kmem.h>
 #include <mm/malloc.h>
 #include <mm/slab.h>
@@ -33,6 +48,15 @@
 #include <kernel.h>
 #include <object.h>
 #include <status.h>
+#include <time.h>
+
+/** Structure for a pipe file created with kern_pipe_create(). */
+typedef struct pipe_file {
+    file_t file;                    /**< File header. */
+    pipe_t *pipe;                   /**< Pipe implementation. */
+    size_t readers;                 /**< Number of handles to the read end. */
+    size_t writers;                 /**< Number of handles to the write end. */
+} pipe_file_t;
 
 static slab_cache_t *pipe_cache;
 
@@ -40,188 +64,174 @@ static void pipe_ctor(void *obj, void *data) {
     pipe_t *pipe = obj;
 
     mutex_init(&pipe->lock, "pipe_lock", 0);
+    condvar_init(&pipe->space_cvar, "pipe_space_cvar");
     notifier_init(&pipe->space_notifier, pipe);
+    condvar_init(&pipe->data_cvar, "pipe_data_cvar");
     notifier_init(&pipe->data_notifier, pipe);
 }
 
-static inline char pipe_get(pipe_t *pipe) {
-    char ch;
+/**
+ * Copies data between a pipe's buffer and an I/O request, and wakes anything
+ * waiting for the result. If the copy fails, the pipe is left unchanged and
+ * the request's transferred count is restored.
+ *
+ * @param pipe          Pipe to copy for (lock must be held).
+ * @param request       Request to copy for.
+ * @param size          Number of bytes to copy. For a read, the pipe must have
+ *                      at least this much data, for a write, at least this
+ *                      much space.
+ *
+ * @return              Status code describing result of the operation.
+ */
+static status_t pipe_copy(pipe_t *pipe, io_request_t *request, size_t size) {
+    size_t transferred = request->transferred;
+    size_t pos         = (request->op == IO_OP_READ)
+        ? pipe->start
+        : (pipe->start + pipe->count) % PIPE_SIZE;
+
+    /* Copy up to the end of the buffer, then any remainder from the start. */
+    size_t first = min(size, PIPE_SIZE - pos);
+    status_t ret = io_request_copy(request, &pipe->buf[pos], first);
+    if (ret == STATUS_SUCCESS && first < size)
+        ret = io_request_copy(request, &pipe->buf[0], size - first);
+
+    if (ret != STATUS_SUCCESS) {
+        request->transferred = transferred;
+        return ret;
+    }
 
-    ch = pipe->buf[pipe->start];
-    if (++pipe->start >= PIPE_SIZE)
-        pipe->start = 0;
+    if (request->op == IO_OP_READ) {
+        pipe->start = (pipe->start + size) % PIPE_SIZE;
+        pipe->count -= size;
 
-    semaphore_up(&pipe->space_sem, 1);
-    return ch;
-}
+        condvar_broadcast(&pipe->space_cvar);
+        notifier_run(&pipe->space_notifier, NULL, false);
+    } else {
+        pipe->count += size;
 
-static inline void pipe_insert(pipe_t *pipe, char ch) {
-    pipe->buf[pipe->end] = ch;
-    if (++pipe->end >= PIPE_SIZE)
-        pipe->end = 0;
+        condvar_broadcast(&pipe->data_cvar);
+        notifier_run(&pipe->data_notifier, NULL, false);
+    }
 
-    semaphore_up(&pipe->data_sem, 1);
+    return STATUS_SUCCESS;
 }
 
 /**
- * Reads data from a pipe into a buffer. Reads of less than or equal to
- * PIPE_SIZE will either read all the requested data, or none at all. Reads of
- * greater than PIPE_SIZE may only return part of the data. A read may not be
- * able to read all data if the calling thread is interrupted, or non-blocking
- * mode is requested.
+ * Perform I/O on a pipe. Writes of less than or equal to PIPE_SIZE will either
+ * transfer all the requested data, or none at all. Writes of greater than
+ * PIPE_SIZE may only transfer part of the data. A read waits until some data
+ * is available, and then returns as much of it as fits in the request without
+ * waiting for more. A transfer may not be able to complete if the calling
+ * thread is interrupted, or non-blocking mode is requested. If the write end
+ * of the pipe is closed, a read will return whatever data remains, if the read
+ * end is closed, writes will fail.
  *
- * @param pipe          Pipe to read from.
- * @param buf           Buffer to read into.
- * @param count         Number of bytes to read.
+ * @param pipe          Pipe to perform I/O on.
+ * @param request       I/O request. The data is copied directly to/from the
+ *                      request, and its transferred count is updated.
  * @param nonblock      Whether to allow blocking.
- * @param _bytes        Where to store number of bytes read.
  *
  * @return              Status code describing result of the operation.
  */
-status_t pipe_read(pipe_t *pipe, char *buf, size_t count, bool nonblock, size_t *_bytes) {
+status_t pipe_io(pipe_t *pipe, io_request_t *request, bool nonblock) {
+    bool is_read = request->op == IO_OP_READ;
+    bool atomic  = !is_read && request->total <= PIPE_SIZE;
     status_t ret = STATUS_SUCCESS;
-    size_t bytes = 0;
-
-    if (count && count <= PIPE_SIZE) {
-        /* Try to get all required data before reading. */
-        for (bytes = 0; bytes < count; bytes++) {
-            ret = semaphore_down_etc(&pipe->data_sem, (nonblock) ? 0 : -1, SLEEP_INTERRUPTIBLE);
-            if (ret != STATUS_SUCCESS) {
-                semaphore_up(&pipe->data_sem, bytes);
-                bytes = 0;
-                goto out;
-            }
-        }
-
-        mutex_lock(&pipe->lock);
 
-        for (bytes = 0; bytes < count; bytes++)
-            buf[bytes] = pipe_get(pipe);
-
-        notifier_run(&pipe->space_notifier, NULL, false);
+    mutex_lock(&pipe->lock);
+
+    while (request->transferred < request->total) {
+        size_t remaining = request->total - request->transferred;
+        size_t available = (is_read) ? pipe->count : PIPE_SIZE - pipe->count;
+
+        if (is_read && pipe->write_closed) {
+            /* No more data will arrive, return whatever is left. */
+            if (!available)
+                break;
+        } else if (!is_read && pipe->read_closed) {
+            ret = STATUS_CONN_HUNGUP;
+            break;
+        } else if (!available || (atomic && available < remaining)) {
+            /* Don't wait for more data once a read has got some. */
+            if (is_read && request->transferred)
+                break;
+
+            if (nonblock) {
+                ret = STATUS_WOULD_BLOCK;
+                break;
+            }
 
-        mutex_unlock(&pipe->lock);
-    } else if (count) {
-        for (bytes = 0; bytes < count; bytes++) {
-            ret = semaphore_down_etc(&pipe->data_sem, (nonblock) ? 0 : -1, SLEEP_INTERRUPTIBLE);
+            ret = condvar_wait_etc(
+                (is_read) ? &pipe->data_cvar : &pipe->space_cvar, &pipe->lock,
+                -1, SLEEP_INTERRUPTIBLE);
             if (ret != STATUS_SUCCESS)
-                goto out;
+                break;
 
-            mutex_lock(&pipe->lock);
+            continue;
+        }
 
-            buf[bytes] = pipe_get(pipe);
+        ret = pipe_copy(pipe, request, min(available, remaining));
+        if (ret != STATUS_SUCCESS)
+            break;
+    }
 
-            notifier_run(&pipe->space_notifier, NULL, false);
+    mutex_unlock(&pipe->lock);
+    return ret;
+}
 
-            mutex_unlock(&pipe->lock);
-        }
+static status_t pipe_kernel_io(
+    pipe_t *pipe, void *buf, size_t count, io_op_t op, bool nonblock,
+    size_t *_bytes)
+{
+    io_vec_t vec;
+    vec.buffer = buf;
+    vec.size   = count;
+
+    io_request_t request;
+    status_t ret = io_request_init(&request, &vec, 1, 0, op, IO_TARGET_KERNEL);
+    if (ret == STATUS_SUCCESS) {
+        ret = pipe_io(pipe, &request, nonblock);
+        io_request_destroy(&request);
+    } else {
+        request.transferred = 0;
     }
 
-out:
     if (_bytes)
-        *_bytes = bytes;
+        *_bytes = request.transferred;
 
     return ret;
 }
 
 /**
- * Writes data from a buffer to a pipe. Writes of less than or equal to
- * PIPE_SIZE will either write all the requested data, or none at all. Writes
- * of greater than PIPE_SIZE may only write part of the data. A write may not
- * be able to write all data if the calling thread is interrupted, or
- * non-blocking mode is requested.
+ * Reads data from a pipe into a buffer. See pipe_io() for details of the
+ * behaviour of this function.
  *
  * @param pipe          Pipe to read from.
  * @param buf           Buffer to read into.
  * @param count         Number of bytes to read.
  * @param nonblock      Whether to allow blocking.
- * @param _bytes        Where to store number of bytes written.
+ * @param _bytes        Where to store number of bytes read.
  *
  * @return              Status code describing result of the operation.
  */
-status_t pipe_write(pipe_t *pipe, const char *buf, size_t count, bool nonblock, size_t *_bytes) {
-    status_t ret = STATUS_SUCCESS;
-    size_t bytes = 0;
-
-    if (count && count <= PIPE_SIZE) {
-        /* Try to get all required space before writing. */
-        for (bytes = 0; bytes < count; bytes++) {
-            ret = semaphore_down_etc(&pipe->space_sem, (nonblock) ? 0 : -1, SLEEP_INTERRUPTIBLE);
-            if (ret != STATUS_SUCCESS) {
-                semaphore_up(&pipe->space_sem, bytes);
-                bytes = 0;
-                goto out;
-            }
-        }
-
-        mutex_lock(&pipe->lock);
-
-        for (bytes = 0; bytes < count; bytes++)
-            pipe_insert(pipe, buf[bytes]);
-
-        /* For atomic writes, we only run the data notifier after writing
-         * everything, so we don't do too many calls. */
-        notifier_run(&pipe->data_notifier, NULL, false);
-
-        mutex_unlock(&pipe->lock);
-    } else if (count) {
-        for (bytes = 0; bytes < count; bytes++) {
-            ret = semaphore_down_etc(&pipe->space_sem, (nonblock) ? 0 : -1, SLEEP_INTERRUPTIBLE);
-            if (ret != STATUS_SUCCESS)
-                goto out;
-
-            mutex_lock(&pipe->lock);
-
-            pipe_insert(pipe, buf[bytes]);
-
-            notifier_run(&pipe->data_notifier, NULL, false);
-
-            mutex_unlock(&pipe->lock);
-        }
-    }
-
-out:
-    if (_bytes)
-        *_bytes = bytes;
-
-    return ret;
+status_t pipe_read(pipe_t *pipe, char *buf, size_t count, bool nonblock, size_t *_bytes) {
+    return pipe_kernel_io(pipe, buf, count, IO_OP_READ, nonblock, _bytes);
 }
 
-/** Perform I/O on a pipe.
- * @param pipe          Pipe to perform I/O on.
- * @param request       I/O request.
+/**
+ * Writes data from a buffer to a pipe. See pipe_io() for details of the
+ * behaviour of this function.
+ *
+ * @param pipe          Pipe to write to.
+ * @param buf           Buffer containing data to write.
+ * @param count         Number of bytes to write.
  * @param nonblock      Whether to allow blocking.
- * @return              Status code describing result of the operation. */
-status_t pipe_io(pipe_t *pipe, io_request_t *request, bool nonblock) {
-    status_t ret;
-
-    char *buf = kmalloc(request->total, MM_USER);
-    if (!buf)
-        return STATUS_NO_MEMORY;
-
-    if (request->op == IO_OP_READ) {
-        size_t count;
-        ret = pipe_read(pipe, buf, request->total, nonblock, &count);
-
-        if (count) {
-            status_t err = io_request_copy(request, buf, count);
-            if (err != STATUS_SUCCESS)
-                ret = err;
-        }
-    } else {
-        ret = io_request_copy(request, buf, request->total);
-        if (ret != STATUS_SUCCESS) {
-            kfree(buf);
-            return ret;
-        }
-
-        size_t count;
-        ret = pipe_write(pipe, buf, request->total, nonblock, &count);
-        request->transferred -= request->total - count;
-    }
-
-    kfree(buf);
-    return ret;
+ * @param _bytes        Where to store number of bytes written.
+ *
+ * @return              Status code describing result of the operation.
+ */
+status_t pipe_write(pipe_t *pipe, const char *buf, size_t count, bool nonblock, size_t *_bytes) {
+    return pipe_kernel_io(pipe, (void *)buf, count, IO_OP_WRITE, nonblock, _bytes);
 }
 
 /**
@@ -235,19 +245,23 @@ status_t pipe_io(pipe_t *pipe, io_request_t *request, bool nonblock) {
  * @param event         Object event structure.
  */
 void pipe_wait(pipe_t *pipe, bool write, object_event_t *event) {
+    mutex_lock(&pipe->lock);
+
     if (write) {
-        if (semaphore_count(&pipe->space_sem)) {
+        if (pipe->count < PIPE_SIZE || pipe->read_closed) {
             object_event_signal(event, 0);
         } else {
             notifier_register(&pipe->space_notifier, object_event_notifier, event);
         }
     } else {
-        if (semaphore_count(&pipe->data_sem)) {
+        if (pipe->count || pipe->write_closed) {
             object_event_signal(event, 0);
         } else {
             notifier_register(&pipe->data_notifier, object_event_notifier, event);
         }
     }
+
+    mutex_unlock(&pipe->lock);
 }
 
 /** Stop waiting for a pipe event.
@@ -259,17 +273,49 @@ void pipe_unwait(pipe_t *pipe, bool write, object_event_t *event) {
     notifier_unregister(notifier, object_event_notifier, event);
 }
 
+/** Marks one end of a pipe as closed (lock must be held).
+ * @see                 pipe_close(). */
+static void pipe_close_locked(pipe_t *pipe, bool write) {
+    assert(mutex_held(&pipe->lock));
+
+    if (write) {
+        pipe->write_closed = true;
+    } else {
+        pipe->read_closed = true;
+    }
+
+    /* Wake everything up to see the change. */
+    condvar_broadcast(&pipe->space_cvar);
+    notifier_run(&pipe->space_notifier, NULL, false);
+    condvar_broadcast(&pipe->data_cvar);
+    notifier_run(&pipe->data_notifier, NULL, false);
+}
+
+/**
+ * Marks one end of a pipe as closed. Once the write end is closed, reads will
+ * return any remaining data and then return no data rather than blocking. Once
+ * the read end is closed, writes will fail with STATUS_CONN_HUNGUP.
+ *
+ * @param pipe          Pipe to close.
+ * @param write         Whether to close the write end (true) or the read end
+ *                      (false).
+ */
+void pipe_close(pipe_t *pipe, bool write) {
+    mutex_lock(&pipe->lock);
+    pipe_close_locked(pipe, write);
+    mutex_unlock(&pipe->lock);
+}
+
 /** Create a new pipe.
  * @return              Pointer to pipe structure. */
 pipe_t *pipe_create(void) {
     pipe_t *pipe = slab_cache_alloc(pipe_cache, MM_KERNEL);
 
-    semaphore_init(&pipe->space_sem, "pipe_space_sem", PIPE_SIZE);
-    semaphore_init(&pipe->data_sem, "pipe_data_sem", 0);
-
-    pipe->buf   = kmem_alloc(PIPE_SIZE, MM_KERNEL);
-    pipe->start = 0;
-    pipe->end   = 0;
+    pipe->buf          = kmem_alloc(PIPE_SIZE, MM_KERNEL);
+    pipe->start        = 0;
+    pipe->count        = 0;
+    pipe->read_closed  = false;
+    pipe->write_closed = false;
 
     return pipe;
 }
@@ -286,6 +332,164 @@ void pipe_destroy(pipe_t *pipe) {
     slab_cache_free(pipe_cache, pipe);
 }
 
+/** Update end counts for a new handle to a pipe file (lock must be held). */
+static status_t pipe_file_get(pipe_file_t *file, uint32_t access) {
+    /* Can't reopen an end that has been closed. */
+    if ((access & FILE_ACCESS_READ && file->pipe->read_closed) ||
+        (access & FILE_ACCESS_WRITE && file->pipe->write_closed))
+    {
+        return STATUS_CONN_HUNGUP;
+    }
+
+    if (access & FILE_ACCESS_READ)
+        file->readers++;
+    if (access & FILE_ACCESS_WRITE)
+        file->writers++;
+
+    return STATUS_SUCCESS;
+}
+
+/** Open a handle to a pipe file. */
+static status_t pipe_file_open(file_handle_t *handle) {
+    pipe_file_t *file = (pipe_file_t *)handle->file;
+
+    mutex_lock(&file->pipe->lock);
+    status_t ret = pipe_file_get(file, handle->access);
+    mutex_unlock(&file->pipe->lock);
+
+    return ret;
+}
+
+/** Close a handle to a pipe file. */
+static void pipe_file_close(file_handle_t *handle) {
+    pipe_file_t *file = (pipe_file_t *)handle->file;
+    pipe_t *pipe      = file->pipe;
+
+    mutex_lock(&pipe->lock);
+
+    if (handle->access & FILE_ACCESS_READ && --file->readers == 0)
+        pipe_close_locked(pipe, false);
+    if (handle->access & FILE_ACCESS_WRITE && --file->writers == 0)
+        pipe_close_locked(pipe, true);
+
+    bool destroy = !file->readers && !file->writers;
+
+    /* Once unlocked, the other end may close and free the file, so it must
+     * not be touched after this unless we are the last user. */
+    mutex_unlock(&pipe->lock);
+
+    if (destroy) {
+        pipe_destroy(pipe);
+        kfree(file);
+    }
+}
+
+/** Signal that a pipe file event is being waited for. */
+static status_t pipe_file_wait(file_handle_t *handle, object_event_t *event) {
+    pipe_file_t *file = (pipe_file_t *)handle->file;
+
+    switch (event->event) {
+        case FILE_EVENT_READABLE:
+            if (!(handle->access & FILE_ACCESS_READ))
+                return STATUS_ACCESS_DENIED;
+
+            pipe_wait(file->pipe, false, event);
+            return STATUS_SUCCESS;
+        case FILE_EVENT_WRITABLE:
+            if (!(handle->access & FILE_ACCESS_WRITE))
+                return STATUS_ACCESS_DENIED;
+
+            pipe_wait(file->pipe, true, event);
+            return STATUS_SUCCESS;
+        default:
+            return STATUS_INVALID_EVENT;
+    }
+}
+
+/** Stop waiting for a pipe file event. */
+static void pipe_file_unwait(file_handle_t *handle, object_event_t *event) {
+    pipe_file_t *file = (pipe_file_t *)handle->file;
+
+    pipe_unwait(file->pipe, event->event == FILE_EVENT_WRITABLE, event);
+}
+
+/** Perform I/O on a pipe file. */
+static status_t pipe_file_io(file_handle_t *handle, io_request_t *request) {
+    pipe_file_t *file = (pipe_file_t *)handle->file;
+
+    return pipe_io(file->pipe, request, handle->flags & FILE_NONBLOCK);
+}
+
+/** Get information about a pipe file. */
+static void pipe_file_info(file_handle_t *handle, file_info_t *info) {
+    pipe_file_t *file = (pipe_file_t *)handle->file;
+
+    info->id         = 0;
+    info->mount      = 0;
+    info->type       = file->file.type;
+    info->block_size = PIPE_SIZE;
+    info->size       = 0;
+    info->links      = 1;
+    info->created    = info->accessed = info->modified = unix_time();
+}
+
+/** File operations for a pipe file. */
+static file_ops_t pipe_file_ops = {
+    .open   = pipe_file_open,
+    .close  = pipe_file_close,
+    .wait   = pipe_file_wait,
+    .unwait = pipe_file_unwait,
+    .io     = pipe_file_io,
+    .info   = pipe_file_info,
+};
+
+/**
+ * Creates a new anonymous pipe, and returns a handle to each end of it. The
+ * pipe remains in existence until all handles to both ends have been closed.
+ * Once all handles to the write end are closed, reads from the read end will
+ * return any remaining data and then return end of file. Once all handles to
+ * the read end are closed, writes to the write end will fail.
+ *
+ * @param handles       Where to store handles to the pipe. The first handle
+ *                      is the read end (has FILE_ACCESS_READ), the second is
+ *                      the write end (has FILE_ACCESS_WRITE).
+ *
+ * @return              Status code describing result of the operation.
+ */
+status_t kern_pipe_create(handle_t handles[2]) {
+    status_t ret;
+
+    if (!handles)
+        return STATUS_INVALID_ARG;
+
+    pipe_file_t *file = kmalloc(sizeof(*file), MM_KERNEL);
+
+    file->file.ops  = &pipe_file_ops;
+    file->file.type = FILE_TYPE_FIFO;
+    file->pipe      = pipe_create();
+    file->readers   = 1;
+    file->writers   = 1;
+
+    /* Once the read end handle is created, closing it will handle cleaning up
+     * the file if anything fails. */
+    object_handle_t *read_handle = file_handle_create(
+        file_handle_alloc(&file->file, FILE_ACCESS_READ, 0));
+    object_handle_t *write_handle = file_handle_create(
+        file_handle_alloc(&file->file, FILE_ACCESS_WRITE, 0));
+
+    handle_t read_id;
+    ret = object_handle_attach(read_handle, &read_id, &handles[0]);
+    if (ret == STATUS_SUCCESS) {
+        ret = object_handle_attach(write_handle, NULL, &handles[1]);
+        if (ret != STATUS_SUCCESS)
+            object_handle_detach(read_id);
+    }
+
+    object_handle_release(read_handle);
+    object_handle_release(write_handle);
+    return ret;
+}
+
 static __init_text void pipe_cache_init(void) {
     pipe_cache = object_cache_create("pipe_cache", pipe_t, pipe_ctor, NULL, NULL, 0, MM_BOOT);
 }
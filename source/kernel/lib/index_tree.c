@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Integer-keyed radix tree.
+ *
+ * The functions in this file implement a radix tree keyed by 64-bit integers,
+ * intended for sparse indices such as the pages of a cache. Each level of the
+ * tree handles INDEX_TREE_BITS bits of the key, and the tree grows upwards
+ * from a single leaf node as larger keys are inserted.
+ *
+ * Modifications to a tree must be serialised by the caller, but lookups may
+ * be performed without any locking, concurrently with modifications. Slots
+ * are only ever updated with atomic stores, and a new node is fully set up
+ * before it is published. Nodes are not freed when they become empty, as a
+ * concurrent lookup may still be looking at them: they are only freed when
+ * the tree is destroyed.
+ */
+
+#include <lib/index_tree.h>
+
+#include <mm/malloc.h>
+
+#include <assert.h>
+
+/** Mask to get the slot index for a level. */
+#define INDEX_TREE_MASK     (INDEX_TREE_SLOTS - 1)
+
+/** Allocate a new node.
+ * @param shift         Shift for the node's level.
+ * @return              Pointer to allocated node. */
+static index_tree_node_t *index_tree_node_alloc(unsigned shift) {
+    index_tree_node_t *node = kmalloc(sizeof(*node), MM_KERNEL);
+
+    for (size_t i = 0; i < INDEX_TREE_SLOTS; i++)
+        atomic_init(&node->slots[i], NULL);
+
+    node->shift = shift;
+    return node;
+}
+
+/** Recursively free a node and its children.
+ * @param node          Node to free. */
+static void index_tree_node_free(index_tree_node_t *node) {
+    if (node->shift) {
+        for (size_t i = 0; i < INDEX_TREE_SLOTS; i++) {
+            index_tree_node_t *child = atomic_load_explicit(&node->slots[i], memory_order_relaxed);
+            if (child)
+                index_tree_node_free(child);
+        }
+    }
+
+    kfree(node);
+}
+
+/** Get the highest key that a node's subtree can contain. */
+static inline uint64_t index_tree_node_max(index_tree_node_t *node) {
+    unsigned bits = node->shift + INDEX_TREE_BITS;
+    return (bits < 64) ? ((uint64_t)1 << bits) - 1 : UINT64_MAX;
+}
+
+/** Get the slot for a key within a node. */
+static inline _Atomic(void *) *index_tree_node_slot(index_tree_node_t *node, uint64_t key) {
+    return &node->slots[(key >> node->shift) & INDEX_TREE_MASK];
+}
+
+/** Find the leaf slot for a key.
+ * @param tree          Tree to search.
+ * @param key           Key to find.
+ * @return              Pointer to slot, or NULL if there is no leaf node
+ *                      that could contain the key. */
+static _Atomic(void *) *index_tree_find_slot(index_tree_t *tree, uint64_t key) {
+    index_tree_node_t *node = atomic_load_explicit(&tree->root, memory_order_acquire);
+    if (!node || key > index_tree_node_max(node))
+        return NULL;
+
+    while (node->shift) {
+        node = atomic_load_explicit(index_tree_node_slot(node, key), memory_order_acquire);
+        if (!node)
+            return NULL;
+    }
+
+    return index_tree_node_slot(node, key);
+}
+
+/** Insert an entry into an index tree.
+ * @param tree          Tree to insert into.
+ * @param key           Key to insert. Must not already be in the tree.
+ * @param value         Value to insert. Must not be NULL. */
+void index_tree_insert(index_tree_t *tree, uint64_t key, void *value) {
+    assert(value);
+
+    index_tree_node_t *node = atomic_load_explicit(&tree->root, memory_order_relaxed);
+    if (!node) {
+        node = index_tree_node_alloc(0);
+        atomic_store_explicit(&tree->root, node, memory_order_release);
+    }
+
+    /* Grow the tree upwards until the root covers the key. Concurrent lookups
+     * on the old root still work as it remains at the same key range. */
+    while (key > index_tree_node_max(node)) {
+        index_tree_node_t *parent = index_tree_node_alloc(node->shift + INDEX_TREE_BITS);
+        atomic_init(&parent->slots[0], node);
+        atomic_store_explicit(&tree->root, parent, memory_order_release);
+        node = parent;
+    }
+
+    /* Descend to the leaf, creating nodes as needed. */
+    while (node->shift) {
+        _Atomic(void *) *slot = index_tree_node_slot(node, key);
+
+        index_tree_node_t *child = atomic_load_explicit(slot, memory_order_relaxed);
+        if (!child) {
+            child = index_tree_node_alloc(node->shift - INDEX_TREE_BITS);
+            atomic_store_explicit(slot, child, memory_order_release);
+        }
+
+        node = child;
+    }
+
+    _Atomic(void *) *slot = index_tree_node_slot(node, key);
+    assert(!atomic_load_explicit(slot, memory_order_relaxed));
+    atomic_store_explicit(slot, value, memory_order_release);
+}
+
+/** Remove an entry from an index tree.
+ * @param tree          Tree to remove from.
+ * @param key           Key to remove.
+ * @return              Value that was removed, or NULL if not found. */
+void *index_tree_remove(index_tree_t *tree, uint64_t key) {
+    _Atomic(void *) *slot = index_tree_find_slot(tree, key);
+    if (!slot)
+        return NULL;
+
+    return atomic_exchange_explicit(slot, NULL, memory_order_release);
+}
+
+/** Look up an entry in an index tree.
+ * @param tree          Tree to look up in.
+ * @param key           Key to look up.
+ * @return              Value found, or NULL if not found. */
+void *index_tree_lookup(index_tree_t *tree, uint64_t key) {
+    _Atomic(void *) *slot = index_tree_find_slot(tree, key);
+    return (slot) ? atomic_load_explicit(slot, memory_order_acquire) : NULL;
+}
+
+/** Search a node for the first entry at or after a key. */
+static void *index_tree_node_next(index_tree_node_t *node, uint64_t base, uint64_t *_key) {
+    for (size_t i = (*_key - base) >> node->shift; i < INDEX_TREE_SLOTS; i++) {
+        void *entry = atomic_load_explicit(&node->slots[i], memory_order_acquire);
+        if (!entry)
+            continue;
+
+        uint64_t slot_base = base + ((uint64_t)i << node->shift);
+        if (*_key < slot_base)
+            *_key = slot_base;
+
+        if (!node->shift)
+            return entry;
+
+        entry = index_tree_node_next(entry, slot_base, _key);
+        if (entry)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the entry with the lowest key that is greater than or equal to the
+ * given key. This can be used to iterate over entries in a range, see also
+ * index_tree_foreach().
+ *
+ * @param tree          Tree to search.
+ * @param _key          Key to search from. Will be updated to the key of the
+ *                      entry found.
+ *
+ * @return              Value found, or NULL if no entry found.
+ */
+void *index_tree_next(index_tree_t *tree, uint64_t *_key) {
+    index_tree_node_t *root = atomic_load_explicit(&tree->root, memory_order_acquire);
+    if (!root || *_key > index_tree_node_max(root))
+        return NULL;
+
+    return index_tree_node_next(root, 0, _key);
+}
+
+/** Initialize an index tree.
+ * @param tree          Tree to initialize. */
+void index_tree_init(index_tree_t *tree) {
+    atomic_init(&tree->root, NULL);
+}
+
+/** Destroy an index tree, freeing all of its nodes. Values remaining in the
+ * tree are not touched.
+ * @param tree          Tree to destroy. */
+void index_tree_destroy(index_tree_t *tree) {
+    index_tree_node_t *root = atomic_load_explicit(&tree->root, memory_order_relaxed);
+    if (root)
+        index_tree_node_free(root);
+
+    atomic_init(&tree->root, NULL);
+}
@@ -38,6 +38,8 @@
 #include <mm/page.h>
 #include <mm/phys.h>
 
+#include <sync/condvar.h>
+
 #include <assert.h>
 #include <kboot.h>
 #include <kernel.h>
@@ -91,6 +93,7 @@ static LIST_DEFINE(kmem_range_pool);
 
 /** Global kernel memory lock. */
 static MUTEX_DEFINE(kmem_lock, 0);
+static CONDVAR_DEFINE(kmem_free_cvar);
 
 static kmem_range_t *kmem_range_get(unsigned mmflag) {
     kmem_range_t *range;
@@ -289,6 +292,9 @@ static void kmem_free_internal(ptr_t addr, size_t size, bool unmap, bool free, b
     /* Insert the range into the freelist. */
     kmem_freelist_insert(range);
 
+    /* Wake anything waiting for space. */
+    condvar_broadcast(&kmem_free_cvar);
+
     mutex_unlock(&kmem_lock);
 
     dprintf("kmem: freed range [%p,%p)\n", addr, (ptr_t)addr + size);
@@ -307,16 +313,20 @@ ptr_t kmem_raw_alloc(size_t size, unsigned mmflag) {
 
     /* Find an available free range. */
     kmem_range_t *range = kmem_freelist_find(size);
-    if (unlikely(!range)) {
-        // TODO: Reclaim/wait for memory.
+    while (unlikely(!range)) {
         if (mmflag & MM_BOOT) {
             fatal("Exhausted kernel memory during boot");
-        } else if (mmflag & MM_WAIT) {
-            fatal("TODO: Reclaim/wait for memory");
+        } else if (!(mmflag & MM_WAIT)) {
+            mutex_unlock(&kmem_lock);
+            return 0;
         }
 
-        mutex_unlock(&kmem_lock);
-        return 0;
+        /* Wait for a range to be freed. The page daemon's shrinkers will get
+         * cached slab objects freed, which may free up some space. */
+        page_daemon_wake();
+        condvar_wait(&kmem_free_cvar, &kmem_lock);
+
+        range = kmem_freelist_find(size);
     }
 
     kmem_freelist_remove(range);
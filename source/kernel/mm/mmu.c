@@ -17,12 +17,10 @@
 /**
  * @file
  * @brief               MMU interface.
- *
- * TODO:
- *  - ASID support.
- *  - Maintain an active CPU set for multicast TLB invalidation.
  */
 
+#include <lib/bitmap.h>
+
 #include <mm/aspace.h>
 #include <mm/malloc.h>
 #include <mm/mmu.h>
@@ -124,7 +122,10 @@ void mmu_context_remap(mmu_context_t *ctx, ptr_t virt, size_t size, uint32_t acc
     return mmu_ops->remap(ctx, virt, size, access);
 }
 
-/** Unmaps a page in an MMU context.
+/**
+ * Unmaps a page in an MMU context. If the page is part of a large page
+ * mapping, the large page is split and only the requested page is unmapped.
+ *
  * @param ctx           Context to unmap from.
  * @param virt          Virtual address to unmap.
  * @param shared        Whether the mapping was shared across multiple CPUs.
@@ -133,7 +134,9 @@ void mmu_context_remap(mmu_context_t *ctx, ptr_t virt, size_t size, uint32_t acc
  * @param _page         Where to pointer to page that was unmapped. May be set
  *                      to NULL if the address was mapped to memory that doesn't
  *                      have a page_t (e.g. device memory).
- * @return              Whether a page was mapped at the virtual address. */
+ *
+ * @return              Whether a page was mapped at the virtual address.
+ */
 bool mmu_context_unmap(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_page) {
     assert(mutex_held(&ctx->lock));
     assert(!(virt % PAGE_SIZE));
@@ -149,6 +152,94 @@ bool mmu_context_unmap(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_pa
     return mmu_ops->unmap(ctx, virt, shared, _page);
 }
 
+/**
+ * Maps a large page (LARGE_PAGE_SIZE bytes) in an MMU context. The virtual and
+ * physical addresses must be aligned to the large page size. This can fail
+ * with STATUS_IN_USE if there are existing page tables covering the range, in
+ * which case the range should be mapped with normal pages instead.
+ *
+ * @param ctx           Context to map in.
+ * @param virt          Virtual address to map.
+ * @param phys          Physical address to map to.
+ * @param access        Mapping access flags.
+ * @param mmflag        Allocation behaviour flags.
+ *
+ * @return              Status code describing the result of the operation.
+ *                      STATUS_NOT_SUPPORTED is returned if large pages are not
+ *                      supported by the architecture.
+ */
+status_t mmu_context_map_large(
+    mmu_context_t *ctx, ptr_t virt, phys_ptr_t phys, uint32_t access,
+    unsigned mmflag)
+{
+    assert(mutex_held(&ctx->lock));
+    assert(!(virt % LARGE_PAGE_SIZE));
+    assert(!(phys % LARGE_PAGE_SIZE));
+
+    if (ctx == &kernel_mmu_context) {
+        assert(virt >= KERNEL_BASE);
+    } else {
+        assert(virt < USER_SIZE);
+    }
+
+    if (!mmu_ops->map_large)
+        return STATUS_NOT_SUPPORTED;
+
+    dprintf(
+        "mmu: mmu_context_map_large(%p, %p, 0x%" PRIxPHYS ", 0x%x, 0x%x)\n",
+        ctx, virt, phys, access, mmflag);
+
+    return mmu_ops->map_large(ctx, virt, phys, access, mmflag);
+}
+
+/**
+ * Checks whether a large page could be mapped at an address in an MMU context,
+ * i.e. whether mmu_context_map_large() would not fail with STATUS_IN_USE. This
+ * allows callers to avoid preparing a large page that cannot be mapped.
+ *
+ * @param ctx           Context to check.
+ * @param virt          Virtual address to check (aligned to the large page
+ *                      size).
+ *
+ * @return              Whether a large page could be mapped. Always false if
+ *                      large pages are not supported by the architecture.
+ */
+bool mmu_context_can_map_large(mmu_context_t *ctx, ptr_t virt) {
+    assert(mutex_held(&ctx->lock));
+    assert(!(virt % LARGE_PAGE_SIZE));
+
+    if (!mmu_ops->map_large)
+        return false;
+
+    return mmu_ops->can_map_large(ctx, virt);
+}
+
+/** Unmaps a large page in an MMU context.
+ * @param ctx           Context to unmap from.
+ * @param virt          Virtual address to unmap (aligned to the large page
+ *                      size).
+ * @param shared        Whether the mapping was shared across multiple CPUs.
+ * @param _page         Where to pointer to the first page that was unmapped.
+ * @return              Whether a large page was mapped at the virtual address.
+ *                      If a large page was not mapped, nothing is done. */
+bool mmu_context_unmap_large(mmu_context_t *ctx, ptr_t virt, bool shared, page_t **_page) {
+    assert(mutex_held(&ctx->lock));
+    assert(!(virt % LARGE_PAGE_SIZE));
+
+    if (ctx == &kernel_mmu_context) {
+        assert(virt >= KERNEL_BASE);
+    } else {
+        assert(virt < USER_SIZE);
+    }
+
+    if (!mmu_ops->unmap_large)
+        return false;
+
+    dprintf("mmu: mmu_context_unmap_large(%p, %p, %d)\n", ctx, virt, shared);
+
+    return mmu_ops->unmap_large(ctx, virt, shared, _page);
+}
+
 /** Queries details about a mapping.
  * @param ctx           Context to query.
  * @param virt          Virtual address to query.
@@ -185,6 +276,11 @@ bool mmu_context_query(mmu_context_t *ctx, ptr_t virt, phys_ptr_t *_phys, uint32
 void mmu_context_load(mmu_context_t *ctx) {
     assert(!local_irq_state());
 
+    /* Mark the context as loaded before loading it so that anything modifying
+     * it will know to invalidate TLB entries on this CPU. */
+    if (ctx->cpus)
+        bitmap_set(ctx->cpus, curr_cpu->id);
+
     mmu_ops->load(ctx);
 }
 
@@ -195,6 +291,9 @@ void mmu_context_unload(mmu_context_t *ctx) {
 
     if (mmu_ops->unload)
         mmu_ops->unload(ctx);
+
+    if (ctx->cpus)
+        bitmap_clear(ctx->cpus, curr_cpu->id);
 }
 
 /** Creates an MMU context.
@@ -207,8 +306,15 @@ mmu_context_t *mmu_context_create(unsigned mmflag) {
 
     mutex_init(&ctx->lock, "mmu_context_lock", MUTEX_RECURSIVE);
 
+    ctx->cpus = bitmap_alloc(highest_cpu_id + 1, mmflag);
+    if (!ctx->cpus) {
+        kfree(ctx);
+        return NULL;
+    }
+
     status_t ret = mmu_ops->init(ctx, mmflag);
     if (ret != STATUS_SUCCESS) {
+        kfree(ctx->cpus);
         kfree(ctx);
         return NULL;
     }
@@ -220,6 +326,7 @@ mmu_context_t *mmu_context_create(unsigned mmflag) {
  * @param ctx           Context to destroy. */
 void mmu_context_destroy(mmu_context_t *ctx) {
     mmu_ops->destroy(ctx);
+    kfree(ctx->cpus);
     kfree(ctx);
 }
 
@@ -227,6 +334,7 @@ void mmu_context_destroy(mmu_context_t *ctx) {
 __init_text void mmu_init(void) {
     /* Initialize the kernel context. */
     mutex_init(&kernel_mmu_context.lock, "mmu_context_lock", MUTEX_RECURSIVE);
+    kernel_mmu_context.cpus = NULL;
     arch_mmu_init();
 
     mmu_context_lock(&kernel_mmu_context);
@@ -45,6 +45,19 @@
  * users of the pages: pages will just be placed on the allocated queue when
  * first allocated, and must be moved manually using page_set_state().
  *
+ * Memory is reclaimed by the page daemon. This is woken when the number of
+ * free pages drops below the low watermark, and works until it is back above
+ * the high watermark. Failed allocations that do not wait only wake it if free
+ * memory is below the low watermark, since opportunistic allocations (e.g.
+ * large pages) can fail while there is plenty of memory free. It evicts pages
+ * from the cached queue in the order that they were placed there (least
+ * recently used first), and kicks the page writer so that modified pages are
+ * written back early and become available to evict. Other subsystems which cache data in memory (e.g. the slab
+ * allocator, filesystem caches) register shrinkers, which the page daemon
+ * calls to get them to free unused data. Allocations which are allowed to
+ * wait (MM_WAIT) sleep until the page daemon has made a pass rather than
+ * failing, and then try again.
+ *
  * Free pages are stored in a number of lists. Allocating a single page is just
  * a matter of popping a page from the first list that has free pages. The
  * lists are separated in a platform-specific manner. This is done to improve
@@ -55,6 +68,23 @@
  * these constraints can be satisfied simply by popping a page from an
  * appropriate list.
  *
+ * To avoid contention on the free page lock, each CPU also has a small cache
+ * of free pages which is used by page_alloc() and page_free(). The cache is
+ * only ever touched by its own CPU with interrupts disabled, so the common
+ * case of allocating or freeing a single page needs no locking at all, and is
+ * safe to use for MM_ATOMIC allocations. When the cache is empty it is
+ * refilled with a batch of pages from the free lists, and when it is full a
+ * batch of its least recently freed pages are returned to the free lists.
+ * Pages in a CPU cache have the state PAGE_STATE_FREE_CPU, and are therefore
+ * not considered by phys_alloc().
+ *
+ * Finally, there is a pool of free pages that have already been zeroed. This
+ * is filled by the idle thread on each CPU, using non-temporal stores so that
+ * it does not pollute the CPU cache. MM_ZERO allocations (such as those for
+ * anonymous page faults) take pages from this pool first, avoiding the cost
+ * of zeroing the page while something is waiting on it. Pages in the pool
+ * have the state PAGE_STATE_FREE_ZERO.
+ *
  * The allocation code is not optimised for quick allocations of contiguous
  * ranges of pages, or pages with alignment/boundary constraints, as it is
  * assumed that this will not be done frequently (e.g. in driver initialization
@@ -65,9 +95,15 @@
  *  - Free page lock must be held to set a page's state to PAGE_STATE_FREE, or
  *    to change it away from PAGE_STATE_FREE.
  *  - Free page lock and a page queue lock cannot be held at the same time.
+ *  - Interrupts must be disabled to access the current CPU's page cache. Pages
+ *    can only be moved between a CPU cache and the free lists with the free
+ *    page lock held.
+ *  - Pages can only be taken from the free lists for zeroing with the free
+ *    page lock held. The zeroed page pool is protected by its own lock.
  *
  * TODO:
- *  - Pre-zero free pages while idle.
+ *  - Pages held in other CPUs' caches are not used when the free lists are
+ *    exhausted.
  *  - Reservations of pages for allocations from userspace. When swap is
  *    implemented, the count of memory available to reserve will include swap
  *    space. This means that allocation will not overcommit memory.
@@ -84,9 +120,12 @@
 
 #include <proc/thread.h>
 
+#include <sync/condvar.h>
 #include <sync/mutex.h>
+#include <sync/semaphore.h>
 
 #include <assert.h>
+#include <cpu.h>
 #include <kboot.h>
 #include <kdb.h>
 #include <kernel.h>
@@ -132,10 +171,28 @@ typedef struct page_freelist {
     phys_ptr_t maxaddr;             /**< Highest end address contained in the list. */
 } page_freelist_t;
 
+/** Number of pages to move between a CPU page cache and the free lists. */
+#define PAGE_CACHE_BATCH            (CPU_PAGE_CACHE_SIZE / 2)
+
+/** Maximum number of pages to keep in the zeroed page pool. This is further
+ * limited to a fraction of total memory. */
+#define PAGE_ZEROED_MAX             1024
+#define PAGE_ZEROED_MAX_FRACTION    16
+
 /** Page writer settings. */
 #define PAGE_WRITER_INTERVAL        secs_to_nsecs(4)
 #define PAGE_WRITER_MAX_PER_RUN     128
 
+/** Page daemon settings. */
+#define PAGE_DAEMON_BATCH           64
+#define PAGE_DAEMON_SCAN_MAX        (PAGE_DAEMON_BATCH * 4)
+#define PAGE_DAEMON_RETRY_INTERVAL  msecs_to_nsecs(100)
+
+/** Free page watermarks. The low watermark is this fraction of total memory,
+ * with a minimum page count, and the high watermark is twice that. */
+#define PAGE_WATERMARK_FRACTION     64
+#define PAGE_WATERMARK_MIN          32
+
 /** Number of page queues. */
 #define PAGE_QUEUE_COUNT            3
 
@@ -152,6 +209,31 @@ static page_queue_t page_queues[PAGE_QUEUE_COUNT];
 static page_freelist_t free_page_lists[PAGE_FREE_LIST_COUNT];
 static MUTEX_DEFINE(free_page_lock, 0);
 
+/** Pool of pre-zeroed free pages. */
+static LIST_DEFINE(zeroed_pages);
+static page_num_t zeroed_page_count;
+static page_num_t zeroed_page_max;
+static SPINLOCK_DEFINE(zeroed_page_lock);
+
+/** Free page watermarks. */
+static page_num_t page_low_watermark;
+static page_num_t page_high_watermark;
+
+/** Page daemon state. */
+static thread_t *page_daemon_thread;
+static SEMAPHORE_DEFINE(page_daemon_sem, 0);
+static atomic_bool page_daemon_pending;
+static atomic_bool page_daemon_force;
+static SEMAPHORE_DEFINE(page_writer_sem, 0);
+
+/** Threads waiting for the page daemon to free memory. */
+static MUTEX_DEFINE(page_wait_lock, 0);
+static CONDVAR_DEFINE(page_wait_cvar);
+
+/** Registered shrinkers. */
+static LIST_DEFINE(page_shrinkers);
+static MUTEX_DEFINE(page_shrinkers_lock, 0);
+
 /** Physical memory ranges. */
 static memory_range_t memory_ranges[MEMORY_RANGE_MAX];
 static size_t memory_range_count;
@@ -168,8 +250,8 @@ static void page_writer(void *arg1, void *arg2) {
     LIST_DEFINE(marker);
 
     while (true) {
-        /* TODO: When low on memory, should write pages more often. */
-        delay(PAGE_WRITER_INTERVAL);
+        /* The page daemon wakes us early when low on memory. */
+        semaphore_down_etc(&page_writer_sem, PAGE_WRITER_INTERVAL, 0);
 
         /* Place the marker at the beginning of the queue to begin with. */
         spinlock_lock(&queue->lock);
@@ -225,6 +307,53 @@ static void remove_page_from_current_queue(page_t *page) {
     page_queue_remove(page->state, page);
 }
 
+/** Gets the number of free pages. This is not exact as it does not lock the
+ * queues, but is good enough for checking against the watermarks. */
+static inline page_num_t page_free_count(void) {
+    page_num_t used =
+        page_queues[PAGE_STATE_ALLOCATED].count +
+        page_queues[PAGE_STATE_MODIFIED].count +
+        page_queues[PAGE_STATE_CACHED].count;
+
+    return (used < total_page_count) ? total_page_count - used : 0;
+}
+
+/** Wakes the page daemon if it is not already pending. */
+static void page_daemon_signal(void) {
+    if (!atomic_exchange(&page_daemon_pending, true))
+        semaphore_up(&page_daemon_sem, 1);
+}
+
+/** Wakes the page daemon if free memory is below the low watermark. */
+static inline void page_daemon_check(void) {
+    if (unlikely(page_free_count() < page_low_watermark))
+        page_daemon_signal();
+}
+
+/**
+ * Wakes the page daemon to free cached data regardless of the amount of free
+ * memory. This is for when something other than free pages has run out that
+ * the shrinkers may be able to free up, e.g. kernel address space. Can be
+ * called from any context.
+ */
+void page_daemon_wake(void) {
+    atomic_store(&page_daemon_force, true);
+    page_daemon_signal();
+}
+
+/** Waits for the page daemon to make a pass to reclaim memory. */
+static void page_wait(void) {
+    if (unlikely(curr_thread == page_daemon_thread))
+        fatal("Page daemon exhausted available memory");
+
+    /* The page daemon broadcasts with the lock held after each pass, so
+     * holding it across waking the daemon means we cannot miss that. */
+    mutex_lock(&page_wait_lock);
+    page_daemon_wake();
+    condvar_wait(&page_wait_cvar, &page_wait_lock);
+    mutex_unlock(&page_wait_lock);
+}
+
 /** Sets the state of a page.
  * @param page          Page to set the state of. Must not currently be free.
  * @param state         New state for the page. Must not be PAGE_STATE_FREE,
@@ -255,6 +384,160 @@ page_t *page_lookup(phys_ptr_t addr) {
     return NULL;
 }
 
+static void page_free_internal(page_t *page) {
+    assert(!refcount_get(&page->count));
+
+    /* Reset the page structure to a clear state. */
+    page->state    = PAGE_STATE_FREE;
+    page->modified = false;
+    page->ops      = NULL;
+    page->private  = NULL;
+
+    /* Push it onto the appropriate list. */
+    list_prepend(&free_page_lists[memory_ranges[page->range].freelist].pages, &page->header);
+}
+
+/** Refills the current CPU's page cache from the free lists. Must be called
+ * with the free page lock held and interrupts disabled. */
+static void page_cache_refill(cpu_t *cpu) {
+    for (unsigned i = 0; i < PAGE_FREE_LIST_COUNT; i++) {
+        while (!list_empty(&free_page_lists[i].pages)) {
+            if (cpu->page_cache_count == PAGE_CACHE_BATCH)
+                return;
+
+            page_t *page = list_first(&free_page_lists[i].pages, page_t, header);
+            list_remove(&page->header);
+
+            page->state = PAGE_STATE_FREE_CPU;
+
+            /* The cache is used as a stack, so fill it from the top down to
+             * hand out pages from the highest priority list first. */
+            cpu->page_cache[PAGE_CACHE_BATCH - ++cpu->page_cache_count] = page;
+        }
+    }
+
+    /* Free lists did not have a full batch, shift down what we got. */
+    if (cpu->page_cache_count) {
+        memmove(
+            &cpu->page_cache[0], &cpu->page_cache[PAGE_CACHE_BATCH - cpu->page_cache_count],
+            cpu->page_cache_count * sizeof(page_t *));
+    }
+}
+
+/** Drains a batch of pages from the current CPU's page cache back to the free
+ * lists. Must be called with the free page lock held and interrupts disabled. */
+static void page_cache_drain(cpu_t *cpu) {
+    unsigned count = min(cpu->page_cache_count, PAGE_CACHE_BATCH);
+
+    /* Return the pages at the bottom of the stack, since they were freed
+     * longest ago and are the least likely to still be in the CPU cache. */
+    for (unsigned i = 0; i < count; i++)
+        page_free_internal(cpu->page_cache[i]);
+
+    cpu->page_cache_count -= count;
+    memmove(&cpu->page_cache[0], &cpu->page_cache[count], cpu->page_cache_count * sizeof(page_t *));
+}
+
+/** Takes a page from the current CPU's page cache. Must be called with
+ * interrupts disabled.
+ * @param cpu           Current CPU.
+ * @return              Page taken (marked as allocated), or NULL if the cache
+ *                      is empty. */
+static page_t *page_cache_get(cpu_t *cpu) {
+    if (!cpu->page_cache_count)
+        return NULL;
+
+    page_t *page = cpu->page_cache[--cpu->page_cache_count];
+    assert(page->state == PAGE_STATE_FREE_CPU);
+
+    page->state = PAGE_STATE_ALLOCATED;
+    return page;
+}
+
+/** Takes a page from the zeroed page pool.
+ * @return              Page taken (marked as allocated), or NULL if the pool
+ *                      is empty. */
+static page_t *page_zeroed_get(void) {
+    /* Unlocked check to avoid taking the lock when the pool is empty. */
+    if (!zeroed_page_count)
+        return NULL;
+
+    page_t *page = NULL;
+
+    spinlock_lock(&zeroed_page_lock);
+
+    if (!list_empty(&zeroed_pages)) {
+        page = list_first(&zeroed_pages, page_t, header);
+        list_remove(&page->header);
+        zeroed_page_count--;
+
+        assert(page->state == PAGE_STATE_FREE_ZERO);
+        page->state = PAGE_STATE_ALLOCATED;
+    }
+
+    spinlock_unlock(&zeroed_page_lock);
+    return page;
+}
+
+/**
+ * Zeroes a free page and adds it to the zeroed page pool. This is called by
+ * the idle thread on each CPU with interrupts disabled, and therefore must not
+ * block. Interrupts are enabled while zeroing the page so that it does not
+ * delay the CPU from responding to anything that becomes runnable.
+ *
+ * @return              Whether a page was zeroed. If true, the caller should
+ *                      check for runnable threads again before idling.
+ */
+bool page_zero_idle(void) {
+    assert(!local_irq_state());
+
+    if (zeroed_page_count >= zeroed_page_max)
+        return false;
+
+    /* Can't sleep in the idle thread, so give up if the lock is held. */
+    if (mutex_lock_etc(&free_page_lock, 0, 0) != STATUS_SUCCESS)
+        return false;
+
+    page_t *page = NULL;
+    for (unsigned i = 0; i < PAGE_FREE_LIST_COUNT; i++) {
+        list_foreach(&free_page_lists[i].pages, iter) {
+            page_t *entry = list_entry(iter, page_t, header);
+
+            /* phys_map() must not need to allocate. */
+            if (phys_pmap_contains(entry->addr, PAGE_SIZE)) {
+                page = entry;
+                break;
+            }
+        }
+
+        if (page)
+            break;
+    }
+
+    /* Once taken off the free lists it will not be touched by anything else
+     * until it is placed in the pool, since it is not in the free state. */
+    if (page) {
+        list_remove(&page->header);
+        page->state = PAGE_STATE_FREE_ZERO;
+    }
+
+    mutex_unlock(&free_page_lock);
+
+    if (!page)
+        return false;
+
+    local_irq_enable();
+    arch_page_zero_nocache(phys_map(page->addr, PAGE_SIZE, MM_ATOMIC));
+    local_irq_disable();
+
+    spinlock_lock(&zeroed_page_lock);
+    list_append(&zeroed_pages, &page->header);
+    zeroed_page_count++;
+    spinlock_unlock(&zeroed_page_lock);
+
+    return true;
+}
+
 /** Allocates a page.
  * @param mmflag        Allocation behaviour flags.
  * @return              Pointer to structure for allocated page. */
@@ -262,88 +545,134 @@ page_t *page_alloc(unsigned mmflag) {
     assert((mmflag & (MM_WAIT | MM_ATOMIC)) != (MM_WAIT | MM_ATOMIC));
 
     preempt_disable();
-    mutex_lock(&free_page_lock);
 
-    /* Attempt to allocate from each of the lists. */
-    for (unsigned i = 0; i < PAGE_FREE_LIST_COUNT; i++) {
-        if (list_empty(&free_page_lists[i].pages))
-            continue;
+    /* If we need a zeroed page, try to get one that was zeroed while idle.
+     * Otherwise try the current CPU's page cache first. */
+    page_t *page = (mmflag & MM_ZERO) ? page_zeroed_get() : NULL;
+    if (page) {
+        mmflag &= ~MM_ZERO;
+    } else {
+        bool irq_state = local_irq_disable();
+        page = page_cache_get(curr_cpu);
+        local_irq_restore(irq_state);
+    }
 
-        /* Get the page and mark it as allocated. */
-        page_t *page = list_first(&free_page_lists[i].pages, page_t, header);
-        list_remove(&page->header);
+    while (!page) {
+        mutex_lock(&free_page_lock);
 
-        page->state = PAGE_STATE_ALLOCATED;
+        /* An interrupt handler may have freed pages into the cache while we
+         * were waiting for the lock, so only refill if it is still empty. */
+        bool irq_state = local_irq_disable();
+
+        cpu_t *cpu = curr_cpu;
+        if (!cpu->page_cache_count)
+            page_cache_refill(cpu);
+
+        page = page_cache_get(cpu);
+
+        local_irq_restore(irq_state);
+
+        /* Use up any zeroed pages before giving up. */
+        if (unlikely(!page)) {
+            page = page_zeroed_get();
+            if (page)
+                mmflag &= ~MM_ZERO;
+        }
 
         /* No longer require the lock. Must be released before attempting to
          * zero the page as that might require another allocation, which would
          * lead to a nested locking error. */
         mutex_unlock(&free_page_lock);
 
-        /* Put the page onto the allocated queue. */
-        page_queue_append(PAGE_STATE_ALLOCATED, page);
-
-        /* If we require a zero page, clear it now. */
-        if (mmflag & MM_ZERO) {
-            void *mapping = phys_map(page->addr, PAGE_SIZE, mmflag & MM_FLAG_MASK);
-            if (unlikely(!mapping)) {
-                page_free(page);
+        if (unlikely(!page)) {
+            if (mmflag & MM_BOOT) {
+                fatal("Unable to satisfy boot page allocation");
+            } else if (!(mmflag & MM_WAIT)) {
                 preempt_enable();
+                page_daemon_check();
                 return NULL;
             }
 
-            memset(mapping, 0, PAGE_SIZE);
-            phys_unmap(mapping, PAGE_SIZE, false);
+            preempt_enable();
+            page_wait();
+            preempt_disable();
         }
+    }
 
-        preempt_enable();
+    page_daemon_check();
 
-        dprintf("page: allocated page 0x%" PRIxPHYS " (list: %u)\n", page->addr, i);
-        return page;
-    }
+    /* Put the page onto the allocated queue. */
+    page_queue_append(PAGE_STATE_ALLOCATED, page);
 
-    // TODO: Reclaim/wait for memory.
-    if (mmflag & MM_BOOT) {
-        fatal("Unable to satisfy boot page allocation");
-    } else if (mmflag & MM_WAIT) {
-        /* TODO: Try harder. */
-        fatal("TODO: Reclaim/wait for memory");
+    /* If we require a zero page, clear it now. */
+    if (mmflag & MM_ZERO) {
+        void *mapping = phys_map(page->addr, PAGE_SIZE, mmflag & MM_FLAG_MASK);
+        if (unlikely(!mapping)) {
+            page_free(page);
+            preempt_enable();
+            return NULL;
+        }
+
+        memset(mapping, 0, PAGE_SIZE);
+        phys_unmap(mapping, PAGE_SIZE, false);
     }
 
-    mutex_unlock(&free_page_lock);
     preempt_enable();
-    return NULL;
-}
 
-static void page_free_internal(page_t *page) {
-    assert(!refcount_get(&page->count));
+    dprintf("page: allocated page 0x%" PRIxPHYS "\n", page->addr);
+    return page;
+}
 
+/** Puts a page that has been removed from its queue into the current CPU's
+ * page cache.
+ * @param page          Page to free. */
+static void page_cache_put(page_t *page) {
     /* Reset the page structure to a clear state. */
-    page->state    = PAGE_STATE_FREE;
     page->modified = false;
     page->ops      = NULL;
     page->private  = NULL;
 
-    /* Push it onto the appropriate list. */
-    list_prepend(&free_page_lists[memory_ranges[page->range].freelist].pages, &page->header);
+    /* Put it in the current CPU's page cache, returning a batch of pages to the
+     * free lists first if it is full. */
+    bool irq_state = local_irq_disable();
+    cpu_t *cpu = curr_cpu;
+
+    if (unlikely(cpu->page_cache_count == CPU_PAGE_CACHE_SIZE)) {
+        local_irq_restore(irq_state);
+        mutex_lock(&free_page_lock);
+        irq_state = local_irq_disable();
+
+        /* We may have moved to another CPU while waiting for the lock. */
+        cpu = curr_cpu;
+        if (cpu->page_cache_count == CPU_PAGE_CACHE_SIZE)
+            page_cache_drain(cpu);
+
+        page->state = PAGE_STATE_FREE_CPU;
+        cpu->page_cache[cpu->page_cache_count++] = page;
+
+        local_irq_restore(irq_state);
+        mutex_unlock(&free_page_lock);
+    } else {
+        page->state = PAGE_STATE_FREE_CPU;
+        cpu->page_cache[cpu->page_cache_count++] = page;
+
+        local_irq_restore(irq_state);
+    }
 }
 
 /** Frees a page.
  * @param page          Page to free. */
 void page_free(page_t *page) {
-    if (unlikely(page->state == PAGE_STATE_FREE))
+    if (unlikely(page->state >= PAGE_STATE_FREE))
         fatal("Attempting to free already free page 0x%" PRIxPHYS, page->addr);
 
+    assert(!refcount_get(&page->count));
+
     /* Remove from current queue. */
     remove_page_from_current_queue(page);
 
-    mutex_lock(&free_page_lock);
-    page_free_internal(page);
-    mutex_unlock(&free_page_lock);
-
-    dprintf(
-        "page: freed page 0x%" PRIxPHYS " (list: %u)\n",
-        page->addr, memory_ranges[page->range].freelist);
+    page_cache_put(page);
+    dprintf("page: freed page 0x%" PRIxPHYS "\n", page->addr);
 }
 
 /** Creates a copy of a page.
@@ -365,6 +694,127 @@ page_t *page_copy(page_t *page, unsigned mmflag) {
     return dest;
 }
 
+/** Evicts pages from the cached queue, least recently used first.
+ * @param count         Maximum number of pages to evict.
+ * @return              Number of pages evicted and freed. */
+static page_num_t page_evict(page_num_t count) {
+    page_queue_t *queue = &page_queues[PAGE_STATE_CACHED];
+    page_t *pages[PAGE_DAEMON_BATCH];
+    page_num_t evicted = 0;
+    size_t scanned = 0;
+
+    assert(count <= PAGE_DAEMON_BATCH);
+
+    /* Holding the queue lock prevents pages from changing state or being
+     * freed while we look at them. Owners may refuse if they are busy with a
+     * page, so limit how far we look to bound the time spent with the lock
+     * held. */
+    spinlock_lock(&queue->lock);
+
+    list_foreach_safe(&queue->pages, iter) {
+        if (evicted == count || scanned++ == PAGE_DAEMON_SCAN_MAX)
+            break;
+
+        page_t *page = list_entry(iter, page_t, header);
+
+        if (page->ops && page->ops->evict_page && page->ops->evict_page(page)) {
+            list_remove(&page->header);
+            queue->count--;
+            pages[evicted++] = page;
+        }
+    }
+
+    spinlock_unlock(&queue->lock);
+
+    /* Can't free under the queue lock (see locking rules). */
+    for (page_num_t i = 0; i < evicted; i++) {
+        dprintf("page: evicted page 0x%" PRIxPHYS "\n", pages[i]->addr);
+        page_cache_put(pages[i]);
+    }
+
+    return evicted;
+}
+
+/** Calls all registered shrinkers.
+ * @param count         Number of objects to ask each shrinker to free.
+ * @return              Total number of objects freed. */
+static size_t page_shrink(size_t count) {
+    size_t freed = 0;
+
+    mutex_lock(&page_shrinkers_lock);
+
+    list_foreach(&page_shrinkers, iter) {
+        page_shrinker_t *shrinker = list_entry(iter, page_shrinker_t, header);
+
+        size_t ret = shrinker->shrink(count);
+        dprintf("page: shrinker %s freed %zu objects\n", shrinker->name, ret);
+        freed += ret;
+    }
+
+    mutex_unlock(&page_shrinkers_lock);
+    return freed;
+}
+
+static void page_daemon(void *arg1, void *arg2) {
+    while (true) {
+        semaphore_down(&page_daemon_sem);
+        atomic_store(&page_daemon_pending, false);
+
+        /* If we were woken to free up something other than pages (e.g. kernel
+         * address space), the shrinkers are called at least once. Otherwise,
+         * there is nothing to do if memory has been freed since we were woken,
+         * and shrinking needlessly throws away cached data. */
+        bool shrink = atomic_exchange(&page_daemon_force, false);
+        if (!shrink && page_free_count() >= page_low_watermark)
+            continue;
+
+        /* Get modified pages written back so that they can be evicted. */
+        if (page_queues[PAGE_STATE_MODIFIED].count)
+            semaphore_up(&page_writer_sem, 1);
+
+        bool progress;
+        do {
+            page_num_t evicted = 0;
+            if (page_free_count() < page_high_watermark)
+                evicted = page_evict(PAGE_DAEMON_BATCH);
+
+            /* Only ask for cached data to be freed if there are not enough
+             * cached pages to evict. */
+            size_t shrunk = 0;
+            if (shrink || evicted < PAGE_DAEMON_BATCH)
+                shrunk = page_shrink(PAGE_DAEMON_BATCH);
+
+            shrink   = false;
+            progress = evicted || shrunk;
+
+            /* If nothing could be freed, give the page writer and anything
+             * else that is freeing memory some time to do so, rather than
+             * having waiters repeatedly wake us again straight away. */
+            if (!progress)
+                delay(PAGE_DAEMON_RETRY_INTERVAL);
+
+            mutex_lock(&page_wait_lock);
+            condvar_broadcast(&page_wait_cvar);
+            mutex_unlock(&page_wait_lock);
+        } while (progress && page_free_count() < page_high_watermark);
+    }
+}
+
+/**
+ * Registers a shrinker, which will be called by the page daemon to free
+ * unused cached data when memory is low. Shrinkers are called from the page
+ * daemon thread, and must not wait for memory to become available.
+ *
+ * @param shrinker      Shrinker to register.
+ */
+void page_shrinker_register(page_shrinker_t *shrinker) {
+    list_init(&shrinker->header);
+
+    mutex_lock(&page_shrinkers_lock);
+    list_append(&page_shrinkers, &shrinker->header);
+    mutex_unlock(&page_shrinkers_lock);
+}
+
 /** Fast path for phys_alloc() (1 page, only minimum/maximum address). */
 static page_t *phys_alloc_fastpath(phys_ptr_t minaddr, phys_ptr_t maxaddr) {
     /* Maximum of 2 possible partial fits. */
@@ -506,23 +956,32 @@ status_t phys_alloc(
     page_num_t count = size / PAGE_SIZE;
 
     preempt_disable();
-    mutex_lock(&free_page_lock);
 
-    /* Single-page allocations with no constraints or only minaddr/maxaddr
-     * constraints can be performed quickly. */
-    page_t *pages = (count == 1 && !align && !boundary)
-        ? phys_alloc_fastpath(minaddr, maxaddr)
-        : phys_alloc_slowpath(count, align, boundary, minaddr, maxaddr);
-    if (unlikely(!pages)) {
+    page_t *pages;
+    while (true) {
+        mutex_lock(&free_page_lock);
+
+        /* Single-page allocations with no constraints or only minaddr/maxaddr
+         * constraints can be performed quickly. */
+        pages = (count == 1 && !align && !boundary)
+            ? phys_alloc_fastpath(minaddr, maxaddr)
+            : phys_alloc_slowpath(count, align, boundary, minaddr, maxaddr);
+        if (likely(pages))
+            break;
+
+        mutex_unlock(&free_page_lock);
+
         if (mmflag & MM_BOOT) {
             fatal("Unable to satisfy boot allocation of %zu page(s)", count);
-        } else if (mmflag & MM_WAIT) {
-            fatal("TODO: Reclaim/wait for memory");
+        } else if (!(mmflag & MM_WAIT)) {
+            preempt_enable();
+            page_daemon_check();
+            return STATUS_NO_MEMORY;
         }
 
-        mutex_unlock(&free_page_lock);
         preempt_enable();
-        return STATUS_NO_MEMORY;
+        page_wait();
+        preempt_disable();
     }
 
     /* Remove the pages from the free list and mark them as allocated. */
@@ -582,7 +1041,7 @@ void phys_free(phys_ptr_t base, phys_size_t size) {
 
     /* Remove each page in the range from its current queue. */
     for (page_num_t i = 0; i < (size / PAGE_SIZE); i++) {
-        if (unlikely(pages[i].state == PAGE_STATE_FREE)) {
+        if (unlikely(pages[i].state >= PAGE_STATE_FREE)) {
             fatal(
                 "Page 0x%" PRIxPHYS " in range [0x%" PRIxPHYS ",0x%" PRIxPHYS ") already free",
                 pages[i].addr, base, base + size);
@@ -671,6 +1130,21 @@ static kdb_status_t kdb_cmd_page(int argc, char **argv, kdb_filter_t *filter) {
         kdb_printf("Modified:  %" PRIu64 " KiB\n", stats.modified / 1024);
         kdb_printf("Cached:    %" PRIu64 " KiB\n", stats.cached / 1024);
         kdb_printf("Free:      %" PRIu64 " KiB\n", stats.free / 1024);
+
+        page_num_t cached = 0;
+        for (size_t i = 0; i <= highest_cpu_id; i++) {
+            if (cpus[i])
+                cached += cpus[i]->page_cache_count;
+        }
+
+        kdb_printf("CPU cache: %" PRIu64 " KiB (of free)\n", ((uint64_t)cached * PAGE_SIZE) / 1024);
+        kdb_printf(
+            "Zeroed:    %" PRIu64 " KiB (of free)\n",
+            ((uint64_t)zeroed_page_count * PAGE_SIZE) / 1024);
+        kdb_printf(
+            "Watermark: %" PRIu64 " KiB low, %" PRIu64 " KiB high\n",
+            ((uint64_t)page_low_watermark * PAGE_SIZE) / 1024,
+            ((uint64_t)page_high_watermark * PAGE_SIZE) / 1024);
     }
 
     return KDB_SUCCESS;
@@ -883,6 +1357,11 @@ __init_text void page_init(void) {
         }
     }
 
+    zeroed_page_max = min(PAGE_ZEROED_MAX, total_page_count / PAGE_ZEROED_MAX_FRACTION);
+
+    page_low_watermark  = max(total_page_count / PAGE_WATERMARK_FRACTION, PAGE_WATERMARK_MIN);
+    page_high_watermark = page_low_watermark * 2;
+
     kdb_register_command(
         "page",
         "Display physical memory usage information.",
@@ -896,6 +1375,12 @@ __init_text void page_daemon_init(void) {
     status_t ret = thread_create("page_writer", NULL, 0, page_writer, NULL, NULL, NULL);
     if (ret != STATUS_SUCCESS)
         fatal("Could not start page writer (%d)", ret);
+
+    ret = thread_create("page_daemon", NULL, 0, page_daemon, NULL, NULL, &page_daemon_thread);
+    if (ret != STATUS_SUCCESS)
+        fatal("Could not start page daemon (%d)", ret);
+
+    thread_run(page_daemon_thread);
 }
 
 /** Reclaim memory no longer in use after kernel initialization. */
@@ -48,15 +48,6 @@ static memory_type_range_t memory_types[MEMORY_TYPE_RANGE_MAX];
 static size_t memory_types_count;
 static SPINLOCK_DEFINE(memory_types_lock);
 
-static inline bool pmap_contains(phys_ptr_t addr, size_t size) {
-    #if KERNEL_PMAP_OFFSET > 0
-        if (addr < KERNEL_PMAP_OFFSET)
-            return false;
-    #endif
-
-    return ((addr + size) <= (KERNEL_PMAP_OFFSET + KERNEL_PMAP_SIZE));
-}
-
 /** Maps physical memory into the kernel address space.
  * @param addr          Physical address to map.
  * @param size          Size of range to map.
@@ -67,7 +58,7 @@ void *phys_map(phys_ptr_t addr, size_t size, unsigned mmflag) {
         return NULL;
 
     /* Use the physical map area if the range lies within it. */
-    if (pmap_contains(addr, size))
+    if (phys_pmap_contains(addr, size))
         return (void *)(KERNEL_PMAP_BASE + (addr - KERNEL_PMAP_OFFSET));
 
     /* Outside the physical map area. Must instead allocate some kernel memory
@@ -30,8 +30,15 @@
  * that we do not leave empty slabs lying around - when a slab becomes empty,
  * it is freed immediately.
  *
+ * As described in the paper, the magazine size of a cache is adjusted
+ * dynamically. Contention on a cache's depot lock indicates that CPUs are
+ * going to the depot too often, so when it is contended frequently the
+ * magazine size is doubled, up to a maximum. When memory is low, magazine
+ * sizes are halved again. Magazines record their own size, so rather than
+ * purging all magazines when the size is changed, empty magazines of the old
+ * size are freed as they pass through the depot.
+ *
  * TODO:
- *  - Dynamic magazine resizing.
  *  - Allocation hash table resizing.
  */
 
@@ -41,6 +48,7 @@
 
 #include <mm/kmem.h>
 #include <mm/malloc.h>
+#include <mm/page.h>
 #include <mm/slab.h>
 
 #include <proc/process.h>
@@ -52,22 +60,31 @@
 #include <kernel.h>
 #include <module.h>
 #include <status.h>
+#include <time.h>
 
 struct slab;
 
 /** Slab magazine structure. */
 typedef struct slab_magazine {
-    /** Array of objects in the magazine. */
-    void *objects[SLAB_MAGAZINE_SIZE];
+    list_t header;                      /**< Link to depot lists. */
     size_t rounds;                      /**< Number of rounds currently in the magazine. */
+    size_t size;                        /**< Number of rounds the magazine can hold. */
 
-    list_t header;                      /**< Link to depot lists. */
+    /** Array of objects in the magazine. */
+    void *objects[];
 } slab_magazine_t;
 
 /** Slab per-CPU cache structure. */
 typedef struct __cacheline_aligned slab_percpu {
     slab_magazine_t *loaded;            /**< Current (loaded) magazine. */
     slab_magazine_t *previous;          /**< Previous magazine. */
+
+    /** Statistics. */
+    uint64_t alloc_hits;                /**< Allocations satisfied from loaded magazines. */
+    uint64_t alloc_misses;              /**< Allocations which had to go to the depot. */
+    uint64_t free_hits;                 /**< Frees satisfied by loaded magazines. */
+    uint64_t free_misses;               /**< Frees which had to go to the depot. */
+    uint64_t contended;                 /**< Number of times the depot lock was contended. */
 } slab_percpu_t;
 
 /**
@@ -99,9 +116,18 @@ typedef struct slab {
 #define SLAB_METADATA_PRIORITY      1
 #define SLAB_MAG_PRIORITY           2
 
+/** Number of magazine caches (sizes are powers of 2 from SLAB_MAGAZINE_SIZE
+ * up to SLAB_MAGAZINE_MAX). */
+#define SLAB_MAG_CACHE_COUNT        4
+
+/** Depot lock contention settings. If a cache's depot lock is contended this
+ * many times within the interval, its magazine size is increased. */
+#define SLAB_CONTENTION_LIMIT       16
+#define SLAB_CONTENTION_INTERVAL    secs_to_nsecs(1)
+
 /** Internally-used caches. */
 static slab_cache_t slab_cache_cache;   /**< Cache for allocation of new slab caches. */
-static slab_cache_t slab_mag_cache;     /**< Cache for magazine structures. */
+static slab_cache_t slab_mag_caches[SLAB_MAG_CACHE_COUNT];
 static slab_cache_t slab_bufctl_cache;  /**< Cache for buffer control structures. */
 static slab_cache_t slab_slab_cache;    /**< Cache for slab structures. */
 static slab_cache_t *slab_percpu_cache; /**< Cache for per-CPU structures. */
@@ -322,15 +348,52 @@ static inline void *slab_obj_alloc(slab_cache_t *cache, unsigned mmflag) {
     return obj;
 }
 
+/** Get the cache to allocate magazines of a certain size from. */
+static inline slab_cache_t *slab_mag_cache(size_t size) {
+    unsigned index = 0;
+    while (((size_t)SLAB_MAGAZINE_SIZE << index) < size)
+        index++;
+
+    assert(index < SLAB_MAG_CACHE_COUNT);
+    return &slab_mag_caches[index];
+}
+
+/** Lock a cache's depot, increasing the magazine size if it is contended too
+ * frequently. Must be called with interrupts disabled. */
+static inline void slab_depot_lock(slab_cache_t *cache) {
+    if (likely(mutex_lock_etc(&cache->depot_lock, 0, 0) == STATUS_SUCCESS))
+        return;
+
+    cache->cpu_caches[curr_cpu->id].contended++;
+
+    mutex_lock(&cache->depot_lock);
+
+    nstime_t now = system_time();
+    if (now - cache->contention_start > SLAB_CONTENTION_INTERVAL) {
+        cache->contention_start = now;
+        cache->contention_count = 0;
+    }
+
+    /* Larger magazines mean CPUs need to go to the depot less often. */
+    if (++cache->contention_count == SLAB_CONTENTION_LIMIT && cache->magazine_size < SLAB_MAGAZINE_MAX) {
+        cache->magazine_size *= 2;
+        cache->contention_count = 0;
+
+        kprintf(
+            LOG_DEBUG, "slab: increased magazine size of %s to %zu\n",
+            cache->name, cache->magazine_size);
+    }
+}
+
 /** Get a full magazine from a cache's depot. */
 static inline slab_magazine_t *slab_magazine_get_full(slab_cache_t *cache) {
-    mutex_lock(&cache->depot_lock);
+    slab_depot_lock(cache);
 
     slab_magazine_t *mag = NULL;
     if (!list_empty(&cache->magazine_full)) {
         mag = list_first(&cache->magazine_full, slab_magazine_t, header);
         list_remove(&mag->header);
-        assert(mag->rounds == SLAB_MAGAZINE_SIZE);
+        assert(mag->rounds == mag->size);
     }
 
     mutex_unlock(&cache->depot_lock);
@@ -339,32 +402,41 @@ static inline slab_magazine_t *slab_magazine_get_full(slab_cache_t *cache) {
 
 /** Return a full magazine to the depot. */
 static inline void slab_magazine_put_full(slab_cache_t *cache, slab_magazine_t *mag) {
-    assert(mag->rounds == SLAB_MAGAZINE_SIZE);
+    assert(mag->rounds == mag->size);
 
-    mutex_lock(&cache->depot_lock);
+    slab_depot_lock(cache);
     list_prepend(&cache->magazine_full, &mag->header);
     mutex_unlock(&cache->depot_lock);
 }
 
 /** Get an empty magazine from a cache's depot. */
 static inline slab_magazine_t *slab_magazine_get_empty(slab_cache_t *cache) {
-    mutex_lock(&cache->depot_lock);
+    slab_depot_lock(cache);
 
-    slab_magazine_t *mag;
+    slab_magazine_t *mag = NULL;
     if (!list_empty(&cache->magazine_empty)) {
         mag = list_first(&cache->magazine_empty, slab_magazine_t, header);
         list_remove(&mag->header);
         assert(!mag->rounds);
-    } else {
+
+        /* Replace magazines left over from before a resize. */
+        if (mag->size != cache->magazine_size) {
+            slab_cache_free(slab_mag_cache(mag->size), mag);
+            mag = NULL;
+        }
+    }
+
+    if (!mag) {
         /* None available, try to allocate a new structure. We do not wait for
          * memory to be available here as if a new magazine cannot be allocated
          * on the first try it means that the system is low on memory. In this
          * case, the object should be freed back to the source. TODO: If low on
          * memory, should not attempt to allocate at all. */
-        mag = slab_cache_alloc(&slab_mag_cache, MM_ATOMIC);
+        mag = slab_cache_alloc(slab_mag_cache(cache->magazine_size), MM_ATOMIC);
         if (mag) {
             list_init(&mag->header);
             mag->rounds = 0;
+            mag->size   = cache->magazine_size;
         }
     }
 
@@ -376,7 +448,7 @@ static inline slab_magazine_t *slab_magazine_get_empty(slab_cache_t *cache) {
 static inline void slab_magazine_put_empty(slab_cache_t *cache, slab_magazine_t *mag) {
     assert(!mag->rounds);
 
-    mutex_lock(&cache->depot_lock);
+    slab_depot_lock(cache);
     list_prepend(&cache->magazine_empty, &mag->header);
     mutex_unlock(&cache->depot_lock);
 }
@@ -390,7 +462,7 @@ static inline void slab_magazine_destroy(slab_cache_t *cache, slab_magazine_t *m
         slab_obj_free(cache, mag->objects[i]);
 
     list_remove(&mag->header);
-    slab_cache_free(&slab_mag_cache, mag);
+    slab_cache_free(slab_mag_cache(mag->size), mag);
 }
 
 /** Allocate an object from the magazine layer. */
@@ -408,16 +480,20 @@ static inline void *slab_cpu_obj_alloc(slab_cache_t *cache) {
     if (likely(cc->loaded)) {
         if (cc->loaded->rounds) {
             ret = cc->loaded->objects[--cc->loaded->rounds];
+            cc->alloc_hits++;
             goto out;
         } else if (cc->previous && cc->previous->rounds) {
             /* Previous has rounds, exchange loaded with previous and allocate
              * from it. */
             swap(cc->loaded, cc->previous);
             ret = cc->loaded->objects[--cc->loaded->rounds];
+            cc->alloc_hits++;
             goto out;
         }
     }
 
+    cc->alloc_misses++;
+
     /* Try to get a full magazine from the depot. */
     slab_magazine_t *mag = slab_magazine_get_full(cache);
     assert(!local_irq_state());
@@ -449,17 +525,21 @@ static inline bool slab_cpu_obj_free(slab_cache_t *cache, void *obj) {
     /* If the loaded magazine has spare slots, just put the object there and
      * return. */
     if (likely(cc->loaded)) {
-        if (cc->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+        if (cc->loaded->rounds < cc->loaded->size) {
             cc->loaded->objects[cc->loaded->rounds++] = obj;
+            cc->free_hits++;
             goto success;
-        } else if (cc->previous && cc->previous->rounds < SLAB_MAGAZINE_SIZE) {
+        } else if (cc->previous && cc->previous->rounds < cc->previous->size) {
             /* Previous has spare slots, exchange them and insert the object. */
             swap(cc->loaded, cc->previous);
             cc->loaded->objects[cc->loaded->rounds++] = obj;
+            cc->free_hits++;
             goto success;
         }
     }
 
+    cc->free_misses++;
+
     /* Get a new empty magazine. */
     slab_magazine_t *mag = slab_magazine_get_empty(cache);
     assert(!local_irq_state());
@@ -653,7 +733,10 @@ static status_t slab_cache_init(
     list_init(&cache->slab_full);
     list_init(&cache->header);
 
-    cache->slab_count = 0;
+    cache->slab_count       = 0;
+    cache->magazine_size    = SLAB_MAGAZINE_SIZE;
+    cache->contention_start = 0;
+    cache->contention_count = 0;
 
     #if CONFIG_SLAB_STATS
         atomic_store(&cache->alloc_current, 0);
@@ -798,30 +881,127 @@ void slab_cache_destroy(slab_cache_t *cache) {
     slab_cache_free(&slab_cache_cache, cache);
 }
 
+/** Frees objects held in the magazine depots of all caches back to the slab
+ * layer, which will free any slabs that become empty. */
+static size_t slab_shrink(size_t count) {
+    size_t freed = 0;
+
+    mutex_lock(&slab_caches_lock);
+
+    /* The cache list is ordered by reclaim priority. */
+    list_foreach(&slab_caches, iter) {
+        slab_cache_t *cache = list_entry(iter, slab_cache_t, header);
+
+        if (freed >= count)
+            break;
+
+        LIST_DEFINE(magazines);
+
+        mutex_lock(&cache->depot_lock);
+
+        list_splice_after(&magazines, &cache->magazine_full);
+        list_splice_after(&magazines, &cache->magazine_empty);
+
+        /* Reduce the amount of memory that will be held in magazines. */
+        if (cache->magazine_size > SLAB_MAGAZINE_SIZE) {
+            cache->magazine_size /= 2;
+            cache->contention_count = 0;
+        }
+
+        mutex_unlock(&cache->depot_lock);
+
+        list_foreach_safe(&magazines, mag_iter) {
+            slab_magazine_t *mag = list_entry(mag_iter, slab_magazine_t, header);
+
+            freed += mag->rounds;
+            slab_magazine_destroy(cache, mag);
+        }
+    }
+
+    mutex_unlock(&slab_caches_lock);
+    return freed;
+}
+
+static page_shrinker_t slab_shrinker = {
+    .name   = "slab",
+    .shrink = slab_shrink,
+};
+
+/** Prints per-CPU statistics for a slab cache. */
+static void kdb_slab_cache_stats(slab_cache_t *cache) {
+    kdb_printf("Cache %s (%p)\n", cache->name, cache);
+    kdb_printf("=================================================\n");
+
+    if (cache->flags & SLAB_CACHE_NOMAG) {
+        kdb_printf("Magazine layer disabled\n");
+        return;
+    }
+
+    kdb_printf("Magazine size: %zu\n\n", cache->magazine_size);
+
+    kdb_printf("CPU  Alloc Hits   Alloc Misses Free Hits    Free Misses  Contended Loaded Previous\n");
+    kdb_printf("===  ==========   ============ =========    ===========  ========= ====== ========\n");
+
+    for (size_t i = 0; i <= highest_cpu_id; i++) {
+        if (!cpus[i])
+            continue;
+
+        slab_percpu_t *cc = &cache->cpu_caches[i];
+
+        kdb_printf(
+            "%-4zu %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-9" PRIu64,
+            i, cc->alloc_hits, cc->alloc_misses, cc->free_hits, cc->free_misses,
+            cc->contended);
+        kdb_printf(
+            " %-6zu %zu\n",
+            (cc->loaded) ? cc->loaded->rounds : 0,
+            (cc->previous) ? cc->previous->rounds : 0);
+    }
+}
+
 /** Prints a list of all slab caches. */
 static kdb_status_t kdb_cmd_slab(int argc, char **argv, kdb_filter_t *filter) {
     if (kdb_help(argc, argv)) {
-        kdb_printf("Usage: %s\n\n", argv[0]);
+        kdb_printf("Usage: %s [<name>]\n\n", argv[0]);
 
-        kdb_printf("Prints a list of all active slab caches and some statistics about them.\n");
+        kdb_printf("Prints a list of all active slab caches and some statistics about them, or\n");
+        kdb_printf("per-CPU magazine statistics for a single cache.\n");
         return KDB_SUCCESS;
+    } else if (argc != 1 && argc != 2) {
+        kdb_printf("Incorrect number of arguments. See 'help %s' for help.\n", argv[0]);
+        return KDB_FAILURE;
+    }
+
+    if (argc == 2) {
+        list_foreach(&slab_caches, iter) {
+            slab_cache_t *cache = list_entry(iter, slab_cache_t, header);
+
+            if (strcmp(cache->name, argv[1]) == 0) {
+                kdb_slab_cache_stats(cache);
+                return KDB_SUCCESS;
+            }
+        }
+
+        kdb_printf("Cache '%s' not found.\n", argv[1]);
+        return KDB_FAILURE;
     }
 
     #if CONFIG_SLAB_STATS
-        kdb_printf("Name                      Align  Obj Size Slab Size Flags Slab Count Current Total\n");
-        kdb_printf("====                      =====  ======== ========= ===== ========== ======= =====\n");
+        kdb_printf("Name                      Align  Obj Size Slab Size Flags Slab Count Mag  Current Total\n");
+        kdb_printf("====                      =====  ======== ========= ===== ========== ===  ======= =====\n");
     #else
-        kdb_printf("Name                      Align  Obj Size Slab Size Flags Slab Count\n");
-        kdb_printf("====                      =====  ======== ========= ===== ==========\n");
+        kdb_printf("Name                      Align  Obj Size Slab Size Flags Slab Count Mag\n");
+        kdb_printf("====                      =====  ======== ========= ===== ========== ===\n");
     #endif
 
     list_foreach(&slab_caches, iter) {
         slab_cache_t *cache = list_entry(iter, slab_cache_t, header);
 
         kdb_printf(
-            "%-*s %-6zu %-8zu %-9zu %-5d %-10zu",
+            "%-*s %-6zu %-8zu %-9zu %-5d %-10zu %-4zu",
             SLAB_NAME_MAX, cache->name, cache->align, cache->obj_size,
-            cache->slab_size, cache->flags, cache->slab_count);
+            cache->slab_size, cache->flags, cache->slab_count,
+            (cache->flags & SLAB_CACHE_NOMAG) ? 0 : cache->magazine_size);
 
         #if CONFIG_SLAB_STATS
             kdb_printf(" %-7d %d", atomic_load(&cache->alloc_current), atomic_load(&cache->alloc_total));
@@ -841,12 +1021,21 @@ __init_text void slab_init(void) {
         alignof(slab_cache_t), NULL, NULL, NULL, SLAB_METADATA_PRIORITY,
         0, MM_BOOT);
 
-    /* Initialize the magazine cache. This cannot have the magazine layer
+    /* Initialize the magazine caches. These cannot have the magazine layer
      * enabled, for pretty obvious reasons. */
-    slab_cache_init(
-        &slab_mag_cache, "slab_mag_cache", sizeof(slab_magazine_t),
-        alignof(slab_magazine_t), NULL, NULL, NULL, SLAB_MAG_PRIORITY,
-        SLAB_CACHE_NOMAG, MM_BOOT);
+    for (unsigned i = 0; i < SLAB_MAG_CACHE_COUNT; i++) {
+        size_t size = (size_t)SLAB_MAGAZINE_SIZE << i;
+
+        char name[SLAB_NAME_MAX];
+        snprintf(name, sizeof(name), "slab_mag_%zu_cache", size);
+
+        slab_cache_init(
+            &slab_mag_caches[i], name, sizeof(slab_magazine_t) + (size * sizeof(void *)),
+            alignof(slab_magazine_t), NULL, NULL, NULL, SLAB_MAG_PRIORITY,
+            SLAB_CACHE_NOMAG, MM_BOOT);
+    }
+
+    assert((SLAB_MAGAZINE_SIZE << (SLAB_MAG_CACHE_COUNT - 1)) == SLAB_MAGAZINE_MAX);
 
     /* Create other internal caches. */
     slab_cache_init(
@@ -885,4 +1074,6 @@ __init_text void slab_late_init(void) {
     }
 
     mutex_unlock(&slab_caches_lock);
+
+    page_shrinker_register(&slab_shrinker);
 }
@@ -54,9 +54,32 @@
  *    mapping each page of the object, allowing pages to be freed when no more
  *    regions refer to them.
  *
+ * Anonymous regions with no source object are opportunistically backed with
+ * large pages. When a fault occurs in a large page aligned extent that lies
+ * entirely within the region and has no pages in the anonymous map yet, a
+ * physically contiguous large page is allocated and mapped in one go. The
+ * anonymous map still tracks each of the small pages individually, so the
+ * rest of the anonymous memory layer is unaware of this: if part of the extent
+ * is later unmapped, copied on write or has its protection changed, the MMU
+ * splits the mapping back into small pages.
+ *
+ * Anonymous maps are divided into blocks of VM_AMAP_BLOCK_PAGES pages, each
+ * of which holds the page pointers and region reference counts for its range.
+ * Blocks are only allocated once they need to hold a page, or once the region
+ * reference counts within them differ. Until then, only a single reference
+ * count for the whole block is stored in the map's block table. This means
+ * that a large reservation which is only sparsely used does not cost kernel
+ * memory in proportion to its size, and cloning a map does not need to
+ * allocate anything for parts of it that have never been touched.
+ *
+ * When a page fault is handled on a region backed by an object, any pages
+ * surrounding the faulting page that the object already has resident (e.g. in
+ * a VM cache) are mapped at the same time. This saves taking a separate fault
+ * on each page of, for example, library code that is already cached. These
+ * extra pages are mapped read-only in private regions, so a later write fault
+ * copies them as normal.
+ *
  * TODO:
- *  - The anonymous object page array could be changed into a two-level array,
- *    which would reduce memory consumption for large, sparsely-used objects.
  *  - Swap support.
  *  - Implement VM_MAP_OVERCOMMIT (at the moment we just overcommit regardless).
  *  - Proper memory locking. Note that when eviction gets implemented we need to
@@ -71,6 +94,7 @@
 #include <arch/frame.h>
 
 #include <lib/string.h>
+#include <lib/utility.h>
 
 #include <mm/aspace.h>
 #include <mm/malloc.h>
@@ -85,6 +109,7 @@
 #include <proc/thread.h>
 
 #include <assert.h>
+#include <kboot.h>
 #include <kdb.h>
 #include <setjmp.h>
 #include <smp.h>
@@ -104,6 +129,11 @@ static slab_cache_t *vm_aspace_cache;
 static slab_cache_t *vm_region_cache;
 static slab_cache_t *vm_amap_cache;
 
+/** Size of the window of resident pages to map around a page fault. */
+static size_t vm_fault_around_size;
+
+KBOOT_INTEGER_OPTION("vm_fault_around", "Number of resident pages to map around a page fault", 16);
+
 static void vm_aspace_ctor(void *obj, void *data) {
     vm_aspace_t *as = obj;
 
@@ -194,6 +224,62 @@ static inline bool vm_region_mergeable(const vm_region_t *a, const vm_region_t *
  * Anonymous map functions.
  */
 
+/** Get the end of the block containing a page in an anonymous map (clamped
+ * to the size of the map). */
+static inline size_t vm_amap_block_end(vm_amap_t *map, size_t idx) {
+    return min(round_down(idx, VM_AMAP_BLOCK_PAGES) + VM_AMAP_BLOCK_PAGES, map->max_size);
+}
+
+/** Get the page at an index in an anonymous map.
+ * @note                Map should be locked. */
+static page_t *vm_amap_page(vm_amap_t *map, size_t idx) {
+    assert(idx < map->max_size);
+
+    vm_amap_block_t *block = map->blocks[idx / VM_AMAP_BLOCK_PAGES].block;
+    return (block) ? block->pages[idx % VM_AMAP_BLOCK_PAGES] : NULL;
+}
+
+/** Get the block containing an index in an anonymous map, allocating it if
+ * it does not yet exist.
+ * @note                Map should be locked. */
+static vm_amap_block_t *vm_amap_block(vm_amap_t *map, size_t idx) {
+    assert(idx < map->max_size);
+
+    vm_amap_entry_t *entry = &map->blocks[idx / VM_AMAP_BLOCK_PAGES];
+    if (!entry->block) {
+        vm_amap_block_t *block = kmalloc(sizeof(*block), MM_KERNEL);
+
+        block->count = 0;
+        memset(block->pages, 0, sizeof(block->pages));
+        for (size_t i = 0; i < VM_AMAP_BLOCK_PAGES; i++)
+            block->rref[i] = entry->rref;
+
+        entry->block = block;
+    }
+
+    return entry->block;
+}
+
+/** Set the page at an index in an anonymous map.
+ * @note                Map should be locked.
+ * @param map           Map to set in.
+ * @param idx           Index of the page.
+ * @param page          Page to set (NULL to clear). */
+static void vm_amap_set_page(vm_amap_t *map, size_t idx, page_t *page) {
+    vm_amap_block_t *block = vm_amap_block(map, idx);
+    page_t **slot = &block->pages[idx % VM_AMAP_BLOCK_PAGES];
+
+    if (page && !*slot) {
+        block->count++;
+        map->curr_size++;
+    } else if (!page && *slot) {
+        block->count--;
+        map->curr_size--;
+    }
+
+    *slot = page;
+}
+
 static vm_amap_t *vm_amap_create(size_t size) {
     assert(size);
 
@@ -203,8 +289,9 @@ static vm_amap_t *vm_amap_create(size_t size) {
 
     map->curr_size = 0;
     map->max_size  = size >> PAGE_WIDTH;
-    map->pages     = kcalloc(map->max_size, sizeof(*map->pages), MM_KERNEL);
-    map->rref      = kcalloc(map->max_size, sizeof(*map->rref), MM_KERNEL);
+    map->blocks    = kcalloc(
+        round_up(map->max_size, VM_AMAP_BLOCK_PAGES) / VM_AMAP_BLOCK_PAGES,
+        sizeof(*map->blocks), MM_KERNEL);
 
     dprintf("vm: created anonymous map %p (size: %zu, pages: %zu)\n", map,size, map->max_size);
 
@@ -215,6 +302,12 @@ static vm_amap_t *vm_amap_create(size_t size) {
 static vm_amap_t *vm_amap_clone(vm_amap_t *src, offset_t offset, size_t size) {
     vm_amap_t *dest = vm_amap_create(size);
 
+    /* Set the region reference count for each page to 1, to account for the
+     * destination region. */
+    size_t blocks = round_up(dest->max_size, VM_AMAP_BLOCK_PAGES) / VM_AMAP_BLOCK_PAGES;
+    for (size_t i = 0; i < blocks; i++)
+        dest->blocks[i].rref = 1;
+
     mutex_lock(&src->lock);
 
     size_t start = (size_t)(offset >> PAGE_WIDTH);
@@ -224,16 +317,23 @@ static vm_amap_t *vm_amap_clone(vm_amap_t *src, offset_t offset, size_t size) {
 
     /* Point all of the pages in the new map to the pages from the source map:
      * they will be copied when a write fault occurs on either the source or the
-     * destination. Set the region reference count for each page to 1, to
-     * account for the destination region. */
-    for (size_t i = start; i < end; i++) {
-        if (src->pages[i]) {
-            refcount_inc(&src->pages[i]->count);
-            dest->curr_size++;
+     * destination. Blocks of the source with no pages are skipped, so nothing
+     * is allocated for them in the destination. */
+    for (size_t i = start; i < end; ) {
+        size_t next = min(vm_amap_block_end(src, i), end);
+
+        vm_amap_block_t *block = src->blocks[i / VM_AMAP_BLOCK_PAGES].block;
+        if (block && block->count) {
+            for (size_t j = i; j < next; j++) {
+                page_t *page = block->pages[j % VM_AMAP_BLOCK_PAGES];
+                if (page) {
+                    refcount_inc(&page->count);
+                    vm_amap_set_page(dest, j - start, page);
+                }
+            }
         }
 
-        dest->pages[i - start] = src->pages[i];
-        dest->rref[i - start]  = 1;
+        i = next;
     }
 
     mutex_unlock(&src->lock);
@@ -244,8 +344,11 @@ static void vm_amap_release(vm_amap_t *map) {
     if (refcount_dec(&map->count) == 0) {
         assert(!map->curr_size);
 
-        kfree(map->rref);
-        kfree(map->pages);
+        size_t blocks = round_up(map->max_size, VM_AMAP_BLOCK_PAGES) / VM_AMAP_BLOCK_PAGES;
+        for (size_t i = 0; i < blocks; i++)
+            kfree(map->blocks[i].block);
+
+        kfree(map->blocks);
 
         dprintf("vm: destroyed anonymous map %p\n", map);
 
@@ -265,20 +368,42 @@ static status_t vm_amap_map(vm_amap_t *map, offset_t offset, size_t size) {
 
     assert(end <= map->max_size);
 
-    /* Increase the region reference counts for pages in the region. */
-    for (size_t i = start; i < end; i++) {
-        if (map->rref[i] == UINT16_MAX) {
-            kprintf(LOG_DEBUG, "vm: anon object %p rref[%zu] is at maximum value!\n", map, i);
+    /* Check that none of the counts would overflow before changing anything. */
+    for (size_t i = start; i < end; ) {
+        size_t next = min(vm_amap_block_end(map, i), end);
+
+        vm_amap_entry_t *entry = &map->blocks[i / VM_AMAP_BLOCK_PAGES];
+        for (size_t j = i; j < next; j++) {
+            uint16_t rref = (entry->block) ? entry->block->rref[j % VM_AMAP_BLOCK_PAGES] : entry->rref;
+            if (rref == UINT16_MAX) {
+                kprintf(LOG_DEBUG, "vm: anon object %p rref[%zu] is at maximum value!\n", map, j);
+                mutex_unlock(&map->lock);
+                return STATUS_NO_MEMORY;
+            }
+
+            if (!entry->block)
+                break;
+        }
+
+        i = next;
+    }
 
-            /* Go and undo what we've done. */
-            for (size_t j = start; j < i; j++)
-                map->rref[j]--;
+    /* Increase the region reference counts for pages in the region. If the
+     * whole of an unallocated block is covered its count can be changed
+     * without allocating it. */
+    for (size_t i = start; i < end; ) {
+        size_t next = min(vm_amap_block_end(map, i), end);
 
-            mutex_unlock(&map->lock);
-            return STATUS_NO_MEMORY;
+        vm_amap_entry_t *entry = &map->blocks[i / VM_AMAP_BLOCK_PAGES];
+        if (!entry->block && !(i % VM_AMAP_BLOCK_PAGES) && next == vm_amap_block_end(map, i)) {
+            entry->rref++;
+        } else {
+            vm_amap_block_t *block = vm_amap_block(map, i);
+            for (size_t j = i; j < next; j++)
+                block->rref[j % VM_AMAP_BLOCK_PAGES]++;
         }
 
-        map->rref[i]++;
+        i = next;
     }
 
     mutex_unlock(&map->lock);
@@ -292,25 +417,61 @@ static void vm_amap_unmap(vm_amap_t *map, offset_t offset, size_t size) {
     /* Work out the entries within the object that this covers and ensure it's
      * within the object - for anonymous objects mappings can't be outside the
      * object. */
-    ptr_t start = (size_t)(offset >> PAGE_WIDTH);
-    ptr_t end   = start + (size >> PAGE_WIDTH);
+    size_t start = (size_t)(offset >> PAGE_WIDTH);
+    size_t end   = start + (size >> PAGE_WIDTH);
 
     assert(end <= map->max_size);
 
-    for (size_t i = start; i < end; i++) {
-        assert(map->rref[i]);
+    for (size_t i = start; i < end; ) {
+        size_t first = round_down(i, VM_AMAP_BLOCK_PAGES);
+        size_t last  = vm_amap_block_end(map, i);
+        size_t next  = min(last, end);
 
-        if (--map->rref[i] == 0 && map->pages[i]) {
-            dprintf(
-                "vm: anon object %p rref[%zu] reached 0, freeing 0x%" PRIxPHYS "\n",
-                map, i, map->pages[i]->addr);
+        vm_amap_entry_t *entry = &map->blocks[i / VM_AMAP_BLOCK_PAGES];
+        if (!entry->block && i == first && next == last) {
+            assert(entry->rref);
+            entry->rref--;
+            i = next;
+            continue;
+        }
+
+        vm_amap_block_t *block = vm_amap_block(map, i);
+        for (size_t j = i; j < next; j++) {
+            size_t idx = j % VM_AMAP_BLOCK_PAGES;
+
+            assert(block->rref[idx]);
+
+            if (--block->rref[idx] == 0 && block->pages[idx]) {
+                page_t *page = block->pages[idx];
+
+                dprintf(
+                    "vm: anon object %p rref[%zu] reached 0, freeing 0x%" PRIxPHYS "\n",
+                    map, j, page->addr);
 
-            if (refcount_dec(&map->pages[i]->count) == 0)
-                page_free(map->pages[i]);
+                if (refcount_dec(&page->count) == 0)
+                    page_free(page);
 
-            map->pages[i] = NULL;
-            map->curr_size--;
+                vm_amap_set_page(map, j, NULL);
+            }
         }
+
+        /* Free the block if it no longer holds anything that can't be
+         * represented by the block table entry. */
+        if (!block->count) {
+            size_t j;
+            for (j = first + 1; j < last; j++) {
+                if (block->rref[j % VM_AMAP_BLOCK_PAGES] != block->rref[0])
+                    break;
+            }
+
+            if (j == last) {
+                entry->rref  = block->rref[0];
+                entry->block = NULL;
+                kfree(block);
+            }
+        }
+
+        i = next;
     }
 
     mutex_unlock(&map->lock);
@@ -320,6 +481,65 @@ static void vm_amap_unmap(vm_amap_t *map, offset_t offset, size_t size) {
  * Page mapping functions.
  */
 
+/** Try to map a large page for a fault in an anonymous region.
+ * @note                Address space, MMU context and anonymous map should be
+ *                      locked.
+ * @return              Whether a large page was mapped. */
+static bool map_anon_large_page(vm_region_t *region, ptr_t addr) {
+    vm_amap_t *amap = region->amap;
+    ptr_t base      = round_down(addr, LARGE_PAGE_SIZE);
+    size_t count    = LARGE_PAGE_SIZE / PAGE_SIZE;
+
+    assert(!region->handle);
+
+    /* The extent must be entirely within the region. Stacks are excluded so
+     * that we never map over the guard page. */
+    if (region->flags & VM_MAP_STACK) {
+        return false;
+    } else if (base < region->start || base + LARGE_PAGE_SIZE > region->start + region->size) {
+        return false;
+    }
+
+    /* Nothing in the extent can have been populated already. */
+    offset_t offset = region->amap_offset + (base - region->start);
+    size_t idx      = (size_t)(offset >> PAGE_WIDTH);
+    for (size_t i = 0; i < count; i++) {
+        if (vm_amap_page(amap, idx + i))
+            return false;
+    }
+
+    /* Check that there is no page table covering the extent before allocating
+     * and zeroing a large page that we then could not map. */
+    if (!mmu_context_can_map_large(region->as->mmu, base))
+        return false;
+
+    /* This is only an optimisation, so don't wait if there is no contiguous
+     * memory available. */
+    phys_ptr_t phys;
+    status_t ret = phys_alloc(LARGE_PAGE_SIZE, LARGE_PAGE_SIZE, 0, 0, 0, MM_NOWAIT | MM_ZERO, &phys);
+    if (ret != STATUS_SUCCESS)
+        return false;
+
+    ret = mmu_context_map_large(region->as->mmu, base, phys, region->access, MM_KERNEL);
+    if (ret != STATUS_SUCCESS) {
+        phys_free(phys, LARGE_PAGE_SIZE);
+        return false;
+    }
+
+    /* Pages allocated by phys_alloc() have contiguous page structures. */
+    page_t *pages = page_lookup(phys);
+    for (size_t i = 0; i < count; i++) {
+        refcount_inc(&pages[i].count);
+        vm_amap_set_page(amap, idx + i, &pages[i]);
+    }
+
+    dprintf(
+        "vm: mapped large page 0x%" PRIxPHYS " at %p (as: %p, access: 0x%x)\n",
+        phys, base, region->as, region->access);
+
+    return true;
+}
+
 /** Map a page for an anonymous region into an address space.
  * @note                Address space and MMU context should be locked. */
 static status_t map_anon_page(vm_region_t *region, ptr_t addr, uint32_t requested, phys_ptr_t *_phys) {
@@ -349,42 +569,53 @@ static status_t map_anon_page(vm_region_t *region, ptr_t addr, uint32_t requeste
 
     mutex_lock(&amap->lock);
 
-    assert(idx < amap->max_size);
+    page_t *curr = vm_amap_page(amap, idx);
+
+    if (!curr && !region->handle) {
+        /* No page existing and no source. See if we can map a whole large
+         * page. */
+        if (!exist && map_anon_large_page(region, addr)) {
+            if (_phys)
+                *_phys = vm_amap_page(amap, idx)->addr;
 
-    if (!amap->pages[idx] && !region->handle) {
-        /* No page existing and no source. Allocate a zeroed page. */
+            mutex_unlock(&amap->lock);
+            return STATUS_SUCCESS;
+        }
+
+        /* Allocate a zeroed page. */
         dprintf("vm:  anon fault: no existing page and no source, allocating new\n");
-        amap->pages[idx] = page_alloc(MM_KERNEL | MM_ZERO);
-        refcount_inc(&amap->pages[idx]->count);
-        amap->curr_size++;
-        phys = amap->pages[idx]->addr;
+        page = page_alloc(MM_KERNEL | MM_ZERO);
+        refcount_inc(&page->count);
+        vm_amap_set_page(amap, idx, page);
+        phys = page->addr;
     } else if (requested & VM_ACCESS_WRITE) {
-        if (amap->pages[idx]) {
-            assert(refcount_get(&amap->pages[idx]->count) > 0);
+        if (curr) {
+            assert(refcount_get(&curr->count) > 0);
 
             /* If the reference count is greater than 1 we must copy it. Shared
              * regions should not contain any pages with a reference count
              * greater than 1. */
-            if (refcount_get(&amap->pages[idx]->count) > 1) {
+            if (refcount_get(&curr->count) > 1) {
                 assert(region->flags & VM_MAP_PRIVATE);
 
                 dprintf(
                     "vm:  anon write fault: copying page %zu (addr: 0x%" PRIxPHYS ", refcount: %" PRId32 ")\n",
-                    idx, amap->pages[idx]->addr, amap->pages[idx]->count);
+                    idx, curr->addr, curr->count);
 
-                page = page_copy(amap->pages[idx], MM_KERNEL);
+                page = page_copy(curr, MM_KERNEL);
                 refcount_inc(&page->count);
 
                 /* Decrease the count of the old page. We must handle it going
                  * to 0 here, as another object could have released the page
                  * while we were copying. */
-                if (refcount_dec(&amap->pages[idx]->count) == 0)
-                    page_free(amap->pages[idx]);
+                if (refcount_dec(&curr->count) == 0)
+                    page_free(curr);
 
-                amap->pages[idx] = page;
+                vm_amap_set_page(amap, idx, page);
+                curr = page;
             }
 
-            phys = amap->pages[idx]->addr;
+            phys = curr->addr;
         } else {
             assert(region->flags & VM_MAP_PRIVATE);
             assert(region->handle);
@@ -423,25 +654,24 @@ static status_t map_anon_page(vm_region_t *region, ptr_t addr, uint32_t requeste
 
             /* Add the page and release the old one. */
             refcount_inc(&page->count);
-            amap->pages[idx] = page;
+            vm_amap_set_page(amap, idx, page);
             if (prev && prev->ops && prev->ops->release_page)
                 prev->ops->release_page(prev);
 
-            amap->curr_size++;
             phys = page->addr;
         }
     } else {
-        if (amap->pages[idx]) {
-            assert(refcount_get(&amap->pages[idx]->count) > 0);
+        if (curr) {
+            assert(refcount_get(&curr->count) > 0);
 
             /* If the reference count is greater than 1, map read only so we
              * copy it if there is a later write to the page. */
-            if (refcount_get(&amap->pages[idx]->count) > 1) {
+            if (refcount_get(&curr->count) > 1) {
                 assert(region->flags & VM_MAP_PRIVATE);
                 access &= ~VM_ACCESS_WRITE;
             }
 
-            phys = amap->pages[idx]->addr;
+            phys = curr->addr;
         } else {
             assert(region->flags & VM_MAP_PRIVATE);
             assert(region->handle);
@@ -539,6 +769,68 @@ static status_t map_object_page(vm_region_t *region, ptr_t addr, phys_ptr_t *_ph
     return STATUS_SUCCESS;
 }
 
+/**
+ * Maps pages around a page that has just been faulted in that are already
+ * resident in the region's source object, so that accesses to them do not
+ * need to take a fault of their own. Pages which are not resident are left
+ * alone, no I/O is performed here.
+ *
+ * @note                Address space and MMU context should be locked.
+ *
+ * @param region        Region the fault occurred in.
+ * @param addr          Page-aligned address of the fault.
+ */
+static void fault_around(vm_region_t *region, ptr_t addr) {
+    if (!vm_fault_around_size || !region->handle || !region->ops->lookup_page)
+        return;
+
+    /* Map the window around the fault that lies within the region. */
+    ptr_t start = max(round_down(addr, vm_fault_around_size), region->start);
+    ptr_t end   = min(start + vm_fault_around_size - 1, region->start + region->size - 1);
+
+    /* Pages in a private region's anonymous map are mapped read-only so that
+     * writes go through copy-on-write. In other regions the page is what a
+     * write fault would map anyway, so give it the region's access flags. */
+    vm_amap_t *amap = region->amap;
+    uint32_t access = region->access;
+    if (amap) {
+        access &= ~VM_ACCESS_WRITE;
+        mutex_lock(&amap->lock);
+    }
+
+    for (ptr_t curr = start; curr <= end; curr += PAGE_SIZE) {
+        if (curr == addr || (region->flags & VM_MAP_STACK && curr == region->start))
+            continue;
+
+        if (mmu_context_query(region->as->mmu, curr, NULL, NULL))
+            continue;
+
+        offset_t offset = curr - region->start;
+        if (amap) {
+            offset += region->amap_offset;
+
+            /* Don't map the source page if there is a page in the map. */
+            if (vm_amap_page(amap, (size_t)(offset >> PAGE_WIDTH)))
+                continue;
+        }
+
+        page_t *page;
+        status_t ret = region->ops->lookup_page(region, offset + region->obj_offset, &page);
+        if (ret != STATUS_SUCCESS)
+            continue;
+
+        mmu_context_map(region->as->mmu, curr, page->addr, access, MM_KERNEL);
+        region->as->faults_saved++;
+
+        dprintf(
+            "vm: mapped 0x%" PRIxPHYS " around fault at %p (as: %p, access: 0x%x)\n",
+            page->addr, curr, region->as, access);
+    }
+
+    if (amap)
+        mutex_unlock(&amap->lock);
+}
+
 /** Map a page for a region into its address space.
  * @note                Address space and MMU context should be locked. */
 static status_t map_page(vm_region_t *region, ptr_t addr, uint32_t requested, phys_ptr_t *_phys) {
@@ -563,13 +855,11 @@ static bool unmap_page(vm_region_t *region, ptr_t addr) {
     /* Release the page from the source. */
     if (region->amap) {
         offset += region->amap_offset;
-        size_t idx = offset >> PAGE_WIDTH;
-
-        assert(idx < region->amap->max_size);
+        page_t *curr = vm_amap_page(region->amap, offset >> PAGE_WIDTH);
 
         /* If page is in the object, then do nothing. */
-        if (region->amap->pages[idx]) {
-            assert(region->amap->pages[idx] == page);
+        if (curr) {
+            assert(curr == page);
             return true;
         }
 
@@ -734,9 +1024,23 @@ static void vm_region_unmap(vm_region_t *region, ptr_t start, size_t size) {
 
     mmu_context_lock(region->as->mmu);
 
-    /* Unmap pages covering the region. */
-    for (size_t i = 0; i < size; i += PAGE_SIZE)
-        unmap_page(region, start + i);
+    /* Unmap pages covering the region. Large pages only exist in anonymous
+     * regions with no source, for which the pages are owned by the anonymous
+     * map, so unmapping them whole needs no further work. Removing them whole
+     * avoids splitting them first. */
+    for (size_t i = 0; i < size; ) {
+        ptr_t addr = start + i;
+
+        if (region->amap && !region->handle &&
+            !(addr % LARGE_PAGE_SIZE) && size - i >= LARGE_PAGE_SIZE &&
+            mmu_context_unmap_large(region->as->mmu, addr, true, NULL))
+        {
+            i += LARGE_PAGE_SIZE;
+        } else {
+            unmap_page(region, addr);
+            i += PAGE_SIZE;
+        }
+    }
 
     mmu_context_unlock(region->as->mmu);
 
@@ -957,6 +1261,9 @@ bool vm_fault(frame_t *frame, ptr_t addr, int reason, uint32_t access) {
         exception.status = map_object_page(region, base, NULL);
     }
 
+    if (exception.status == STATUS_SUCCESS && reason == VM_FAULT_UNMAPPED)
+        fault_around(region, base);
+
     local_irq_disable();
     mmu_context_unlock(as->mmu);
 
@@ -1554,10 +1861,12 @@ void vm_aspace_switch(vm_aspace_t *as) {
             refcount_dec(&curr_cpu->aspace->count);
         }
 
-        /* Switch to the new address space. */
+        /* Switch to the new address space. The current address space must be
+         * set before loading, as the MMU may need to be able to detect that
+         * this CPU is using the context (e.g. for PCID invalidation). */
         refcount_inc(&as->count);
-        mmu_context_load(as->mmu);
         curr_cpu->aspace = as;
+        mmu_context_load(as->mmu);
     }
 
     local_irq_restore(irq_state);
@@ -1570,9 +1879,10 @@ vm_aspace_t *vm_aspace_create(void) {
 
     vm_aspace_t *as = slab_cache_alloc(vm_aspace_cache, MM_KERNEL);
 
-    as->mmu        = mmu_context_create(MM_KERNEL);
-    as->find_cache = NULL;
-    as->free_map   = 0;
+    as->mmu          = mmu_context_create(MM_KERNEL);
+    as->find_cache   = NULL;
+    as->free_map     = 0;
+    as->faults_saved = 0;
 
     /* Insert the initial free region. */
     vm_region_t *region = slab_cache_alloc(vm_region_cache, MM_KERNEL);
@@ -1614,9 +1924,10 @@ vm_aspace_t *vm_aspace_create(void) {
 vm_aspace_t *vm_aspace_clone(vm_aspace_t *parent) {
     vm_aspace_t *as = slab_cache_alloc(vm_aspace_cache, MM_KERNEL);
 
-    as->mmu        = mmu_context_create(MM_KERNEL);
-    as->find_cache = NULL;
-    as->free_map   = 0;
+    as->mmu          = mmu_context_create(MM_KERNEL);
+    as->find_cache   = NULL;
+    as->free_map     = 0;
+    as->faults_saved = 0;
 
     mutex_lock(&parent->lock);
 
@@ -1914,12 +2225,13 @@ static kdb_status_t kdb_cmd_aspace(int argc, char **argv, kdb_filter_t *filter)
         kdb_printf("=================================================\n");
 
         kdb_printf(
-            "lock:       %d (%" PRId32 ")\n",
+            "lock:         %d (%" PRId32 ")\n",
             atomic_load(&as->lock.value), (as->lock.holder) ? as->lock.holder->id : -1);
-        kdb_printf("count:      %d\n", refcount_get(&as->count));
-        kdb_printf("find_cache: %p\n", as->find_cache);
-        kdb_printf("mmu:        %p\n", as->mmu);
-        kdb_printf("free_map:   0x%lx\n\n", as->free_map);
+        kdb_printf("count:        %d\n", refcount_get(&as->count));
+        kdb_printf("find_cache:   %p\n", as->find_cache);
+        kdb_printf("mmu:          %p\n", as->mmu);
+        kdb_printf("free_map:     0x%lx\n", as->free_map);
+        kdb_printf("faults_saved: %" PRIu64 "\n\n", as->faults_saved);
     }
 
     if (mode == DUMP_FREE)
@@ -1974,6 +2286,8 @@ __init_text void vm_init(void) {
         "vm_amap_cache",
         vm_amap_t, vm_amap_ctor, NULL, NULL, 0, MM_BOOT);
 
+    vm_fault_around_size = kboot_integer_option("vm_fault_around") * PAGE_SIZE;
+
     /* Bring up the page daemons. */
     page_daemon_init();
 
@@ -18,6 +18,28 @@
  * @file
  * @brief               Page-based data cache.
  *
+ * Reading data into a page is done without the cache lock held, so that other
+ * pages in the cache can be used while the read is in progress. The page is
+ * inserted into the cache marked as busy beforehand, and anyone who needs it
+ * waits for the read to complete rather than starting another.
+ *
+ * Reads through vm_cache_io() are tracked per file handle. When they are found
+ * to be sequential, pages beyond the end of the read are read in ahead of time
+ * by a worker thread, so that I/O for the following pages overlaps with the
+ * caller copying out the current ones. The read-ahead window starts small and
+ * doubles on each sequential read, up to a maximum, and is reset on any
+ * non-sequential read.
+ *
+ * Pages are indexed by an index_tree_t, which can be searched without locking.
+ * Modifications to the index and I/O are serialised by the cache's mutex, but
+ * taking a reference to a page that is already cached, and releasing one,
+ * only needs the page lock, a spinlock which covers the page reference count
+ * and state transitions and removal of pages from the index. The common case
+ * of getting a cached page is therefore done without any sleeping lock, and
+ * readers of the same cache do not block each other. Unused pages can be
+ * evicted by the page daemon at any time, so anything removing a page from
+ * the index must check that it has not already been removed.
+ *
  * TODO:
  *  - Put pages in the pageable queue.
  *  - Implement nonblocking I/O?
@@ -28,12 +50,15 @@
 
 #include <io/request.h>
 
+#include <mm/malloc.h>
 #include <mm/phys.h>
 #include <mm/slab.h>
 #include <mm/vm_cache.h>
 
 #include <proc/thread.h>
 
+#include <sync/semaphore.h>
+
 #include <assert.h>
 #include <kdb.h>
 #include <status.h>
@@ -47,11 +72,28 @@
 #   define dprintf(fmt...)
 #endif
 
+/** Read-ahead window limits (in pages). */
+#define VM_CACHE_READAHEAD_MIN      4
+#define VM_CACHE_READAHEAD_MAX      32
+
+/** Structure describing a batch of pages to read ahead. */
+typedef struct vm_cache_readahead_job {
+    list_t header;                  /**< Link to job queue. */
+    vm_cache_t *cache;              /**< Cache being read into. */
+    size_t count;                   /**< Number of pages. */
+    page_t *pages[VM_CACHE_READAHEAD_MAX];
+} vm_cache_readahead_job_t;
+
 static page_ops_t vm_cache_page_ops;
 
 /** Slab cache for allocating VM cache structures. */
 static slab_cache_t *vm_cache_cache;
 
+/** Queue of read-ahead jobs for the read-ahead thread. */
+static LIST_DEFINE(readahead_jobs);
+static SPINLOCK_DEFINE(readahead_lock);
+static SEMAPHORE_DEFINE(readahead_sem, 0);
+
 /** Constructor for VM cache structures.
  * @param obj           Object to construct.
  * @param data          Unused. */
@@ -59,7 +101,76 @@ static void vm_cache_ctor(void *obj, void *data) {
     vm_cache_t *cache = obj;
 
     mutex_init(&cache->lock, "vm_cache_lock", 0);
-    avl_tree_init(&cache->pages);
+    spinlock_init(&cache->page_lock, "vm_cache_page_lock");
+    condvar_init(&cache->io_cvar, "vm_cache_io_cvar");
+    index_tree_init(&cache->pages);
+}
+
+/** Gets a reference to a page if it is cached and not busy. This does not
+ * require the cache lock.
+ * @param cache         Cache to get page from.
+ * @param offset        Offset of page to get.
+ * @return              Referenced page, or NULL if not available. */
+static page_t *vm_cache_ref_page(vm_cache_t *cache, offset_t offset) {
+    spinlock_lock(&cache->page_lock);
+
+    page_t *page = index_tree_lookup(&cache->pages, offset >> PAGE_WIDTH);
+    if (page && !page->busy && offset < cache->size) {
+        if (refcount_inc(&page->count) == 1)
+            page_set_state(page, PAGE_STATE_ALLOCATED);
+    } else {
+        page = NULL;
+    }
+
+    spinlock_unlock(&cache->page_lock);
+    return page;
+}
+
+/** Finishes I/O on a busy page.
+ * @param cache         Cache the page belongs to. Must be locked.
+ * @param page          Page that I/O was being performed on.
+ * @param ret           Status of the I/O. If this is a failure, the page is
+ *                      removed from the cache and freed. */
+static void vm_cache_finish_io(vm_cache_t *cache, page_t *page, status_t ret) {
+    assert(page->busy);
+
+    spinlock_lock(&cache->page_lock);
+
+    page->busy = false;
+
+    if (ret != STATUS_SUCCESS) {
+        index_tree_remove(&cache->pages, page->offset >> PAGE_WIDTH);
+        refcount_dec(&page->count);
+    }
+
+    spinlock_unlock(&cache->page_lock);
+
+    if (ret != STATUS_SUCCESS)
+        page_free(page);
+
+    cache->io_count--;
+    condvar_broadcast(&cache->io_cvar);
+}
+
+/** Reads data for a page that is not in a cache. The page is inserted into
+ * the cache marked as busy and the lock is dropped while reading.
+ * @param cache         Cache to read into. Must be locked, and will be locked
+ *                      again upon return.
+ * @param page          Page to read (referenced by the caller).
+ * @param mapping       Mapping of the page.
+ * @return              Status code describing result of the operation. Upon
+ *                      failure the page will have been freed. */
+static status_t vm_cache_read_page(vm_cache_t *cache, page_t *page, void *mapping) {
+    page->busy = true;
+    index_tree_insert(&cache->pages, page->offset >> PAGE_WIDTH, page);
+    cache->io_count++;
+
+    mutex_unlock(&cache->lock);
+    status_t ret = cache->ops->read_page(cache, mapping, page->offset);
+    mutex_lock(&cache->lock);
+
+    vm_cache_finish_io(cache, page, ret);
+    return ret;
 }
 
 /** Get a page from a cache.
@@ -85,24 +196,36 @@ static status_t vm_cache_get_page_internal(
     assert((_page && !_mapping) || (_mapping && !_page));
     assert(!(offset % PAGE_SIZE));
 
-    mutex_lock(&cache->lock);
+    /* Check if we have it cached, without taking the cache lock. */
+    page_t *page = vm_cache_ref_page(cache, offset);
+    if (!page) {
+        mutex_lock(&cache->lock);
 
-    assert(!cache->deleted);
+        assert(!cache->deleted);
 
-    /* Check whether it is within the size of the cache. */
-    if (offset >= cache->size) {
-        mutex_unlock(&cache->lock);
-        return STATUS_INVALID_ADDR;
-    }
+        while (true) {
+            /* Check whether it is within the size of the cache. */
+            if (offset >= cache->size) {
+                mutex_unlock(&cache->lock);
+                return STATUS_INVALID_ADDR;
+            }
 
-    /* Check if we have it cached. */
-    page_t *page = avl_tree_lookup(&cache->pages, offset, page_t, avl_link);
-    if (page) {
-        if (refcount_inc(&page->count) == 1)
-            page_set_state(page, PAGE_STATE_ALLOCATED);
+            /* Check again now that we hold the lock, as another thread may
+             * have brought the page in. */
+            page = vm_cache_ref_page(cache, offset);
+            if (page || !index_tree_lookup(&cache->pages, offset >> PAGE_WIDTH))
+                break;
 
-        mutex_unlock(&cache->lock);
+            /* The page is being read in, wait for that to finish. The read
+             * could fail and remove the page, so we must look it up again. */
+            condvar_wait(&cache->io_cvar, &cache->lock);
+        }
 
+        if (page)
+            mutex_unlock(&cache->lock);
+    }
+
+    if (page) {
         /* Map it in if required. Wire the thread to the current CPU and specify
          * that the mapping is not being shared - the mapping will only be
          * accessed by this thread, so we can save having to do a remote TLB
@@ -128,10 +251,17 @@ static status_t vm_cache_get_page_internal(
     /* Allocate a new page. */
     page = page_alloc(MM_KERNEL);
 
+    page->ops     = &vm_cache_page_ops;
+    page->private = cache;
+    page->offset  = offset;
+
+    refcount_inc(&page->count);
+
     /* Only bother filling the page with data if it's not going to be
      * immediately overwritten. */
     void *mapping = NULL;
     bool shared = false;
+    bool cached = false;
     if (!overwrite) {
         /* If a read operation is provided, read in data, else zero the page. */
         if (cache->ops && cache->ops->read_page) {
@@ -141,13 +271,15 @@ static status_t vm_cache_get_page_internal(
             mapping = phys_map(page->addr, PAGE_SIZE, MM_KERNEL);
             shared  = true;
 
-            ret = cache->ops->read_page(cache, mapping, offset);
+            /* This inserts the page into the cache. */
+            ret = vm_cache_read_page(cache, page, mapping);
             if (ret != STATUS_SUCCESS) {
                 phys_unmap(mapping, PAGE_SIZE, true);
-                page_free(page);
                 mutex_unlock(&cache->lock);
                 return ret;
             }
+
+            cached = true;
         } else {
             thread_wire(curr_thread);
             mapping = phys_map(page->addr, PAGE_SIZE, MM_KERNEL);
@@ -156,12 +288,8 @@ static status_t vm_cache_get_page_internal(
     }
 
     /* Cache the page and unlock. */
-    page->ops     = &vm_cache_page_ops;
-    page->private = cache;
-    page->offset  = offset;
-
-    refcount_inc(&page->count);
-    avl_tree_insert(&cache->pages, offset, &page->avl_link);
+    if (!cached)
+        index_tree_insert(&cache->pages, offset >> PAGE_WIDTH, page);
 
     mutex_unlock(&cache->lock);
 
@@ -195,13 +323,17 @@ static status_t vm_cache_get_page_internal(
 }
 
 /** Releases a page from a cache.
- * @param cache         Cache that the page belongs to. Must be locked.
+ * @param cache         Cache that the page belongs to.
  * @param page          Page to release.
  * @param dirty         Whether the page has been dirtied. */
 static void vm_cache_release_page_internal(vm_cache_t *cache, page_t *page, bool dirty) {
     dprintf(
         "cache: released page 0x%" PRIxPHYS " at offset 0x%" PRIx64 " in %p\n",
-        page->addr, offset, cache);
+        page->addr, page->offset, cache);
+
+    bool discard = false;
+
+    spinlock_lock(&cache->page_lock);
 
     /* Mark as modified if requested. */
     if (dirty)
@@ -213,8 +345,8 @@ static void vm_cache_release_page_internal(vm_cache_t *cache, page_t *page, bool
          * resized with pages in use, discard it). Otherwise, move the page to
          * the appropriate queue. */
         if (page->offset >= cache->size) {
-            avl_tree_remove(&cache->pages, &page->avl_link);
-            page_free(page);
+            index_tree_remove(&cache->pages, page->offset >> PAGE_WIDTH);
+            discard = true;
         } else if (page->modified && cache->ops && cache->ops->write_page) {
             page_set_state(page, PAGE_STATE_MODIFIED);
         } else {
@@ -222,6 +354,11 @@ static void vm_cache_release_page_internal(vm_cache_t *cache, page_t *page, bool
             page_set_state(page, PAGE_STATE_CACHED);
         }
     }
+
+    spinlock_unlock(&cache->page_lock);
+
+    if (discard)
+        page_free(page);
 }
 
 /** Flushes changes to a cache page. */
@@ -242,10 +379,14 @@ static status_t vm_cache_flush_page_internal(vm_cache_t *cache, page_t *page) {
     if (ret == STATUS_SUCCESS) {
         /* Clear modified flag only if the page reference count is zero. This is
          * because the page may be mapped into an address space as read-write. */
+        spinlock_lock(&cache->page_lock);
+
         if (refcount_get(&page->count) == 0) {
             page->modified = false;
-            page_set_state(page, PAGE_STATE_CACHED); 
+            page_set_state(page, PAGE_STATE_CACHED);
         }
+
+        spinlock_unlock(&cache->page_lock);
     }
 
     phys_unmap(mapping, PAGE_SIZE, true);
@@ -285,15 +426,12 @@ static void vm_cache_unmap_page(
     if (!shared)
         thread_unwire(curr_thread);
 
-    mutex_lock(&cache->lock);
-
-    page_t *page = avl_tree_lookup(&cache->pages, offset, page_t, avl_link);
+    /* We hold a reference so the page cannot be removed. */
+    page_t *page = index_tree_lookup(&cache->pages, offset >> PAGE_WIDTH);
     if (unlikely(!page))
         fatal("Tried to release page that isn't cached");
 
     vm_cache_release_page_internal(cache, page, dirty);
-
-    mutex_unlock(&cache->lock);
 }
 
 /** Flush changes to a page from a cache. */
@@ -308,30 +446,48 @@ static status_t vm_cache_flush_page(page_t *page) {
 
     if (cache->deleted) {
         mutex_unlock(&cache->lock);
-        return true;
+        return STATUS_SUCCESS;
     }
 
     status_t ret = vm_cache_flush_page_internal(cache, page);
     mutex_unlock(&cache->lock);
-    return (ret == STATUS_SUCCESS);
+    return ret;
 }
 
 /** Release a page in a cache. */
 static void vm_cache_release_page(page_t *page) {
     vm_cache_t *cache = page->private;
 
-    mutex_lock(&cache->lock);
-
     /* The VM system will have flagged the page as modified if necessary. */
     vm_cache_release_page_internal(cache, page, false);
+}
 
-    mutex_unlock(&cache->lock);
+/** Evict an unused page from a cache. */
+static bool vm_cache_evict_page(page_t *page) {
+    vm_cache_t *cache = page->private;
+
+    /* Called with the page queue locked, which nests the other way to the
+     * page lock, so we can only try to take it. The queue lock does prevent
+     * the page from being freed, so the cache cannot go away. */
+    if (!spinlock_trylock_noirq(&cache->page_lock))
+        return false;
+
+    uint64_t key = page->offset >> PAGE_WIDTH;
+    bool evict =
+        refcount_get(&page->count) == 0 && !page->busy && !page->modified &&
+        index_tree_lookup(&cache->pages, key) == page;
+    if (evict)
+        index_tree_remove(&cache->pages, key);
+
+    spinlock_unlock_noirq(&cache->page_lock);
+    return evict;
 }
 
 /** VM cache page operations. */
 static page_ops_t vm_cache_page_ops = {
     .flush_page   = vm_cache_flush_page,
     .release_page = vm_cache_release_page,
+    .evict_page   = vm_cache_evict_page,
 };
 
 /** Get a page from a cache. */
@@ -339,16 +495,163 @@ static status_t vm_cache_get_page(vm_region_t *region, offset_t offset, page_t *
     return vm_cache_get_page_internal(region->private, offset, false, _page, NULL, NULL);
 }
 
+/** Get a page from a cache if it is already cached. */
+static status_t vm_cache_lookup_page(vm_region_t *region, offset_t offset, page_t **_page) {
+    vm_cache_t *cache = region->private;
+
+    assert(!(offset % PAGE_SIZE));
+
+    page_t *page = vm_cache_ref_page(cache, offset);
+    if (!page)
+        return STATUS_NOT_FOUND;
+
+    *_page = page;
+    return STATUS_SUCCESS;
+}
+
 /** VM region operations for mapping a VM cache. */
 vm_region_ops_t vm_cache_region_ops = {
-    .get_page = vm_cache_get_page,
+    .get_page    = vm_cache_get_page,
+    .lookup_page = vm_cache_lookup_page,
 };
 
+/** Thread which performs read-ahead I/O. */
+static void vm_cache_readahead_thread(void *arg1, void *arg2) {
+    while (true) {
+        semaphore_down(&readahead_sem);
+
+        spinlock_lock(&readahead_lock);
+
+        assert(!list_empty(&readahead_jobs));
+        vm_cache_readahead_job_t *job = list_first(&readahead_jobs, vm_cache_readahead_job_t, header);
+        list_remove(&job->header);
+
+        spinlock_unlock(&readahead_lock);
+
+        vm_cache_t *cache = job->cache;
+
+        /* The cache cannot be destroyed until all of the pages have completed,
+         * so it must not be touched after the last one is finished. */
+        for (size_t i = 0; i < job->count; i++) {
+            page_t *page = job->pages[i];
+
+            void *mapping = phys_map(page->addr, PAGE_SIZE, MM_KERNEL);
+            status_t ret = cache->ops->read_page(cache, mapping, page->offset);
+            phys_unmap(mapping, PAGE_SIZE, true);
+
+            dprintf(
+                "cache: read ahead page 0x%" PRIxPHYS " at offset 0x%" PRIx64 " in %p: %d\n",
+                page->addr, page->offset, cache, ret);
+
+            mutex_lock(&cache->lock);
+
+            vm_cache_finish_io(cache, page, ret);
+            if (ret == STATUS_SUCCESS)
+                vm_cache_release_page_internal(cache, page, false);
+
+            mutex_unlock(&cache->lock);
+        }
+
+        kfree(job);
+    }
+}
+
+/** Queues pages following a read to be read ahead.
+ * @param cache         Cache to read into. Must be locked.
+ * @param offset        Offset of the first page to read.
+ * @param count         Number of pages to read. */
+static void vm_cache_readahead_queue(vm_cache_t *cache, offset_t offset, size_t count) {
+    vm_cache_readahead_job_t *job = NULL;
+
+    for (size_t i = 0; i < count && offset < cache->size; i++, offset += PAGE_SIZE) {
+        if (index_tree_lookup(&cache->pages, offset >> PAGE_WIDTH))
+            continue;
+
+        /* Read-ahead is only an optimization, so don't wait for memory. */
+        page_t *page = page_alloc(MM_NOWAIT);
+        if (!page)
+            break;
+
+        if (!job) {
+            job = kmalloc(sizeof(*job), MM_NOWAIT);
+            if (!job) {
+                page_free(page);
+                break;
+            }
+
+            list_init(&job->header);
+            job->cache = cache;
+            job->count = 0;
+        }
+
+        page->ops     = &vm_cache_page_ops;
+        page->private = cache;
+        page->offset  = offset;
+        page->busy    = true;
+
+        /* The reference is held by the read-ahead thread until done. */
+        refcount_inc(&page->count);
+        index_tree_insert(&cache->pages, offset >> PAGE_WIDTH, page);
+        cache->io_count++;
+
+        job->pages[job->count++] = page;
+    }
+
+    if (job) {
+        spinlock_lock(&readahead_lock);
+        list_append(&readahead_jobs, &job->header);
+        spinlock_unlock(&readahead_lock);
+
+        semaphore_up(&readahead_sem, 1);
+    }
+}
+
+/** Updates read-ahead state for a read and starts read-ahead if it is found
+ * to be sequential.
+ * @param cache         Cache being read from. Must be locked.
+ * @param ra            Read-ahead state.
+ * @param offset        Offset of the read.
+ * @param size          Size of the read. */
+static void vm_cache_readahead(vm_cache_t *cache, vm_cache_readahead_t *ra, offset_t offset, size_t size) {
+    if (offset == ra->next) {
+        ra->window = (ra->window)
+            ? min(ra->window * 2, VM_CACHE_READAHEAD_MAX)
+            : VM_CACHE_READAHEAD_MIN;
+    } else {
+        ra->window = 0;
+        ra->issued = 0;
+    }
+
+    ra->next = offset + size;
+
+    /* No point if there is no I/O to be done to get pages. */
+    if (!ra->window || !cache->ops || !cache->ops->read_page)
+        return;
+
+    /* Read ahead the window following this read, but only once at least half
+     * of what was previously read ahead has been consumed so that the pages
+     * are read in reasonably sized batches. */
+    offset_t start = round_up(ra->next, PAGE_SIZE);
+    offset_t end   = start + ((offset_t)ra->window * PAGE_SIZE);
+
+    if (ra->issued > start) {
+        if (ra->issued - start >= ((offset_t)ra->window * PAGE_SIZE) / 2)
+            return;
+
+        start = ra->issued;
+    }
+
+    ra->issued = end;
+    vm_cache_readahead_queue(cache, start, (end - start) / PAGE_SIZE);
+}
+
 /** Performs I/O on a cache.
  * @param cache         Cache to read from.
  * @param request       I/O request to perform.
+ * @param ra            Read-ahead state for the file handle performing the
+ *                      I/O (optional).
  * @return              Status code describing result of the operation. */
-status_t vm_cache_io(vm_cache_t *cache, io_request_t *request) {
+status_t vm_cache_io(vm_cache_t *cache, io_request_t *request, vm_cache_readahead_t *ra) {
     status_t ret;
 
     mutex_lock(&cache->lock);
@@ -363,6 +666,9 @@ status_t vm_cache_io(vm_cache_t *cache, io_request_t *request) {
         ? (size_t)(cache->size - request->offset)
         : request->total;
 
+    if (ra && request->op == IO_OP_READ)
+        vm_cache_readahead(cache, ra, request->offset, total);
+
     mutex_unlock(&cache->lock);
 
     /* Now work out the start page and the end page. Subtract one from count to
@@ -429,21 +735,35 @@ status_t vm_cache_io(vm_cache_t *cache, io_request_t *request) {
 void vm_cache_resize(vm_cache_t *cache, offset_t size) {
     mutex_lock(&cache->lock);
 
+    /* Set the new size first so that no new references can be taken to pages
+     * beyond the end. */
+    offset_t prev = cache->size;
+
+    spinlock_lock(&cache->page_lock);
+    cache->size = size;
+    spinlock_unlock(&cache->page_lock);
+
     /* Shrink the cache if the new size is smaller. If any pages are in use they
      * will get freed once they are released. */
-    if (size < cache->size) {
-        avl_tree_foreach_safe(&cache->pages, iter) {
-            page_t *page = avl_tree_entry(iter, page_t, avl_link);
+    if (size < prev) {
+        uint64_t key;
+        index_tree_foreach(
+            &cache->pages, page_t, page, key,
+            round_up(size, PAGE_SIZE) >> PAGE_WIDTH, UINT64_MAX)
+        {
+            spinlock_lock(&cache->page_lock);
+
+            bool discard =
+                refcount_get(&page->count) == 0 &&
+                index_tree_remove(&cache->pages, key) == page;
+
+            spinlock_unlock(&cache->page_lock);
 
-            if (page->offset >= size && refcount_get(&page->count) == 0) {
-                avl_tree_remove(&cache->pages, &page->avl_link);
+            if (discard)
                 page_free(page);
-            }
         }
     }
 
-    cache->size = size;
-
     mutex_unlock(&cache->lock);
 }
 
@@ -459,9 +779,8 @@ status_t vm_cache_flush(vm_cache_t *cache) {
     mutex_lock(&cache->lock);
 
     /* Flush all pages. */
-    avl_tree_foreach(&cache->pages, iter) {
-        page_t *page = avl_tree_entry(iter, page_t, avl_link);
-
+    uint64_t key;
+    index_tree_foreach(&cache->pages, page_t, page, key, 0, UINT64_MAX) {
         status_t err = vm_cache_flush_page_internal(cache, page);
         if (err != STATUS_SUCCESS)
             ret = err;
@@ -479,10 +798,11 @@ status_t vm_cache_flush(vm_cache_t *cache) {
 vm_cache_t *vm_cache_create(offset_t size, vm_cache_ops_t *ops, void *data) {
     vm_cache_t *cache = slab_cache_alloc(vm_cache_cache, MM_KERNEL);
 
-    cache->size    = size;
-    cache->ops     = ops;
-    cache->data    = data;
-    cache->deleted = false;
+    cache->size     = size;
+    cache->ops      = ops;
+    cache->data     = data;
+    cache->deleted  = false;
+    cache->io_count = 0;
 
     return cache;
 }
@@ -495,12 +815,15 @@ vm_cache_t *vm_cache_create(offset_t size, vm_cache_ops_t *ops, void *data) {
 status_t vm_cache_destroy(vm_cache_t *cache, bool discard) {
     mutex_lock(&cache->lock);
 
+    /* Wait for any outstanding read-ahead to complete. */
+    while (cache->io_count)
+        condvar_wait(&cache->io_cvar, &cache->lock);
+
     cache->deleted = true;
 
     /* Free all pages. */
-    avl_tree_foreach_safe(&cache->pages, iter) {
-        page_t *page = avl_tree_entry(iter, page_t, avl_link);
-
+    uint64_t key;
+    index_tree_foreach(&cache->pages, page_t, page, key, 0, UINT64_MAX) {
         if (refcount_get(&page->count) != 0) {
             fatal("Cache page still in use while destroying");
         } else if (!discard) {
@@ -512,10 +835,21 @@ status_t vm_cache_destroy(vm_cache_t *cache, bool discard) {
             }
         }
 
-        avl_tree_remove(&cache->pages, &page->avl_link);
-        page_free(page);
+        spinlock_lock(&cache->page_lock);
+        bool removed = index_tree_remove(&cache->pages, key) == page;
+        spinlock_unlock(&cache->page_lock);
+
+        if (removed)
+            page_free(page);
     }
 
+    /* A page may have been evicted from under us, in which case the page
+     * daemon could still be using the index and lock. Wait for it. */
+    spinlock_lock(&cache->page_lock);
+    spinlock_unlock(&cache->page_lock);
+
+    index_tree_destroy(&cache->pages);
+
     /* Unlock and relock the cache to allow any attempts to flush or evict a
      * page see the deleted flag. */
     mutex_unlock(&cache->lock);
@@ -550,21 +884,21 @@ static kdb_status_t kdb_cmd_cache(int argc, char **argv, kdb_filter_t *filter) {
     kdb_printf("=================================================\n");
 
     kdb_printf(
-        "locked:  %d (%" PRId32 ")\n",
+        "locked:   %d (%" PRId32 ")\n",
         atomic_load(&cache->lock.value), (cache->lock.holder) ? cache->lock.holder->id : -1);
-    kdb_printf("size:    %" PRIu64 "\n", cache->size);
-    kdb_printf("ops:     %p\n", cache->ops);
-    kdb_printf("data:    %p\n", cache->data);
-    kdb_printf("deleted: %d\n\n", cache->deleted);
+    kdb_printf("size:     %" PRIu64 "\n", cache->size);
+    kdb_printf("ops:      %p\n", cache->ops);
+    kdb_printf("data:     %p\n", cache->data);
+    kdb_printf("deleted:  %d\n", cache->deleted);
+    kdb_printf("io_count: %zu\n\n", cache->io_count);
 
     /* Show all cached pages. */
     kdb_printf("Cached pages:\n");
-    avl_tree_foreach(&cache->pages, iter) {
-        page_t *page = avl_tree_entry(iter, page_t, avl_link);
-
+    uint64_t key;
+    index_tree_foreach(&cache->pages, page_t, page, key, 0, UINT64_MAX) {
         kdb_printf(
-            "  Page 0x%016" PRIxPHYS " - Offset: %-10" PRIu64 " Modified: %-1d Count: %d\n",
-            page->addr, page->offset, page->modified, refcount_get(&page->count));
+            "  Page 0x%016" PRIxPHYS " - Offset: %-10" PRIu64 " Modified: %-1d Busy: %-1d Count: %d\n",
+            page->addr, page->offset, page->modified, page->busy, refcount_get(&page->count));
     }
 
     return KDB_SUCCESS;
@@ -576,5 +910,9 @@ __init_text void vm_cache_init(void) {
         "vm_cache_cache",
         vm_cache_t, vm_cache_ctor, NULL, NULL, 0, MM_BOOT);
 
+    status_t ret = thread_create("vm_readahead", NULL, 0, vm_cache_readahead_thread, NULL, NULL, NULL);
+    if (ret != STATUS_SUCCESS)
+        fatal("Could not start read-ahead thread (%d)", ret);
+
     kdb_register_command("cache", "Print information about a page cache.", kdb_cmd_cache);
 }
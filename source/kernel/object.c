@@ -18,6 +18,13 @@
  * @file
  * @brief               Kernel object manager.
  *
+ * Besides kern_object_wait(), which sets up and tears down waits on every
+ * object on each call, object events can be waited on through a wait set.
+ * Events are registered with a wait set once, and remain armed until they are
+ * removed. When an event is signalled, it is placed on the wait set's ready
+ * list, so a wait on the set only has to deal with the events that are ready
+ * rather than every registered event.
+ *
  * TODO:
  *  - Make handle tables resizable, based on process limits or something (e.g.
  *    rlimit).
@@ -26,6 +33,8 @@
 
 #include <lib/bitmap.h>
 
+#include <lib/utility.h>
+
 #include <mm/malloc.h>
 #include <mm/safe.h>
 #include <mm/slab.h>
@@ -51,6 +60,9 @@
 /** Maximum number of handles. */
 #define HANDLE_TABLE_SIZE   512
 
+/** Maximum number of events returned by a single wait set wait. */
+#define WAITSET_WAIT_MAX    1024
+
 /** Object waiter structure. */
 typedef struct object_waiter {
     list_t header;                  /**< Link to waiters list. */
@@ -59,6 +71,16 @@ typedef struct object_waiter {
     size_t count;                   /**< Number of remaining events to be signalled. */
 } object_waiter_t;
 
+/** Wait set structure. */
+typedef struct object_waitset {
+    mutex_t lock;                   /**< Lock for the registered event list. */
+    list_t events;                  /**< Registered events. */
+
+    spinlock_t ready_lock;          /**< Lock for the ready list. */
+    list_t ready;                   /**< Events that have been signalled. */
+    list_t waiters;                 /**< Threads waiting for events. */
+} object_waitset_t;
+
 /** Object waiting internal data structure. */
 typedef struct object_wait {
     object_event_t event;           /**< User-supplied event information. */
@@ -68,6 +90,7 @@ typedef struct object_wait {
     enum {
         OBJECT_WAIT_NORMAL,         /**< Wait is a call to kern_object_wait(). */
         OBJECT_WAIT_CALLBACK,       /**< Wait is a callback. */
+        OBJECT_WAIT_WAITSET,        /**< Wait is registered in a wait set. */
     } type;
 
     union {
@@ -90,6 +113,13 @@ typedef struct object_wait {
 
             unsigned priority;      /**< Callback priority. */
         };
+
+        /** Wait set data. */
+        struct {
+            object_waitset_t *set;  /**< Wait set the event is registered in. */
+            list_t set_link;        /**< Link to wait set events list. */
+            list_t ready_link;      /**< Link to wait set ready list. */
+        };
     };
 } object_wait_t;
 
@@ -99,6 +129,9 @@ static slab_cache_t *object_handle_cache;
 /** Cache for object wait structures. */
 static slab_cache_t *object_wait_cache;
 
+/** Cache for wait set structures. */
+static slab_cache_t *object_waitset_cache;
+
 /** Object type names. */
 static const char *object_type_names[] = {
     [OBJECT_TYPE_PROCESS]    = "OBJECT_TYPE_PROCESS",
@@ -111,6 +144,7 @@ static const char *object_type_names[] = {
     [OBJECT_TYPE_PORT]       = "OBJECT_TYPE_PORT",
     [OBJECT_TYPE_CONNECTION] = "OBJECT_TYPE_CONNECTION",
     [OBJECT_TYPE_SEMAPHORE]  = "OBJECT_TYPE_SEMAPHORE",
+    [OBJECT_TYPE_WAITSET]    = "OBJECT_TYPE_WAITSET",
 };
 
 /**
@@ -666,6 +700,23 @@ void object_event_signal(object_event_t *event, unsigned long data) {
 
             break;
         }
+        case OBJECT_WAIT_WAITSET: {
+            object_waitset_t *set = wait->set;
+
+            spinlock_lock(&set->ready_lock);
+
+            /* Only queue if it is not already queued, in which case the waiter
+             * will just pick up the latest data. Wake a single waiter, it will
+             * pass on the wakeup if it leaves anything on the list. */
+            if (list_empty(&wait->ready_link))
+                list_append(&set->ready, &wait->ready_link);
+
+            if (!list_empty(&set->waiters))
+                thread_wake(list_first(&set->waiters, thread_t, wait_link));
+
+            spinlock_unlock(&set->ready_lock);
+            break;
+        }
     }
 }
 
@@ -727,6 +778,9 @@ __init_text void object_init(void) {
     object_wait_cache = object_cache_create(
         "object_wait_cache",
         object_wait_t, NULL, NULL, NULL, 0, MM_BOOT);
+    object_waitset_cache = object_cache_create(
+        "object_waitset_cache",
+        object_waitset_t, NULL, NULL, NULL, 0, MM_BOOT);
 
     kdb_register_command("handles", "Inspect a process' handle table.", kdb_cmd_handles);
 }
@@ -1017,6 +1071,355 @@ err_free:
     return ret;
 }
 
+/** Removes an event from a wait set (wait set lock must be held). */
+static void waitset_remove_event(object_waitset_t *set, object_wait_t *wait) {
+    wait->handle->type->unwait(wait->handle, &wait->event);
+
+    spinlock_lock(&set->ready_lock);
+    list_remove(&wait->ready_link);
+    spinlock_unlock(&set->ready_lock);
+
+    list_remove(&wait->set_link);
+    object_handle_release(wait->handle);
+    slab_cache_free(object_wait_cache, wait);
+}
+
+/** Closes a handle to a wait set. */
+static void waitset_object_close(object_handle_t *handle) {
+    object_waitset_t *set = handle->private;
+
+    mutex_lock(&set->lock);
+
+    while (!list_empty(&set->events)) {
+        object_wait_t *wait = list_first(&set->events, object_wait_t, set_link);
+        waitset_remove_event(set, wait);
+    }
+
+    mutex_unlock(&set->lock);
+
+    assert(list_empty(&set->waiters));
+    slab_cache_free(object_waitset_cache, set);
+}
+
+/** Wait set object type. */
+static object_type_t waitset_object_type = {
+    .id    = OBJECT_TYPE_WAITSET,
+    .close = waitset_object_close,
+};
+
+/**
+ * Finds an event in a wait set (wait set lock must be held). Events are matched
+ * by the handle structure rather than the handle ID, since the ID may have been
+ * closed and reused since the event was registered.
+ */
+static object_wait_t *waitset_find_event(object_waitset_t *set, object_handle_t *handle, unsigned event) {
+    list_foreach(&set->events, iter) {
+        object_wait_t *wait = list_entry(iter, object_wait_t, set_link);
+
+        if (wait->handle == handle && wait->event.event == event)
+            return wait;
+    }
+
+    return NULL;
+}
+
+/**
+ * Creates a new wait set. A wait set is a persistent set of object events to
+ * wait for: events are registered once with kern_waitset_add(), and remain
+ * registered until they are removed with kern_waitset_remove() or the wait set
+ * is closed. kern_waitset_wait() then returns only the events that have been
+ * signalled, so unlike kern_object_wait(), the cost of a wait does not depend
+ * on the number of registered events.
+ *
+ * @param _handle       Where to store handle to the wait set.
+ *
+ * @return              Status code describing result of the operation.
+ */
+status_t kern_waitset_create(handle_t *_handle) {
+    if (!_handle)
+        return STATUS_INVALID_ARG;
+
+    object_waitset_t *set = slab_cache_alloc(object_waitset_cache, MM_KERNEL);
+
+    mutex_init(&set->lock, "waitset_lock", 0);
+    spinlock_init(&set->ready_lock, "waitset_ready_lock");
+    list_init(&set->events);
+    list_init(&set->ready);
+    list_init(&set->waiters);
+
+    status_t ret = object_handle_open(&waitset_object_type, set, NULL, _handle);
+    if (ret != STATUS_SUCCESS)
+        slab_cache_free(object_waitset_cache, set);
+
+    return ret;
+}
+
+/**
+ * Registers an event with a wait set. Each event ID can only be registered once
+ * for an open handle in a wait set. The wait set holds a reference to the
+ * handle, so the object remains registered until the event is removed, even if
+ * the handle ID is closed. The handle ID is only used to look up the handle: it
+ * is returned as given in signalled events, but once closed it may be reused
+ * for a different handle, which can be registered separately. Events should be
+ * removed before closing the handle ID, as it can no longer be used to remove
+ * them afterwards.
+ *
+ * By default, events are level-triggered: once returned by kern_waitset_wait()
+ * the event is re-armed, and will be returned again by the next wait if the
+ * event condition is still true. If the OBJECT_EVENT_EDGE flag is set, the
+ * event is only returned when the event condition changes from false to true.
+ * If the OBJECT_EVENT_ONESHOT flag is set, the event is removed from the wait
+ * set once it has been returned.
+ *
+ * @param handle        Handle to wait set.
+ * @param event         Event to register. The udata field will be returned
+ *                      unmodified when the event is signalled.
+ *
+ * @return              STATUS_SUCCESS if successful.
+ *                      STATUS_INVALID_ARG if event is NULL.
+ *                      STATUS_INVALID_HANDLE if a handle does not exist.
+ *                      STATUS_INVALID_EVENT if an invalid event ID is used.
+ *                      STATUS_ALREADY_EXISTS if the event is already
+ *                      registered in the wait set.
+ */
+status_t kern_waitset_add(handle_t handle, const object_event_t *event) {
+    status_t ret;
+
+    if (!event)
+        return STATUS_INVALID_ARG;
+
+    object_wait_t *wait = slab_cache_alloc(object_wait_cache, MM_KERNEL);
+
+    ret = memcpy_from_user(&wait->event, event, sizeof(wait->event));
+    if (ret != STATUS_SUCCESS)
+        goto err_free;
+
+    wait->event.flags &= ~(OBJECT_EVENT_SIGNALLED | OBJECT_EVENT_ERROR);
+    wait->event.data   = 0;
+
+    object_handle_t *khandle;
+    ret = object_handle_lookup(handle, OBJECT_TYPE_WAITSET, &khandle);
+    if (ret != STATUS_SUCCESS)
+        goto err_free;
+
+    object_waitset_t *set = khandle->private;
+
+    wait->type = OBJECT_WAIT_WAITSET;
+    wait->set  = set;
+
+    list_init(&wait->set_link);
+    list_init(&wait->ready_link);
+
+    mutex_lock(&set->lock);
+
+    ret = object_handle_lookup(wait->event.handle, -1, &wait->handle);
+    if (ret != STATUS_SUCCESS) {
+        goto err_unlock;
+    } else if (!wait->handle->type->wait || !wait->handle->type->unwait) {
+        ret = STATUS_INVALID_EVENT;
+        goto err_release_handle;
+    } else if (waitset_find_event(set, wait->handle, wait->event.event)) {
+        ret = STATUS_ALREADY_EXISTS;
+        goto err_release_handle;
+    }
+
+    list_append(&set->events, &wait->set_link);
+
+    ret = wait->handle->type->wait(wait->handle, &wait->event);
+    if (ret != STATUS_SUCCESS) {
+        list_remove(&wait->set_link);
+
+        /* Could have been signalled before failing. */
+        spinlock_lock(&set->ready_lock);
+        list_remove(&wait->ready_link);
+        spinlock_unlock(&set->ready_lock);
+
+        goto err_release_handle;
+    }
+
+    mutex_unlock(&set->lock);
+    object_handle_release(khandle);
+    return STATUS_SUCCESS;
+
+err_release_handle:
+    object_handle_release(wait->handle);
+
+err_unlock:
+    mutex_unlock(&set->lock);
+    object_handle_release(khandle);
+
+err_free:
+    slab_cache_free(object_wait_cache, wait);
+    return ret;
+}
+
+/** Removes an event from a wait set.
+ * @param handle        Handle to wait set.
+ * @param target        Handle that the event was registered for. This must
+ *                      still refer to the same handle as it did when the
+ *                      event was registered.
+ * @param event         Event ID that was registered.
+ * @return              STATUS_SUCCESS if successful.
+ *                      STATUS_INVALID_HANDLE if the wait set handle or the
+ *                      target handle does not exist.
+ *                      STATUS_NOT_FOUND if the event is not registered. */
+status_t kern_waitset_remove(handle_t handle, handle_t target, unsigned event) {
+    object_handle_t *khandle;
+    status_t ret = object_handle_lookup(handle, OBJECT_TYPE_WAITSET, &khandle);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    object_handle_t *ktarget;
+    ret = object_handle_lookup(target, -1, &ktarget);
+    if (ret != STATUS_SUCCESS) {
+        object_handle_release(khandle);
+        return ret;
+    }
+
+    object_waitset_t *set = khandle->private;
+
+    mutex_lock(&set->lock);
+
+    object_wait_t *wait = waitset_find_event(set, ktarget, event);
+    if (wait) {
+        waitset_remove_event(set, wait);
+    } else {
+        ret = STATUS_NOT_FOUND;
+    }
+
+    mutex_unlock(&set->lock);
+    object_handle_release(ktarget);
+    object_handle_release(khandle);
+    return ret;
+}
+
+/**
+ * Waits for events registered in a wait set to be signalled, or until the
+ * timeout period expires. Only events that have been signalled are returned,
+ * with the OBJECT_EVENT_SIGNALLED flag and the event data set. If more events
+ * are ready than will fit in the supplied array, the rest will be returned by
+ * subsequent calls.
+ *
+ * @param handle        Handle to wait set.
+ * @param events        Array to return signalled events in.
+ * @param count         Size of the array. At most 1024 events are returned by
+ *                      a single call.
+ * @param timeout       Maximum time to wait in nanoseconds. A value of 0 will
+ *                      cause the function to return immediately if no events
+ *                      are ready, and a value of -1 will block indefinitely
+ *                      until an event is signalled.
+ * @param _count        Where to store number of events returned.
+ *
+ * @return              STATUS_SUCCESS if successful.
+ *                      STATUS_INVALID_ARG if count is 0 or events or _count
+ *                      is NULL.
+ *                      STATUS_INVALID_HANDLE if the wait set handle does not
+ *                      exist.
+ *                      STATUS_WOULD_BLOCK if the timeout is 0 and no events
+ *                      are ready.
+ *                      STATUS_TIMED_OUT if the timeout expires.
+ *                      STATUS_INTERRUPTED if the sleep was interrupted.
+ */
+status_t kern_waitset_wait(
+    handle_t handle, object_event_t *events, size_t count, nstime_t timeout,
+    size_t *_count)
+{
+    status_t ret;
+
+    if (!count || !events || !_count)
+        return STATUS_INVALID_ARG;
+
+    count = min(count, WAITSET_WAIT_MAX);
+
+    object_handle_t *khandle;
+    ret = object_handle_lookup(handle, OBJECT_TYPE_WAITSET, &khandle);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    object_waitset_t *set = khandle->private;
+
+    /* Use an absolute timeout since we may need to sleep more than once. */
+    unsigned sleep_flags = SLEEP_INTERRUPTIBLE;
+    if (timeout > 0) {
+        timeout += system_time();
+        sleep_flags |= SLEEP_ABSOLUTE;
+    }
+
+    object_event_t *kevents = NULL;
+    object_wait_t **waits   = NULL;
+    size_t ready            = 0;
+
+    while (!ready) {
+        /* Wait for something to be put on the ready list. */
+        spinlock_lock(&set->ready_lock);
+
+        if (list_empty(&set->ready)) {
+            list_append(&set->waiters, &curr_thread->wait_link);
+
+            ret = thread_sleep(&set->ready_lock, timeout, "waitset_wait", sleep_flags);
+            if (ret != STATUS_SUCCESS)
+                goto out;
+        } else {
+            spinlock_unlock(&set->ready_lock);
+        }
+
+        if (!kevents) {
+            kevents = kmalloc(count * sizeof(*kevents), MM_KERNEL);
+            waits   = kmalloc(count * sizeof(*waits), MM_KERNEL);
+        }
+
+        /* Take the lock to prevent events from being removed while we're
+         * working with them. Another thread may have taken the events in the
+         * meantime, in which case we go back to sleep. */
+        mutex_lock(&set->lock);
+        spinlock_lock(&set->ready_lock);
+
+        while (ready < count && !list_empty(&set->ready)) {
+            object_wait_t *wait = list_first(&set->ready, object_wait_t, ready_link);
+            list_remove(&wait->ready_link);
+
+            memcpy(&kevents[ready], &wait->event, sizeof(*kevents));
+            wait->event.flags &= ~OBJECT_EVENT_SIGNALLED;
+            waits[ready++] = wait;
+        }
+
+        /* Pass on the wakeup if we've left anything behind. */
+        if (!list_empty(&set->ready) && !list_empty(&set->waiters))
+            thread_wake(list_first(&set->waiters, thread_t, wait_link));
+
+        spinlock_unlock(&set->ready_lock);
+
+        for (size_t i = 0; i < ready; i++) {
+            object_wait_t *wait = waits[i];
+
+            if (wait->event.flags & OBJECT_EVENT_ONESHOT) {
+                waitset_remove_event(set, wait);
+            } else if (!(wait->event.flags & OBJECT_EVENT_EDGE)) {
+                /* Re-arm level-triggered events. If the condition is still
+                 * true this will put the event straight back on the ready
+                 * list. */
+                wait->handle->type->unwait(wait->handle, &wait->event);
+                if (wait->handle->type->wait(wait->handle, &wait->event) != STATUS_SUCCESS) {
+                    kevents[i].flags |= OBJECT_EVENT_ERROR;
+                    waitset_remove_event(set, wait);
+                }
+            }
+        }
+
+        mutex_unlock(&set->lock);
+    }
+
+    ret = memcpy_to_user(events, kevents, ready * sizeof(*kevents));
+    if (ret == STATUS_SUCCESS)
+        ret = write_user(_count, ready);
+
+out:
+    kfree(kevents);
+    kfree(waits);
+    object_handle_release(khandle);
+    return ret;
+}
+
 /** Gets the flags set on a handle table entry.
  * @see                 kern_handle_set_flags().
  * @param handle        Handle to get flags for.
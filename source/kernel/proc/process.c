@@ -47,7 +47,7 @@
 #include <security/security.h>
 
 #include <sync/futex.h>
-#include <sync/rwlock.h>
+#include <sync/brlock.h>
 #include <sync/semaphore.h>
 
 #include <assert.h>
@@ -87,6 +87,7 @@ typedef struct process_load {
     elf_image_t *image;             /**< ELF loader data. */
     ptr_t arg_block;                /**< Address of argument block mapping. */
     ptr_t stack;                    /**< Address of stack mapping. */
+    ptr_t time_page;                /**< Address of time page mapping. */
 
     semaphore_t sem;                /**< Semaphore to wait for completion on. */
     status_t status;                /**< Status code to return from the call. */
@@ -94,7 +95,7 @@ typedef struct process_load {
 
 /** Tree of all processes. */
 static AVL_TREE_DEFINE(process_tree);
-static RWLOCK_DEFINE(process_tree_lock);
+static brlock_t process_tree_lock;
 
 /** Process ID allocator. */
 static id_allocator_t process_id_allocator;
@@ -163,9 +164,9 @@ static status_t process_alloc(
     process->load           = NULL;
 
     /* Add to the process tree. */
-    rwlock_write_lock(&process_tree_lock);
+    brlock_write_lock(&process_tree_lock);
     avl_tree_insert(&process_tree, process->id, &process->tree_link);
-    rwlock_unlock(&process_tree_lock);
+    brlock_write_unlock(&process_tree_lock);
 
     dprintf(
         "process: created process %" PRId32 " (%s) (process: %p, parent: %p)\n",
@@ -224,9 +225,9 @@ void process_release(process_t *process) {
     if (process->state == PROCESS_CREATED)
         process_cleanup(process);
 
-    rwlock_write_lock(&process_tree_lock);
+    brlock_write_lock(&process_tree_lock);
     avl_tree_remove(&process_tree, &process->tree_link);
-    rwlock_unlock(&process_tree_lock);
+    brlock_write_unlock(&process_tree_lock);
 
     token_release(process->token);
     id_allocator_free(&process_id_allocator, process->id);
@@ -384,13 +385,13 @@ process_t *process_lookup_unsafe(process_id_t id) {
  * @return              Pointer to process found, or NULL if not found.
  */
 process_t *process_lookup(process_id_t id) {
-    rwlock_read_lock(&process_tree_lock);
+    brlock_read_lock(&process_tree_lock);
 
     process_t *process = process_lookup_unsafe(id);
     if (process)
         process_retain(process);
 
-    rwlock_unlock(&process_tree_lock);
+    brlock_read_unlock(&process_tree_lock);
     return process;
 }
 
@@ -467,6 +468,11 @@ static status_t process_load(process_load_t *load, process_t *parent) {
     if (ret != STATUS_SUCCESS)
         return ret;
 
+    /* Map the time page. This is not fatal, libkernel will fall back to using
+     * kernel calls to get the time if it isn't available. */
+    if (time_page_map(load->aspace, &load->time_page) != STATUS_SUCCESS)
+        load->time_page = 0;
+
     return STATUS_SUCCESS;
 }
 
@@ -504,6 +510,7 @@ static void process_entry_trampoline(void *arg1, void *arg2) {
     uargs->arg_count = load->arg_count;
     uargs->env_count = load->env_count;
     uargs->load_base = (void *)load->image->load_base;
+    uargs->time_page = (void *)load->time_page;
 
     /* Copy path string, arguments and environment variables. */
     strcpy(uargs->path, load->path);
@@ -663,6 +670,8 @@ static kdb_status_t kdb_cmd_process(int argc, char **argv, kdb_filter_t *filter)
 
 /** Initialize the process table and slab cache. */
 __init_text void process_init(void) {
+    brlock_init(&process_tree_lock, "process_tree_lock");
+
     /* Create the process ID allocator. We reserve ID 0 as it is always
      * given to the kernel process. */
     id_allocator_init(&process_id_allocator, 65535, MM_BOOT);
@@ -685,7 +694,7 @@ __init_text void process_init(void) {
 
 /** Terminate all running processes. */
 void process_shutdown(void) {
-    rwlock_read_lock(&process_tree_lock);
+    brlock_read_lock(&process_tree_lock);
 
     avl_tree_foreach_safe(&process_tree, iter) {
         process_t *process = avl_tree_entry(iter, process_t, tree_link);
@@ -697,7 +706,7 @@ void process_shutdown(void) {
         }
     }
 
-    rwlock_unlock(&process_tree_lock);
+    brlock_read_unlock(&process_tree_lock);
 
     /* Wait until everything has terminated. */
     nstime_t interval = 0;
@@ -707,7 +716,7 @@ void process_shutdown(void) {
         interval += msecs_to_nsecs(1);
 
         count = 0;
-        rwlock_read_lock(&process_tree_lock);
+        brlock_read_lock(&process_tree_lock);
 
         avl_tree_foreach_safe(&process_tree, iter) {
             process_t *process = avl_tree_entry(iter, process_t, tree_link);
@@ -723,7 +732,7 @@ void process_shutdown(void) {
             }
         }
 
-        rwlock_unlock(&process_tree_lock);
+        brlock_read_unlock(&process_tree_lock);
     } while (count);
 
     /* Close the kernel library handle. */
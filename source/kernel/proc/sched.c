@@ -41,19 +41,24 @@
  * CPU-bound is to see whether it uses up all of its timeslice.
  *
  * On multi-CPU systems, load is balanced between CPUs when moving threads into
- * the Ready state by picking an appropriate CPU to run on. Currently, the CPU
- * that the thread previously ran on is favoured if it is not heavily loaded.
- * Otherwise, the CPU with the lowest load is picked.
+ * the Ready state by picking an appropriate CPU to run on. If there are idle
+ * CPUs, the CPU topology is used to pick the best of them: CPUs sharing a last
+ * level cache with the CPU waking the thread are favoured, followed by CPUs on
+ * a core which is entirely idle (so that the thread does not compete with
+ * another for a core's execution resources), followed by the CPU the thread
+ * previously ran on. If no CPUs are idle, the CPU that the thread previously
+ * ran on is favoured if it is not heavily loaded. Otherwise, the CPU with the
+ * lowest load is picked.
+ *
+ * Since CPU-bound threads rarely go through the Ready transition, this alone
+ * can leave one CPU saturated while another sits idle. To handle this, a CPU
+ * that runs out of threads to run will steal a ready thread from the most
+ * heavily loaded CPU. Additionally, each CPU runs a periodic balance timer
+ * which checks whether another CPU has at least 2 more threads than it, and
+ * if so triggers a reschedule which pulls a thread over.
  *
  * TODO:
- *  - Load balancing could be improved in situations where there are several
- *    CPU-bound threads running. Currently, a thread is only moved to another
- *    CPU when it is woken from sleep. This could be done by stealing threads
- *    from other CPUs when a CPU becomes idle.
- *  - Once the facility to get CPU topology information is implemented, we
- *    should be more friendly to HT systems when picking a CPU for a thread to
- *    run on by favouring idle logical CPUs on a core that is not already
- *    running a thread on another of its logical CPUs.
+ *  - Load balancing does not take topology into account.
  *  - Possibly a better heuristic for determining whether a thread is CPU-/IO-
  *    bound is to look at how much time it spends sleeping.
  *  - Alter timeslice based on priority?
@@ -64,12 +69,15 @@
 #include <lib/string.h>
 
 #include <mm/malloc.h>
+#include <mm/page.h>
 #include <mm/vm.h>
 
 #include <proc/process.h>
 #include <proc/sched.h>
 #include <proc/thread.h>
 
+#include <sync/rcu.h>
+
 #include <assert.h>
 #include <cpu.h>
 #include <kdb.h>
@@ -96,6 +104,9 @@
 /** Maximum penalty to CPU-bound threads. */
 #define MAX_PENALTY         5
 
+/** Interval between periodic load balancing checks. */
+#define BALANCE_INTERVAL    msecs_to_nsecs(50)
+
 /** Run queue structure. */
 typedef struct sched_queue {
     unsigned long bitmap;               /**< Bitmap of queues with data. */
@@ -114,6 +125,12 @@ typedef struct sched_cpu {
     sched_queue_t *expired;             /**< Expired queue. */
     sched_queue_t queues[2];            /**< Active and expired queues. */
     size_t total;                       /**< Total running/ready thread count. */
+
+    timer_t balance_timer;              /**< Periodic load balancing timer. */
+    bool balance;                       /**< Whether a load balance is required. */
+
+    nstime_t idle_time;                 /**< Total time spent idle. */
+    nstime_t idle_start;                /**< Time at which the CPU last became idle. */
 } sched_cpu_t;
 
 /** Total number of running/ready threads across all CPUs. */
@@ -186,6 +203,136 @@ static thread_t *sched_pick_thread(sched_cpu_t *cpu) {
     return thread;
 }
 
+/** Find the most heavily loaded CPU to take a thread from.
+ * @param cpu           Scheduler information for the CPU to balance to.
+ * @return              CPU with the highest load that is at least 2 greater
+ *                      than the load of the given CPU, or NULL if none. */
+static cpu_t *sched_find_busiest(sched_cpu_t *cpu) {
+    cpu_t *busiest = NULL;
+
+    /* Loads are read without locking, this is only a heuristic. Moving a thread
+     * only evens things out if the difference is at least 2. */
+    size_t max_load = cpu->total + 1;
+
+    list_foreach(&running_cpus, iter) {
+        cpu_t *other = list_entry(iter, cpu_t, header);
+
+        if (other->sched == cpu || !other->sched)
+            continue;
+
+        size_t load = other->sched->total;
+        if (load > max_load) {
+            busiest  = other;
+            max_load = load;
+        }
+    }
+
+    return busiest;
+}
+
+/** Take a thread from a run queue if it can be migrated.
+ * @param queue         Queue to search.
+ * @return              Thread removed from the queue (locked), or NULL if no
+ *                      suitable thread was found. */
+static thread_t *sched_steal_from_queue(sched_queue_t *queue) {
+    unsigned long bitmap = queue->bitmap;
+
+    while (bitmap) {
+        int i = fls(bitmap);
+        bitmap &= ~(1ul << i);
+
+        list_foreach(&queue->threads[i], iter) {
+            thread_t *thread = list_entry(iter, thread_t, runq_link);
+
+            /* A thread that was just switched away from on its CPU is put on
+             * the queue before its lock is released after the switch. The lock
+             * must be held to migrate it, so this also prevents us from running
+             * a thread that is still on another CPU's stack. */
+            if (!spinlock_trylock_noirq(&thread->lock))
+                continue;
+
+            if (thread->wired || thread->preempt_count) {
+                spinlock_unlock_noirq(&thread->lock);
+                continue;
+            }
+
+            sched_queue_remove(queue, thread);
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+
+/** Attempt to pull a thread over from the most heavily loaded CPU.
+ * @param cpu           Scheduler information for the current CPU (locked).
+ * @return              Whether a thread was moved to the current CPU. */
+static bool sched_steal_thread(sched_cpu_t *cpu) {
+    if (cpu_count == 1)
+        return false;
+
+    cpu_t *busiest = sched_find_busiest(cpu);
+    if (!busiest)
+        return false;
+
+    /* We already hold our own lock, and the other CPU could be trying to do
+     * the same to us, so don't wait for the lock. */
+    sched_cpu_t *other = busiest->sched;
+    if (!spinlock_trylock_noirq(&other->lock))
+        return false;
+
+    /* Check again now that we have the lock. Prefer threads that have used up
+     * their timeslice as they are less likely to be cache hot. */
+    thread_t *thread = NULL;
+    if (other->total > cpu->total + 1) {
+        thread = sched_steal_from_queue(other->expired);
+        if (!thread)
+            thread = sched_steal_from_queue(other->active);
+    }
+
+    if (thread) {
+        other->total--;
+        spinlock_unlock_noirq(&other->lock);
+
+        dprintf(
+            "sched: CPU %" PRIu32 " stole thread %" PRId32 " from CPU %" PRIu32 "\n",
+            curr_cpu->id, thread->id, busiest->id);
+
+        thread->cpu = curr_cpu;
+        sched_queue_insert(cpu->active, thread);
+        cpu->total++;
+
+        spinlock_unlock_noirq(&thread->lock);
+        return true;
+    } else {
+        spinlock_unlock_noirq(&other->lock);
+        return false;
+    }
+}
+
+/** Update idle state and time accounting for the current CPU.
+ * @param cpu           Scheduler information for the current CPU (locked).
+ * @param idle          Whether the CPU is becoming idle. */
+static inline void sched_set_idle(sched_cpu_t *cpu, bool idle) {
+    if (idle != curr_cpu->idle) {
+        nstime_t now = system_time();
+
+        if (idle) {
+            cpu->idle_start = now;
+
+            for (cpu_group_t *group = curr_cpu->group; group; group = group->parent)
+                atomic_fetch_sub_explicit(&group->busy_count, 1, memory_order_relaxed);
+        } else {
+            cpu->idle_time += now - cpu->idle_start;
+
+            for (cpu_group_t *group = curr_cpu->group; group; group = group->parent)
+                atomic_fetch_add_explicit(&group->busy_count, 1, memory_order_relaxed);
+        }
+
+        curr_cpu->idle = idle;
+    }
+}
+
 /** Scheduler timer handler function.
  * @param data          Data argument (unused).
  * @return              Always returns true. */
@@ -194,6 +341,21 @@ static bool sched_timer_handler(void *data) {
     return true;
 }
 
+/** Load balancing timer handler function.
+ * @param data          Scheduler information for the CPU.
+ * @return              Whether to preempt the current thread. */
+static bool sched_balance_timer_handler(void *data) {
+    sched_cpu_t *cpu = data;
+
+    /* Only trigger a reschedule if it looks like there is something to take,
+     * the real check is done in sched_steal_thread() with the locks held. */
+    if (!sched_find_busiest(cpu))
+        return false;
+
+    cpu->balance = true;
+    return true;
+}
+
 /**
  * Main function of the scheduler. Picks a new thread to run and switches to
  * it. Interrupts must be disabled (explicitly, before taking the thread lock),
@@ -209,6 +371,9 @@ static bool sched_timer_handler(void *data) {
 void sched_reschedule(bool state) {
     sched_cpu_t *cpu = curr_cpu->sched;
 
+    /* A thread cannot switch inside an RCU read-side critical section. */
+    rcu_quiescent_state();
+
     spinlock_lock_noirq(&cpu->lock);
 
     /* Stop the preemption timer if it is running. */
@@ -236,6 +401,13 @@ void sched_reschedule(bool state) {
         atomic_fetch_sub(&threads_running, 1);
     }
 
+    /* If we have nothing left to run, or the balance timer has found that
+     * another CPU is more heavily loaded, try to take a thread from it. */
+    if (cpu->balance || (!cpu->active->bitmap && !cpu->expired->bitmap)) {
+        cpu->balance = false;
+        sched_steal_thread(cpu);
+    }
+
     /* Find a new thread to run. A NULL return value means no threads are ready,
      * so we schedule the idle thread in this case. */
     thread_t *next = sched_pick_thread(cpu);
@@ -244,7 +416,7 @@ void sched_reschedule(bool state) {
             spinlock_lock_noirq(&next->lock);
 
         next->timeslice = THREAD_TIMESLICE;
-        curr_cpu->idle = false;
+        sched_set_idle(cpu, false);
     } else {
         next = cpu->idle_thread;
         if (next != curr_thread) {
@@ -258,7 +430,7 @@ void sched_reschedule(bool state) {
         /* The idle thread runs indefinitely until an interrupt causes something
          * to be woken up. */
         next->timeslice = 0;
-        curr_cpu->idle = true;
+        sched_set_idle(cpu, true);
     }
 
     assert(next->cpu == curr_cpu);
@@ -355,34 +527,89 @@ void preempt_enable(void) {
 
     assert(curr_thread->preempt_count > 0);
 
-    if (--curr_thread->preempt_count == 0 && irq_state) {
-        spinlock_lock_noirq(&curr_thread->lock);
+    if (--curr_thread->preempt_count == 0) {
+        /* This ends any RCU read-side critical section. */
+        rcu_quiescent_state();
 
-        /* If a preemption was missed then preempt immediately. */
-        if (curr_thread->flags & THREAD_PREEMPTED) {
-            curr_thread->flags &= ~THREAD_PREEMPTED;
-            sched_reschedule(irq_state);
-            return;
-        }
+        if (irq_state) {
+            spinlock_lock_noirq(&curr_thread->lock);
 
-        spinlock_unlock_noirq(&curr_thread->lock);
+            /* If a preemption was missed then preempt immediately. */
+            if (curr_thread->flags & THREAD_PREEMPTED) {
+                curr_thread->flags &= ~THREAD_PREEMPTED;
+                sched_reschedule(irq_state);
+                return;
+            }
+
+            spinlock_unlock_noirq(&curr_thread->lock);
+        }
     }
 
     local_irq_restore(irq_state);
 }
 
+/** Find the best idle CPU for a thread to run on.
+ * @param prev          CPU that the thread previously ran on.
+ * @return              Idle CPU to use, or NULL if none are idle. */
+static cpu_t *sched_find_idle_cpu(cpu_t *prev) {
+    /* The idle states are read without locking, this is only a heuristic. */
+    cpu_group_t *waker_cache = cpu_topology_group(curr_cpu, CPU_TOPOLOGY_CACHE);
+
+    cpu_t *best    = NULL;
+    int best_score = -1;
+
+    list_foreach(&running_cpus, iter) {
+        cpu_t *cpu = list_entry(iter, cpu_t, header);
+
+        /* Ignore CPUs that are idle but have just been given a thread. */
+        if (!cpu->sched || !cpu->idle || cpu->sched->total)
+            continue;
+
+        /* Keeping the thread close to the waker is most important, as they
+         * are likely to be sharing data. Then, avoid putting the thread on a
+         * core where it will compete with another thread. */
+        int score = 0;
+        if (cpu_topology_group(cpu, CPU_TOPOLOGY_CACHE) == waker_cache)
+            score += 4;
+        if (!atomic_load_explicit(&cpu->group->busy_count, memory_order_relaxed))
+            score += 2;
+        if (cpu == prev)
+            score += 1;
+
+        if (score > best_score) {
+            best       = cpu;
+            best_score = score;
+
+            if (score == 7)
+                break;
+        }
+    }
+
+    return best;
+}
+
 static inline cpu_t *sched_allocate_cpu(thread_t *thread) {
     /* On uniprocessor systems, we only have one choice. */
     if (cpu_count == 1)
         return curr_cpu;
 
+    /* Start on the current CPU that the thread currently belongs to. */
+    cpu_t *cpu = (thread->cpu) ? thread->cpu : curr_cpu;
+
+    /* If there is an idle CPU, use it. */
+    cpu_t *idle = sched_find_idle_cpu(cpu);
+    if (idle) {
+        dprintf(
+            "sched: giving thread %" PRId32 " to idle CPU %" PRIu32 " (previous: %" PRIu32 ")\n",
+            thread->id, idle->id, cpu->id);
+
+        return idle;
+    }
+
     /* Add 1 to the total number of threads to account for the thread we're
      * adding. */
     size_t total = atomic_load(&threads_running) + 1;
 
-    /* Start on the current CPU that the thread currently belongs to. */
-    cpu_t *cpu = (thread->cpu) ? thread->cpu : curr_cpu;
-
     /* Get the average number of threads that a CPU should have as well as the
      * CPU's current load. We round up to a multiple of the CPU count rather
      * than rounding down here to stop us from loading off threads
@@ -450,6 +677,23 @@ void sched_insert_thread(thread_t *thread) {
     spinlock_unlock(&sched->lock);
 }
 
+/** Get the total time that a CPU has spent idle.
+ * @param cpu           CPU to get for.
+ * @return              Total time spent idle since the scheduler was
+ *                      initialized on the CPU. */
+nstime_t sched_cpu_idle_time(cpu_t *cpu) {
+    sched_cpu_t *sched = cpu->sched;
+
+    spinlock_lock(&sched->lock);
+
+    nstime_t time = sched->idle_time;
+    if (cpu->idle)
+        time += system_time() - sched->idle_start;
+
+    spinlock_unlock(&sched->lock);
+    return time;
+}
+
 static void sched_idle_thread(void *arg1, void *arg2) {
     /* We run the loop with interrupts disabled. The arch_cpu_idle() function is
      * expected to re-enable interrupts as required. */
@@ -459,6 +703,11 @@ static void sched_idle_thread(void *arg1, void *arg2) {
         spinlock_lock_noirq(&curr_thread->lock);
         sched_reschedule(false);
 
+        /* Make use of the idle time to zero free pages. If we zeroed one,
+         * check again for something to run before halting. */
+        if (page_zero_idle())
+            continue;
+
         arch_cpu_idle();
     }
 }
@@ -477,6 +726,9 @@ __init_text void sched_init_percpu(void) {
     curr_cpu->sched->total = 0;
     curr_cpu->sched->active = &curr_cpu->sched->queues[0];
     curr_cpu->sched->expired = &curr_cpu->sched->queues[1];
+    curr_cpu->sched->balance = false;
+    curr_cpu->sched->idle_time = 0;
+    curr_cpu->sched->idle_start = system_time();
 
     /* Create the idle thread. */
     char name[THREAD_NAME_MAX];
@@ -506,6 +758,14 @@ __init_text void sched_init_percpu(void) {
         for (int j = 0; j < PRIORITY_COUNT; j++)
             list_init(&curr_cpu->sched->queues[i].threads[j]);
     }
+
+    /* Start the load balancing timer. cpu_count is final by this point as
+     * secondary CPUs have already been detected. */
+    timer_init(
+        &curr_cpu->sched->balance_timer, "sched_balance_timer",
+        sched_balance_timer_handler, curr_cpu->sched, 0);
+    if (cpu_count > 1)
+        timer_start(&curr_cpu->sched->balance_timer, BALANCE_INTERVAL, TIMER_PERIODIC);
 }
 
 /** Begin executing other threads. */
@@ -75,6 +75,7 @@
 
 #include <security/security.h>
 
+#include <sync/brlock.h>
 #include <sync/mutex.h>
 #include <sync/semaphore.h>
 
@@ -106,7 +107,7 @@ static bool thread_timeout(void *_thread);
 
 /** Tree of all threads. */
 static AVL_TREE_DEFINE(thread_tree);
-static RWLOCK_DEFINE(thread_tree_lock);
+static brlock_t thread_tree_lock;
 
 /** Thread ID allocator. */
 static id_allocator_t thread_id_allocator;
@@ -205,9 +206,9 @@ void thread_release(thread_t *thread) {
     if (thread->state == THREAD_CREATED)
         thread_cleanup(thread);
 
-    rwlock_write_lock(&thread_tree_lock);
+    brlock_write_lock(&thread_tree_lock);
     avl_tree_remove(&thread_tree, &thread->tree_link);
-    rwlock_unlock(&thread_tree_lock);
+    brlock_write_unlock(&thread_tree_lock);
 
     process_detach_thread(thread);
     id_allocator_free(&thread_id_allocator, thread->id);
@@ -700,7 +701,7 @@ thread_t *thread_lookup_unsafe(thread_id_t id) {
  * @return              Pointer to thread found, or NULL if not found.
  */
 thread_t *thread_lookup(thread_id_t id) {
-    rwlock_read_lock(&thread_tree_lock);
+    brlock_read_lock(&thread_tree_lock);
 
     thread_t *thread = thread_lookup_unsafe(id);
     if (thread) {
@@ -710,13 +711,14 @@ thread_t *thread_lookup(thread_id_t id) {
          * lying around that's being held onto by some handles, and query
          * information. Note that if this is allowed, a change will be necessary
          * to prevent a race condition with thread_release(). */
-        if (thread->state == THREAD_DEAD || thread->state == THREAD_CREATED)
-            return NULL;
-
-        thread_retain(thread);
+        if (thread->state == THREAD_DEAD || thread->state == THREAD_CREATED) {
+            thread = NULL;
+        } else {
+            thread_retain(thread);
+        }
     }
 
-    rwlock_unlock(&thread_tree_lock);
+    brlock_read_unlock(&thread_tree_lock);
     return thread;
 }
 
@@ -805,7 +807,7 @@ status_t thread_create(
     process_attach_thread(owner, thread);
 
     /* Add to the thread tree. */
-    rwlock_write_lock(&thread_tree_lock);
+    brlock_write_lock(&thread_tree_lock);
     avl_tree_insert(&thread_tree, thread->id, &thread->tree_link);
 
     dprintf(
@@ -819,7 +821,7 @@ status_t thread_create(
         thread_run(thread);
     }
 
-    rwlock_unlock(&thread_tree_lock);
+    brlock_write_unlock(&thread_tree_lock);
     return STATUS_SUCCESS;
 }
 
@@ -947,6 +949,8 @@ static kdb_status_t kdb_cmd_kill(int argc, char **argv, kdb_filter_t *filter) {
 
 /** Initialize the thread system. */
 __init_text void thread_init(void) {
+    brlock_init(&thread_tree_lock, "thread_tree_lock");
+
     /* Initialize the thread ID allocator. */
     id_allocator_init(&thread_id_allocator, 65535, MM_BOOT);
 
@@ -19,6 +19,7 @@
  * @brief               Symmetric Multi-Processing (SMP) support.
  */
 
+#include <lib/bitmap.h>
 #include <lib/refcount.h>
 
 #include <mm/malloc.h>
@@ -245,6 +246,35 @@ status_t smp_call_single(cpu_id_t dest, smp_call_func_t func, void *arg, unsigne
     return ret;
 }
 
+/** Queue a call to a CPU as part of a broadcast/multicast call.
+ * @param cpu           CPU to call on.
+ * @param func          Function to call.
+ * @param arg           Argument to pass to the function.
+ * @param flags         Behaviour flags.
+ * @param acked         Acknowledgement count for synchronous calls. */
+static void smp_call_queue_multiple(
+    cpu_t *cpu, smp_call_func_t func, void *arg, unsigned flags,
+    atomic_uint *acked)
+{
+    smp_call_t *call = smp_call_get();
+    call->func = func;
+    call->arg  = arg;
+
+    if (!(flags & SMP_CALL_ASYNC)) {
+        atomic_fetch_add(acked, 1);
+        call->result = acked;
+    } else {
+        call->result = NULL;
+    }
+
+    /* Queue the call in the CPU's call queue and send it an IPI. */
+    smp_call_queue(call, cpu);
+
+    /* We do not need to keep the structure around on this side as we have no
+     * status code to collect from it. */
+    smp_call_release(call);
+}
+
 /**
  * Interrupts all remote CPUs and causes the specified function to be called
  * on them. If the SMP_CALL_ASYNC flag is specified, this function will
@@ -274,30 +304,51 @@ void smp_call_broadcast(smp_call_func_t func, void *arg, unsigned flags) {
     /* Loop through all running CPUs, excluding ourselves. */
     list_foreach(&running_cpus, iter) {
         cpu_t *cpu = list_entry(iter, cpu_t, header);
-        if (cpu == curr_cpu)
-            continue;
+        if (cpu != curr_cpu)
+            smp_call_queue_multiple(cpu, func, arg, flags, &acked);
+    }
+
+    /* If calling synchronously, wait for all the sent messages to be
+     * acknowledged. */
+    if (!(flags & SMP_CALL_ASYNC)) {
+        while (atomic_load(&acked) != 0)
+            smp_ipi_handler();
+    }
 
-        smp_call_t *call = smp_call_get();
-        call->func = func;
-        call->arg  = arg;
+    local_irq_restore(irq_state);
+}
 
-        if (!(flags & SMP_CALL_ASYNC)) {
-            atomic_fetch_add(&acked, 1);
-            call->result = &acked;
-        } else {
-            call->result = NULL;
-        }
+/**
+ * Interrupts a set of CPUs and causes the specified function to be called on
+ * them. The current CPU is excluded even if it is in the set. Calls are queued
+ * to all of the CPUs before waiting for any of them, so the function runs on
+ * the target CPUs concurrently. Behaves the same as smp_call_broadcast() in
+ * all other respects.
+ *
+ * @param mask          Bitmap of CPU IDs to call on (sized for
+ *                      highest_cpu_id + 1 bits).
+ * @param func          Function to call (must not be NULL).
+ * @param arg           Argument to pass to the function.
+ * @param flags         Behaviour flags.
+ */
+void smp_call_multicast(const unsigned long *mask, smp_call_func_t func, void *arg, unsigned flags) {
+    bool irq_state = local_irq_disable();
 
-        /* Queue the call in the CPU's call queue and send it an IPI. */
-        smp_call_queue(call, cpu);
+    /* Don't do anything if the call system isn't enabled. */
+    if (!smp_call_enabled) {
+        local_irq_restore(irq_state);
+        return;
+    }
 
-        /* We do not need to keep the structure around on this side as we have
-         * no status code to collect from it. */
-        smp_call_release(call);
+    atomic_uint acked = 0;
+
+    for (cpu_id_t i = 0; i <= highest_cpu_id; i++) {
+        if (i != curr_cpu->id && bitmap_test(mask, i)) {
+            assert(cpus[i]);
+            smp_call_queue_multiple(cpus[i], func, arg, flags, &acked);
+        }
     }
 
-    /* If calling synchronously, wait for all the sent messages to be
-     * acknowledged. */
     if (!(flags & SMP_CALL_ASYNC)) {
         while (atomic_load(&acked) != 0)
             smp_ipi_handler();
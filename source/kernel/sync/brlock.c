@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Big-reader lock implementation.
+ *
+ * A reader increments the count for its current CPU, and then checks whether
+ * a writer is active. A writer sets the writer flag, and then waits for the
+ * sum of all CPUs' counts to reach zero. Both sides use sequentially consistent
+ * operations, so either the reader sees the writer flag and backs out, or the
+ * writer sees the reader's count and waits for it. A reader may migrate to
+ * another CPU while it holds the lock, so it may decrement a different count
+ * to the one it incremented. This means that individual counts can go
+ * negative, but the sum is still correct.
+ *
+ * Readers that see an active writer wait by taking the writer mutex, which is
+ * held for the whole time that a writer holds the lock. This also prevents
+ * writers from being starved by a constant stream of readers.
+ */
+
+#include <mm/malloc.h>
+
+#include <proc/thread.h>
+
+#include <sync/brlock.h>
+
+#include <cpu.h>
+#include <status.h>
+
+/** Get the number of readers holding a big-reader lock.
+ * @param lock          Lock to check.
+ * @return              Total number of readers. */
+static long brlock_readers(brlock_t *lock) {
+    long readers = 0;
+
+    for (cpu_id_t i = 0; i <= highest_cpu_id; i++)
+        readers += atomic_load(&lock->percpu[i].readers);
+
+    return readers;
+}
+
+/** Release a reader count, waking a writer waiting for readers to drain.
+ * @param lock          Lock to release. */
+static void brlock_put_reader(brlock_t *lock) {
+    atomic_fetch_sub(&lock->percpu[curr_cpu->id].readers, 1);
+
+    if (unlikely(atomic_load(&lock->writer))) {
+        spinlock_lock(&lock->lock);
+
+        if (!list_empty(&lock->threads)) {
+            thread_t *thread = list_first(&lock->threads, thread_t, wait_link);
+            thread_wake(thread);
+        }
+
+        spinlock_unlock(&lock->lock);
+    }
+}
+
+/**
+ * Acquires a big-reader lock for reading. Multiple readers can hold the lock
+ * at any one time. If a writer holds the lock or is waiting for it, the
+ * function will block until the writer has released it.
+ *
+ * @param lock          Lock to acquire.
+ */
+void brlock_read_lock(brlock_t *lock) {
+    atomic_fetch_add(&lock->percpu[curr_cpu->id].readers, 1);
+
+    if (likely(!atomic_load(&lock->writer)))
+        return;
+
+    /* Back out, as a writer may already have seen our count. Then wait for
+     * the writer to finish. Once we hold the writer mutex there can be no
+     * active writer, and any writer that comes along after we release it will
+     * see our count. */
+    brlock_put_reader(lock);
+
+    mutex_lock(&lock->write_lock);
+    atomic_fetch_add(&lock->percpu[curr_cpu->id].readers, 1);
+    mutex_unlock(&lock->write_lock);
+}
+
+/** Releases a big-reader lock held for reading.
+ * @param lock          Lock to release. */
+void brlock_read_unlock(brlock_t *lock) {
+    brlock_put_reader(lock);
+}
+
+/**
+ * Acquires a big-reader lock for writing. When the lock has been acquired, no
+ * other readers or writers will be holding the lock, or be able to acquire it.
+ *
+ * @param lock          Lock to acquire.
+ */
+void brlock_write_lock(brlock_t *lock) {
+    mutex_lock(&lock->write_lock);
+
+    /* Stop new readers, then wait for existing readers to drain. */
+    atomic_store(&lock->writer, true);
+
+    spinlock_lock(&lock->lock);
+
+    while (brlock_readers(lock) != 0) {
+        list_append(&lock->threads, &curr_thread->wait_link);
+        thread_sleep(&lock->lock, -1, lock->name, 0);
+        spinlock_lock(&lock->lock);
+    }
+
+    spinlock_unlock(&lock->lock);
+}
+
+/** Releases a big-reader lock held for writing.
+ * @param lock          Lock to release. */
+void brlock_write_unlock(brlock_t *lock) {
+    atomic_store(&lock->writer, false);
+    mutex_unlock(&lock->write_lock);
+}
+
+/** Initializes a big-reader lock.
+ * @param lock          Lock to initialize.
+ * @param name          Name to give lock. */
+void brlock_init(brlock_t *lock, const char *name) {
+    lock->percpu = kcalloc(highest_cpu_id + 1, sizeof(*lock->percpu), MM_KERNEL);
+
+    atomic_store_explicit(&lock->writer, false, memory_order_relaxed);
+    mutex_init(&lock->write_lock, name, 0);
+    spinlock_init(&lock->lock, "brlock_lock");
+    list_init(&lock->threads);
+
+    lock->name = name;
+}
@@ -17,14 +17,28 @@
 /**
  * @file
  * @brief               Mutex implementation.
+ *
+ * When a mutex is held by a thread that is currently running on another CPU,
+ * it is likely that it will be released shortly, so rather than going to sleep
+ * straight away (which costs a context switch on both sides), a thread trying
+ * to acquire it spins for as long as the holder remains running. As soon as the
+ * holder is preempted or blocks, or the mutex is being handed directly to a
+ * thread already sleeping on it, the thread falls back to sleeping. Spinning is
+ * only done with interrupts and preemption enabled: a CPU spinning with
+ * interrupts disabled could not respond to an IPI that the holder is waiting
+ * on (e.g. a TLB shootdown), which would deadlock.
  */
 
+#include <arch/lirq.h>
+
 #include <proc/thread.h>
 
 #include <sync/mutex.h>
 
 #include <assert.h>
+#include <cpu.h>
 #include <status.h>
+#include <time.h>
 
 static inline void mutex_recursive_error(mutex_t *lock) {
     #if CONFIG_DEBUG
@@ -37,6 +51,56 @@ static inline void mutex_recursive_error(mutex_t *lock) {
     #endif
 }
 
+/**
+ * Check whether the holder of a mutex is running. The holder is not
+ * dereferenced since it may release the lock and exit at any time. Instead,
+ * this checks whether it is still the current thread of the CPU that it
+ * acquired the lock on, which will not be the case once it has been preempted
+ * or has blocked.
+ *
+ * @param lock          Mutex to check.
+ * @param holder        Holder of the mutex.
+ *
+ * @return              Whether the holder is running.
+ */
+static inline bool mutex_holder_running(mutex_t *lock, thread_t *holder) {
+    cpu_t *cpu = lock->holder_cpu;
+    return cpu && cpu->thread == holder;
+}
+
+/** Spin waiting for a mutex to be released while its holder is running.
+ * @param lock          Mutex to acquire.
+ * @param deadline      System time at which to stop spinning, or -1 for none.
+ * @return              Whether the mutex was acquired. */
+static bool mutex_spin(mutex_t *lock, nstime_t deadline) {
+    if (cpu_count == 1 || !local_irq_state() || curr_thread->preempt_count)
+        return false;
+
+    while (true) {
+        thread_t *holder = lock->holder;
+
+        /* A NULL holder means either that the lock is being handed over to a
+         * sleeping thread, or that it is part way through being acquired or
+         * released. Just fall back to the slow path in either case. */
+        if (!holder || !mutex_holder_running(lock, holder))
+            return false;
+
+        while (lock->holder == holder && mutex_held(lock)) {
+            if (!mutex_holder_running(lock, holder))
+                return false;
+            if (deadline >= 0 && system_time() >= deadline)
+                return false;
+
+            arch_cpu_spin_hint();
+            compiler_barrier();
+        }
+
+        unsigned expected = 0;
+        if (atomic_compare_exchange_strong(&lock->value, &expected, 1))
+            return true;
+    }
+}
+
 static inline status_t mutex_lock_internal(mutex_t *lock, nstime_t timeout, unsigned flags) {
     unsigned expected = 0;
     if (!atomic_compare_exchange_strong(&lock->value, &expected, 1)) {
@@ -48,6 +112,16 @@ static inline status_t mutex_lock_internal(mutex_t *lock, nstime_t timeout, unsi
                 mutex_recursive_error(lock);
             }
         } else {
+            /* Make the timeout absolute so that time spent spinning counts
+             * towards it. */
+            if (timeout > 0 && !(flags & SLEEP_ABSOLUTE)) {
+                timeout += system_time();
+                flags |= SLEEP_ABSOLUTE;
+            }
+
+            if (timeout != 0 && mutex_spin(lock, timeout))
+                goto out;
+
             spinlock_lock(&lock->lock);
 
             /* Check again now that we have the lock, in case mutex_unlock() was
@@ -67,6 +141,11 @@ static inline status_t mutex_lock_internal(mutex_t *lock, nstime_t timeout, unsi
         }
     }
 
+out:
+    /* Set the CPU first so that a spinning thread that sees us as the holder
+     * sees the right CPU. */
+    lock->holder_cpu = curr_cpu;
+    compiler_barrier();
     lock->holder = curr_thread;
     return STATUS_SUCCESS;
 }
@@ -167,7 +246,8 @@ void mutex_init(mutex_t *lock, const char *name, unsigned flags) {
     spinlock_init(&lock->lock, "mutex_lock");
     list_init(&lock->threads);
 
-    lock->flags  = flags;
-    lock->holder = NULL;
-    lock->name   = name;
+    lock->flags      = flags;
+    lock->holder     = NULL;
+    lock->holder_cpu = NULL;
+    lock->name       = name;
 }
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Read-copy-update (RCU) implementation.
+ *
+ * This is a simple implementation of RCU for a kernel where read-side critical
+ * sections disable preemption. A CPU passes through a quiescent state when it
+ * is not within any read-side critical section: when it performs a context
+ * switch (which includes each pass of the idle loop), or when preemption is
+ * re-enabled by the outermost preempt_enable(). A grace period ends once every
+ * CPU has passed through a quiescent state since it began, at which point no
+ * read-side critical section that was active at the start remains.
+ *
+ * Callbacks are queued on a per-CPU list by call_rcu(). A single RCU thread
+ * collects the callbacks from all CPUs, runs a grace period for the batch, and
+ * then invokes them. Callbacks queued while a grace period is in progress wait
+ * for the next batch.
+ *
+ * Read-side critical sections are only allowed in thread context, so CPUs that
+ * are idle at the start of a grace period cannot be in one, even if they are
+ * handling an interrupt, and are treated as having already passed through a
+ * quiescent state. A CPU that runs a single thread for a long time without
+ * switching may not pass through a quiescent state on its own, so if a grace
+ * period takes too long, CPUs that have not yet reported one are sent an IPI.
+ * If the interrupted thread does not have preemption disabled, it cannot be
+ * in a read-side critical section, so this is a quiescent state.
+ */
+
+#include <arch/barrier.h>
+
+#include <lib/bitmap.h>
+
+#include <proc/thread.h>
+
+#include <sync/rcu.h>
+#include <sync/semaphore.h>
+
+#include <assert.h>
+#include <cpu.h>
+#include <kernel.h>
+#include <smp.h>
+#include <status.h>
+#include <time.h>
+
+/** Structure used by synchronize_rcu(). */
+typedef struct rcu_sync {
+    rcu_head_t head;                /**< RCU callback head. */
+    semaphore_t sem;                /**< Semaphore to wait on. */
+} rcu_sync_t;
+
+/** Interval at which to check for grace period completion. */
+#define RCU_POLL_INTERVAL           msecs_to_nsecs(1)
+
+/** Time after which CPUs that have not reported a quiescent state are sent an IPI. */
+#define RCU_FORCE_INTERVAL          msecs_to_nsecs(10)
+
+/** Number of CPUs yet to pass through a quiescent state. */
+static atomic_size_t rcu_gp_remaining;
+
+/** Grace period thread. */
+static thread_t *rcu_thread;
+static SEMAPHORE_DEFINE(rcu_request_sem, 0);
+static atomic_bool rcu_requested;
+
+/** Bitmap of CPUs to send an IPI to. */
+static unsigned long *rcu_force_cpus;
+
+/** Record that a CPU has passed through a quiescent state.
+ * @param cpu           CPU to record for. */
+static inline void rcu_cpu_qs(cpu_t *cpu) {
+    if (atomic_exchange(&cpu->rcu_qs_pending, false))
+        atomic_fetch_sub(&rcu_gp_remaining, 1);
+}
+
+/**
+ * Records that the current CPU has passed through a quiescent state, i.e. it
+ * is not within an RCU read-side critical section. This is called by the
+ * scheduler when switching threads, and when preemption is re-enabled.
+ * Interrupts must be disabled.
+ */
+void rcu_quiescent_state(void) {
+    cpu_t *cpu = curr_cpu;
+
+    if (unlikely(atomic_load_explicit(&cpu->rcu_qs_pending, memory_order_relaxed)))
+        rcu_cpu_qs(cpu);
+}
+
+/** SMP call function to force a quiescent state.
+ * @param arg           Unused.
+ * @return              Always STATUS_SUCCESS. */
+static status_t rcu_force_qs(void *arg) {
+    /* Read-side critical sections disable preemption, so if we've interrupted
+     * a thread with preemption enabled, it is not inside one. */
+    if (!curr_thread || !curr_thread->preempt_count)
+        rcu_cpu_qs(curr_cpu);
+
+    return STATUS_SUCCESS;
+}
+
+/** Run a grace period. */
+static void rcu_grace_period(void) {
+    bool irq_state = local_irq_disable();
+
+    atomic_store(&rcu_gp_remaining, cpu_count);
+
+    list_foreach(&running_cpus, iter) {
+        cpu_t *cpu = list_entry(iter, cpu_t, header);
+        atomic_store(&cpu->rcu_qs_pending, true);
+    }
+
+    /* Order the start of the grace period against checking for idle CPUs. A
+     * CPU that we see as idle can only enter a read-side critical section
+     * after this point, so it does not need to be waited for. We're not in a
+     * read-side critical section, so this is also a quiescent state for the
+     * current CPU. */
+    memory_barrier();
+
+    list_foreach(&running_cpus, iter) {
+        cpu_t *cpu = list_entry(iter, cpu_t, header);
+
+        if (cpu == curr_cpu || cpu->idle)
+            rcu_cpu_qs(cpu);
+    }
+
+    local_irq_restore(irq_state);
+
+    nstime_t elapsed = 0;
+    while (atomic_load(&rcu_gp_remaining) != 0) {
+        delay(RCU_POLL_INTERVAL);
+        elapsed += RCU_POLL_INTERVAL;
+
+        if (elapsed >= RCU_FORCE_INTERVAL) {
+            bitmap_zero(rcu_force_cpus, highest_cpu_id + 1);
+
+            list_foreach(&running_cpus, iter) {
+                cpu_t *cpu = list_entry(iter, cpu_t, header);
+
+                if (atomic_load(&cpu->rcu_qs_pending))
+                    bitmap_set(rcu_force_cpus, cpu->id);
+            }
+
+            smp_call_multicast(rcu_force_cpus, rcu_force_qs, NULL, SMP_CALL_ASYNC);
+            elapsed = 0;
+        }
+    }
+}
+
+/** Main function for the RCU thread.
+ * @param arg1          Unused.
+ * @param arg2          Unused. */
+static void rcu_thread_entry(void *arg1, void *arg2) {
+    LIST_DEFINE(batch);
+
+    while (true) {
+        semaphore_down(&rcu_request_sem);
+        atomic_store(&rcu_requested, false);
+
+        /* Collect the callbacks queued on all CPUs. Any that get queued after
+         * this will trigger another request. */
+        list_foreach(&running_cpus, iter) {
+            cpu_t *cpu = list_entry(iter, cpu_t, header);
+
+            spinlock_lock(&cpu->rcu_lock);
+            list_splice_before(&batch, &cpu->rcu_callbacks);
+            spinlock_unlock(&cpu->rcu_lock);
+        }
+
+        if (list_empty(&batch))
+            continue;
+
+        rcu_grace_period();
+
+        list_foreach_safe(&batch, iter) {
+            rcu_head_t *head = list_entry(iter, rcu_head_t, header);
+
+            list_remove(&head->header);
+            head->func(head);
+        }
+    }
+}
+
+/**
+ * Queues a function to be called once all RCU read-side critical sections that
+ * are currently active have ended. The function is called from the RCU thread,
+ * so it may block, but it will delay other callbacks while doing so.
+ *
+ * @param head          Callback head, usually embedded in the structure to be
+ *                      freed by the callback.
+ * @param func          Function to call.
+ */
+void call_rcu(rcu_head_t *head, rcu_func_t func) {
+    list_init(&head->header);
+    head->func = func;
+
+    bool irq_state = local_irq_disable();
+
+    cpu_t *cpu = curr_cpu;
+    spinlock_lock_noirq(&cpu->rcu_lock);
+    list_append(&cpu->rcu_callbacks, &head->header);
+    spinlock_unlock_noirq(&cpu->rcu_lock);
+
+    local_irq_restore(irq_state);
+
+    if (!atomic_exchange(&rcu_requested, true))
+        semaphore_up(&rcu_request_sem, 1);
+}
+
+static void rcu_sync_func(rcu_head_t *head) {
+    rcu_sync_t *sync = container_of(head, rcu_sync_t, head);
+    semaphore_up(&sync->sem, 1);
+}
+
+/**
+ * Waits until all RCU read-side critical sections that are currently active
+ * have ended. Must not be called from within a read-side critical section.
+ */
+void synchronize_rcu(void) {
+    rcu_sync_t sync;
+
+    semaphore_init(&sync.sem, "rcu_sync_sem", 0);
+    call_rcu(&sync.head, rcu_sync_func);
+    semaphore_down(&sync.sem);
+}
+
+/** Start the RCU thread. */
+static __init_text void rcu_init(void) {
+    rcu_force_cpus = bitmap_alloc(highest_cpu_id + 1, MM_BOOT);
+
+    status_t ret = thread_create("rcu", NULL, 0, rcu_thread_entry, NULL, NULL, &rcu_thread);
+    if (ret != STATUS_SUCCESS)
+        fatal("Failed to create RCU thread: %d", ret);
+
+    thread_run(rcu_thread);
+}
+
+INITCALL(rcu_init);
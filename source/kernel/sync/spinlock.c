@@ -17,38 +17,146 @@
 /**
  * @file
  * @brief               Spinlock implementation.
+ *
+ * Spinlocks are queued locks, based on the MCS lock. An uncontended lock is
+ * taken with a single compare and exchange on the locked flag. When the lock
+ * is contended, the CPU instead appends one of its own queue nodes to the tail
+ * of the lock's waiter queue and spins on a flag in that node, so that each
+ * waiter spins on a separate cache line rather than all waiters hammering the
+ * lock itself. The waiter at the head of the queue is the only one that spins
+ * on the lock; once it has taken the lock it hands the head position on to the
+ * next waiter. This means that waiters acquire the lock in FIFO order.
+ *
+ * Unlike a plain MCS lock, a queue node is only needed while waiting, not for
+ * the whole time the lock is held, so the lock can be released without any
+ * reference to the queue. Since waiting is always done with interrupts
+ * disabled, a CPU only needs more than one node if something such as an NMI
+ * handler takes a contended lock while it is already waiting for one.
  */
 
 #include <arch/barrier.h>
 
+#include <lib/utility.h>
+
+#include <mm/malloc.h>
+
 #include <sync/spinlock.h>
 
 #include <assert.h>
 #include <cpu.h>
+#include <kernel.h>
+#include <smp.h>
 #include <status.h>
+#include <time.h>
 
-/** Internal spinlock locking code.
- * @param lock          Spinlock to acquire. */
-static inline void spinlock_lock_internal(spinlock_t *lock) {
-    /* Attempt to take the lock. Prefer the uncontended case. */
-    if (likely(atomic_fetch_sub(&lock->value, 1) == 1))
-        return;
+/** Number of bits of the encoded tail used for the node index. */
+#define SPINLOCK_TAIL_INDEX_BITS    2
+
+static_assert(SPINLOCK_NODE_COUNT == (1 << SPINLOCK_TAIL_INDEX_BITS), "Node count mismatch");
+
+/** Encode a queue node as a value for the tail of a lock.
+ * @param cpu           CPU that the node belongs to.
+ * @param index         Index of the node.
+ * @return              Encoded tail value (never 0). */
+static inline unsigned spinlock_encode_tail(cpu_t *cpu, unsigned index) {
+    return ((cpu->id + 1) << SPINLOCK_TAIL_INDEX_BITS) | index;
+}
 
+/** Get the queue node for an encoded tail value.
+ * @param tail          Encoded tail value.
+ * @return              Pointer to queue node. */
+static inline spinlock_node_t *spinlock_decode_tail(unsigned tail) {
+    cpu_t *cpu = cpus[(tail >> SPINLOCK_TAIL_INDEX_BITS) - 1];
+    return &cpu->spinlock_nodes[tail & (SPINLOCK_NODE_COUNT - 1)];
+}
+
+/** Attempt to take a spinlock if it is free and there are no waiters.
+ * @param lock          Spinlock to acquire.
+ * @return              Whether the lock was acquired. */
+static inline bool spinlock_lock_fast(spinlock_t *lock) {
+    /* Don't jump ahead of any waiters. */
+    if (atomic_load_explicit(&lock->tail, memory_order_relaxed) != 0)
+        return false;
+
+    bool expected = false;
+    return atomic_compare_exchange_strong_explicit(
+        &lock->locked, &expected, true,
+        memory_order_acquire, memory_order_relaxed);
+}
+
+/** Contended spinlock locking code.
+ * @param lock          Spinlock to acquire. */
+static __noinline void spinlock_lock_slow(spinlock_t *lock) {
     /* When running on a single processor there is no need for us to spin as
      * there should only ever be one thing here at any one time, so just die. */
-    if (likely(cpu_count > 1)) {
-        while (true) {
-            /* Wait for it to become unheld. */
-            while (atomic_load(&lock->value) != 1)
-                arch_cpu_spin_hint();
-
-            /* Try to acquire it. */
-            if (atomic_fetch_sub(&lock->value, 1) == 1)
-                break;
-        }
-    } else {
+    if (unlikely(cpu_count <= 1))
         fatal("Nested locking of spinlock %p (%s)", lock, lock->name);
+
+    cpu_t *cpu = curr_cpu;
+
+    unsigned index = cpu->spinlock_node_depth++;
+    if (unlikely(index >= SPINLOCK_NODE_COUNT))
+        fatal("Too many nested waits on spinlock %p (%s)", lock, lock->name);
+
+    spinlock_node_t *node = &cpu->spinlock_nodes[index];
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->wait, true, memory_order_relaxed);
+
+    /* Add ourself to the tail of the queue. If there was a previous waiter,
+     * link ourself to it and wait for it to pass the head of the queue on to
+     * us. The previous waiter cannot finish with its node until we have linked
+     * to it, as the tail no longer refers to it. */
+    unsigned tail = spinlock_encode_tail(cpu, index);
+    unsigned prev = atomic_exchange_explicit(&lock->tail, tail, memory_order_acq_rel);
+    if (prev != 0) {
+        atomic_store_explicit(&spinlock_decode_tail(prev)->next, node, memory_order_release);
+
+        while (atomic_load_explicit(&node->wait, memory_order_acquire))
+            arch_cpu_spin_hint();
+    }
+
+    /* We're at the head of the queue, wait for the holder to release it. The
+     * only other CPUs that can compete with us are ones that saw no waiters in
+     * spinlock_lock_fast() before we were queued. */
+    while (true) {
+        while (atomic_load_explicit(&lock->locked, memory_order_relaxed))
+            arch_cpu_spin_hint();
+
+        bool expected = false;
+        if (atomic_compare_exchange_weak_explicit(
+                &lock->locked, &expected, true,
+                memory_order_acquire, memory_order_relaxed))
+        {
+            break;
+        }
     }
+
+    /* Pass the head of the queue on. If we're still the tail then there are
+     * no other waiters, otherwise wait for the next waiter to finish linking
+     * itself to us. */
+    unsigned expected = tail;
+    if (!atomic_compare_exchange_strong_explicit(
+            &lock->tail, &expected, 0,
+            memory_order_release, memory_order_relaxed))
+    {
+        spinlock_node_t *next;
+        while (!(next = atomic_load_explicit(&node->next, memory_order_acquire)))
+            arch_cpu_spin_hint();
+
+        atomic_store_explicit(&next->wait, false, memory_order_release);
+    }
+
+    cpu->spinlock_node_depth--;
+}
+
+/** Internal spinlock locking code.
+ * @param lock          Spinlock to acquire. */
+static inline void spinlock_lock_internal(spinlock_t *lock) {
+    /* Prefer the uncontended case. */
+    if (likely(spinlock_lock_fast(lock)))
+        return;
+
+    spinlock_lock_slow(lock);
 }
 
 /**
@@ -94,6 +202,22 @@ void spinlock_lock_noirq(spinlock_t *lock) {
     spinlock_lock_internal(lock);
 }
 
+/**
+ * Attempts to acquire the specified spinlock without spinning if it is already
+ * held, and without changing interrupt state. As with spinlock_lock_noirq(),
+ * interrupts must be disabled and a lock acquired with this function MUST be
+ * released with spinlock_unlock_noirq().
+ *
+ * @param lock          Spinlock to acquire.
+ *
+ * @return              Whether the lock was acquired.
+ */
+bool spinlock_trylock_noirq(spinlock_t *lock) {
+    assert(!local_irq_state());
+
+    return spinlock_lock_fast(lock);
+}
+
 /**
  * Releases the specified spinlock and restores the interrupt state to what it
  * was before the lock was acquired. This should only be used if the lock was
@@ -106,7 +230,7 @@ void spinlock_unlock(spinlock_t *lock) {
         fatal("Release of already unlocked spinlock %p (%s)", lock, lock->name);
 
     bool irq_state = lock->state;
-    atomic_store(&lock->value, 1);
+    atomic_store_explicit(&lock->locked, false, memory_order_release);
     local_irq_restore(irq_state);
 }
 
@@ -120,14 +244,117 @@ void spinlock_unlock_noirq(spinlock_t *lock) {
     if (unlikely(!spinlock_held(lock)))
         fatal("Release of already unlocked spinlock %p (%s)", lock, lock->name);
 
-    atomic_store(&lock->value, 1);
+    atomic_store_explicit(&lock->locked, false, memory_order_release);
 }
 
 /** Initializes a spinlock.
  * @param lock          Spinlock to initialize.
  * @param name          Name of the spinlock, used for debugging purposes. */
 void spinlock_init(spinlock_t *lock, const char *name) {
-    atomic_store_explicit(&lock->value, 1, memory_order_relaxed);
+    atomic_store_explicit(&lock->locked, false, memory_order_relaxed);
+    atomic_store_explicit(&lock->tail, 0, memory_order_relaxed);
     lock->name  = name;
     lock->state = false;
 }
+
+#if CONFIG_SPINLOCK_BENCHMARK
+
+/** Length of the spinlock benchmark run. */
+#define SPINLOCK_BENCHMARK_TIME     msecs_to_nsecs(500)
+
+/** Number of acquisitions between checks of the time. */
+#define SPINLOCK_BENCHMARK_BATCH    64
+
+static SPINLOCK_DEFINE(spinlock_benchmark_lock);
+static atomic_size_t spinlock_benchmark_ready;
+static atomic_size_t spinlock_benchmark_done;
+static atomic_bool spinlock_benchmark_started;
+static nstime_t spinlock_benchmark_end;
+static uint64_t *spinlock_benchmark_counts;
+static volatile uint64_t spinlock_benchmark_shared;
+
+/** Repeatedly acquire the benchmark lock until the end time is reached.
+ * @param arg           Unused.
+ * @return              Always STATUS_SUCCESS. */
+static status_t spinlock_benchmark_run(void *arg) {
+    uint64_t count = 0;
+
+    atomic_fetch_add(&spinlock_benchmark_ready, 1);
+    while (!atomic_load(&spinlock_benchmark_started))
+        arch_cpu_spin_hint();
+
+    while (system_time() < spinlock_benchmark_end) {
+        for (unsigned i = 0; i < SPINLOCK_BENCHMARK_BATCH; i++) {
+            spinlock_lock_noirq(&spinlock_benchmark_lock);
+            spinlock_benchmark_shared++;
+            spinlock_unlock_noirq(&spinlock_benchmark_lock);
+        }
+
+        count += SPINLOCK_BENCHMARK_BATCH;
+    }
+
+    spinlock_benchmark_counts[curr_cpu->id] = count;
+    atomic_fetch_add(&spinlock_benchmark_done, 1);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Measures spinlock throughput and fairness. All CPUs repeatedly acquire and
+ * release a single lock with interrupts disabled for a fixed length of time.
+ * The total number of acquisitions gives the throughput, and the spread of
+ * per-CPU acquisition counts shows how fairly the lock is handed out.
+ */
+static __init_text void spinlock_benchmark(void) {
+    if (cpu_count < 2) {
+        kprintf(LOG_NOTICE, "spinlock: benchmark requires more than 1 CPU\n");
+        return;
+    }
+
+    spinlock_benchmark_counts = kcalloc(highest_cpu_id + 1, sizeof(*spinlock_benchmark_counts), MM_BOOT);
+
+    /* Keep the current CPU from being interrupted or migrated so that it
+     * competes on equal terms with the CPUs running the SMP call. */
+    bool irq_state = local_irq_disable();
+
+    smp_call_broadcast(spinlock_benchmark_run, NULL, SMP_CALL_ASYNC);
+
+    while (atomic_load(&spinlock_benchmark_ready) != cpu_count - 1)
+        arch_cpu_spin_hint();
+
+    spinlock_benchmark_end = system_time() + SPINLOCK_BENCHMARK_TIME;
+    atomic_store(&spinlock_benchmark_started, true);
+
+    spinlock_benchmark_run(NULL);
+
+    while (atomic_load(&spinlock_benchmark_done) != cpu_count)
+        arch_cpu_spin_hint();
+
+    local_irq_restore(irq_state);
+
+    uint64_t total = 0, lowest = UINT64_MAX, highest = 0;
+    list_foreach(&running_cpus, iter) {
+        cpu_t *cpu = list_entry(iter, cpu_t, header);
+        uint64_t count = spinlock_benchmark_counts[cpu->id];
+
+        kprintf(LOG_NOTICE, "spinlock: CPU %" PRIu32 ": %" PRIu64 " acquisitions\n", cpu->id, count);
+
+        total += count;
+        lowest  = min(lowest, count);
+        highest = max(highest, count);
+    }
+
+    uint64_t mean = total / cpu_count;
+
+    kprintf(
+        LOG_NOTICE, "spinlock: %zu CPUs: %" PRIu64 " acquisitions/sec\n",
+        cpu_count, (total * 1000) / nsecs_to_msecs(SPINLOCK_BENCHMARK_TIME));
+    kprintf(
+        LOG_NOTICE, "spinlock: per-CPU min %" PRIu64 "%% max %" PRIu64 "%% of mean\n",
+        (lowest * 100) / mean, (highest * 100) / mean);
+
+    kfree(spinlock_benchmark_counts);
+}
+
+INITCALL(spinlock_benchmark);
+
+#endif /* CONFIG_SPINLOCK_BENCHMARK */
@@ -18,6 +18,12 @@
  * @file
  * @brief               Time handling functions.
  *
+ * Running timers are kept in a per-CPU AVL tree keyed by their target time,
+ * so that starting and stopping a timer is O(log n) in the number of timers
+ * running on the CPU, and the next timer to expire is the first node in the
+ * tree. Keys must be unique, so a timer whose target time collides with an
+ * existing timer is moved to the next free nanosecond.
+ *
  * TODO:
  *  - Timers are tied to the CPU that they are created on. This is the right
  *    thing to do with, e.g. the scheduler timers, but what should we do with
@@ -27,10 +33,15 @@
 
 #include <kernel/time.h>
 
+#include <arch/barrier.h>
+
 #include <lib/notifier.h>
 
 #include <mm/malloc.h>
+#include <mm/page.h>
+#include <mm/phys.h>
 #include <mm/safe.h>
+#include <mm/vm.h>
 
 #include <proc/thread.h>
 
@@ -81,6 +92,11 @@ nstime_t boot_unix_time;
 /** Hardware timer device. */
 static timer_device_t *timer_device;
 
+/** Time information page exported to user mode. */
+static page_t *time_page_page;
+static time_page_t *time_page;
+static object_handle_t *time_page_handle;
+
 /** Convert a date/time to nanoseconds since the epoch. */
 nstime_t time_to_unix(
     unsigned year, unsigned month, unsigned day, unsigned hour,
@@ -168,26 +184,24 @@ void timer_device_set(timer_device_t *device) {
     kprintf(LOG_NOTICE, "timer: activated timer device %s\n", device->name);
 }
 
+/** Gets the first timer to expire on a CPU, with CPU timer lock held. */
+static inline timer_t *first_timer(cpu_t *cpu) {
+    avl_tree_node_t *node = avl_tree_first(&cpu->timers);
+    return (node) ? avl_tree_entry(node, timer_t, link) : NULL;
+}
+
 /** Start a timer, with CPU timer lock held. */
 static void timer_start_unsafe(timer_t *timer) {
-    assert(list_empty(&timer->header));
-
     /* Work out the absolute completion time. */
-    timer->target = system_time() + timer->initial;
+    nstime_t target = system_time() + timer->initial;
 
-    /* Find the insertion point for the timer: the list must be ordered with
-     * nearest expiration time first. */
-    list_t *pos = curr_cpu->timers.next;
-    while (pos != &curr_cpu->timers) {
-        timer_t *exist = list_entry(pos, timer_t, header);
+    /* Tree keys must be unique. Collisions are rare, and firing a nanosecond
+     * late makes no difference. */
+    while (avl_tree_lookup_node(&curr_cpu->timers, target))
+        target++;
 
-        if (exist->target > timer->target)
-            break;
-
-        pos = pos->next;
-    }
-
-    list_add_before(pos, &timer->header);
+    timer->target = target;
+    avl_tree_insert(&curr_cpu->timers, target, &timer->link);
 }
 
 static void timer_dpc_request(void *_timer) {
@@ -210,17 +224,18 @@ bool timer_tick(void) {
 
     bool preempt = false;
 
-    /* Iterate the list and check for expired timers. */
-    list_foreach_safe(&curr_cpu->timers, iter) {
-        timer_t *timer = list_entry(iter, timer_t, header);
-
-        /* Since the list is ordered soonest expiry first, we can break if the
+    /* Pull expired timers off the front of the tree. */
+    timer_t *timer;
+    while ((timer = first_timer(curr_cpu))) {
+        /* Since the tree is ordered soonest expiry first, we can stop if the
          * current timer has not expired. */
         if (time < timer->target)
             break;
 
-        /* This timer has expired, remove it from the list. */
-        list_remove(&timer->header);
+        /* This timer has expired, remove it from the tree. */
+        avl_tree_remove(&curr_cpu->timers, &timer->link);
+        if (timer->mode != TIMER_PERIODIC)
+            timer->cpu = NULL;
 
         /* Perform its timeout action. */
         if (timer->flags & TIMER_THREAD) {
@@ -237,15 +252,15 @@ bool timer_tick(void) {
 
     switch (timer_device->type) {
         case TIMER_DEVICE_ONESHOT:
-            /* Prepare the next tick if there is still a timer in the list. */
-            if (!list_empty(&curr_cpu->timers))
-                timer_device_prepare(list_first(&curr_cpu->timers, timer_t, header));
+            /* Prepare the next tick if there is still a timer in the tree. */
+            if (timer)
+                timer_device_prepare(timer);
 
             break;
         case TIMER_DEVICE_PERIODIC:
-            /* For periodic devices, if the list is empty disable the device so the
-            * timer does not interrupt unnecessarily. */
-            if (list_empty(&curr_cpu->timers))
+            /* For periodic devices, if the tree is empty disable the device so
+             * the timer does not interrupt unnecessarily. */
+            if (avl_tree_empty(&curr_cpu->timers))
                 timer_device_disable();
 
             break;
@@ -262,8 +277,7 @@ bool timer_tick(void) {
  * @param data          Data argument to pass to timer.
  * @param flags         Behaviour flags for the timer. */
 void timer_init(timer_t *timer, const char *name, timer_func_t func, void *data, uint32_t flags) {
-    list_init(&timer->header);
-
+    timer->cpu   = NULL;
     timer->func  = func;
     timer->data  = data;
     timer->flags = flags;
@@ -279,6 +293,8 @@ void timer_start(timer_t *timer, nstime_t length, unsigned mode) {
     if (length <= 0)
         return;
 
+    assert(!timer_running(timer));
+
     /* Prevent curr_cpu from changing underneath us. */
     bool irq_state = local_irq_disable();
 
@@ -288,15 +304,15 @@ void timer_start(timer_t *timer, nstime_t length, unsigned mode) {
 
     spinlock_lock_noirq(&curr_cpu->timer_lock);
 
-    /* Add the timer to the list. */
+    /* Add the timer to the tree. */
     timer_start_unsafe(timer);
 
     switch (timer_device->type) {
         case TIMER_DEVICE_ONESHOT:
-            /* If the new timer is at the beginning of the list, then it has
+            /* If the new timer is at the beginning of the tree, then it has
              * the shortest remaining time, so we need to adjust the device to
              * tick for it. */
-            if (timer == list_first(&curr_cpu->timers, timer_t, header))
+            if (timer == first_timer(curr_cpu))
                 timer_device_prepare(timer);
 
             break;
@@ -313,36 +329,44 @@ void timer_start(timer_t *timer, nstime_t length, unsigned mode) {
 /** Cancel a running timer.
  * @param timer         Timer to stop. */
 void timer_stop(timer_t *timer) {
-    if (!list_empty(&timer->header)) {
-        assert(timer->cpu);
+    cpu_t *cpu = timer->cpu;
 
-        spinlock_lock(&timer->cpu->timer_lock);
+    if (cpu) {
+        spinlock_lock(&cpu->timer_lock);
 
-        timer_t *first = list_first(&timer->cpu->timers, timer_t, header);
+        /* Recheck now that we have the lock, it may have expired. */
+        if (timer->cpu != cpu) {
+            spinlock_unlock(&cpu->timer_lock);
+            return;
+        }
+
+        timer_t *first = first_timer(cpu);
 
-        list_remove(&timer->header);
+        avl_tree_remove(&cpu->timers, &timer->link);
+        timer->cpu = NULL;
 
         /* If the timer is running on this CPU, adjust the tick length or
          * disable the device if required. If the timer is on another CPU, it's
          * no big deal: the tick handler is able to handle unexpected ticks. */
-        if (timer->cpu == curr_cpu) {
+        if (cpu == curr_cpu) {
             switch (timer_device->type) {
                 case TIMER_DEVICE_ONESHOT:
-                    if (first == timer && !list_empty(&curr_cpu->timers)) {
-                        first = list_first(&curr_cpu->timers, timer_t, header);
-                        timer_device_prepare(first);
+                    if (first == timer) {
+                        first = first_timer(cpu);
+                        if (first)
+                            timer_device_prepare(first);
                     }
 
                     break;
                 case TIMER_DEVICE_PERIODIC:
-                    if (list_empty(&curr_cpu->timers))
+                    if (avl_tree_empty(&cpu->timers))
                         timer_device_disable();
 
                     break;
             }
         }
 
-        spinlock_unlock(&timer->cpu->timer_lock);
+        spinlock_unlock(&cpu->timer_lock);
     }
 }
 
@@ -402,8 +426,8 @@ static kdb_status_t kdb_cmd_timers(int argc, char **argv, kdb_filter_t *filter)
     kdb_printf("Name                 Target           Function           Data\n");
     kdb_printf("====                 ======           ========           ====\n");
 
-    list_foreach(&cpu->timers, iter) {
-        timer_t *timer = list_entry(iter, timer_t, header);
+    avl_tree_foreach(&cpu->timers, iter) {
+        timer_t *timer = avl_tree_entry(iter, timer_t, link);
 
         kdb_printf(
             "%-20s %-16llu %-18p %p\n",
@@ -427,6 +451,80 @@ static kdb_status_t kdb_cmd_uptime(int argc, char **argv, kdb_filter_t *filter)
     return KDB_SUCCESS;
 }
 
+/** Get a page from the time page object. */
+static status_t time_page_get_page(vm_region_t *region, offset_t offset, page_t **_page) {
+    if (offset != 0)
+        return STATUS_INVALID_ADDR;
+
+    *_page = time_page_page;
+    return STATUS_SUCCESS;
+}
+
+/** Time page region operations. */
+static vm_region_ops_t time_page_region_ops = {
+    .get_page = time_page_get_page,
+};
+
+/** Map the time page object. */
+static status_t time_page_object_map(object_handle_t *handle, vm_region_t *region) {
+    if (region->access & (VM_ACCESS_WRITE | VM_ACCESS_EXECUTE) || region->flags & VM_MAP_PRIVATE)
+        return STATUS_ACCESS_DENIED;
+
+    region->ops = &time_page_region_ops;
+    return STATUS_SUCCESS;
+}
+
+/** Time page object type. This is only used internally for vm_map(), handles
+ * to it are never attached to a process. */
+static object_type_t time_page_object_type = {
+    .map = time_page_object_map,
+};
+
+/** Maps the time information page into an address space.
+ * @param as            Address space to map into.
+ * @param _addr         Where to store address of mapping.
+ * @return              Status code describing result of the operation. */
+status_t time_page_map(vm_aspace_t *as, ptr_t *_addr) {
+    if (!time_page_handle)
+        return STATUS_NOT_SUPPORTED;
+
+    return vm_map(
+        as, _addr, PAGE_SIZE, 0, VM_ADDRESS_ANY, VM_ACCESS_READ, 0,
+        time_page_handle, 0, "time_page");
+}
+
+/** Begins an update to the time page. */
+static void time_page_write_begin(void) {
+    time_page->seq++;
+    write_barrier();
+}
+
+/** Ends an update to the time page. */
+static void time_page_write_end(void) {
+    write_barrier();
+    time_page->seq++;
+}
+
+/** Creates the time page once all CPUs are up. */
+static __init_text void time_page_init(void) {
+    time_page_page = page_alloc(MM_BOOT | MM_ZERO);
+    time_page      = phys_map(time_page_page->addr, PAGE_SIZE, MM_BOOT);
+
+    time_page_write_begin();
+
+    time_page->boot_unix_time = boot_unix_time;
+    arch_time_page_init(time_page);
+
+    time_page_write_end();
+
+    if (!time_page->cpu_count)
+        kprintf(LOG_NOTICE, "time: user mode time not supported\n");
+
+    time_page_handle = object_handle_create(&time_page_object_type, NULL);
+}
+
+INITCALL(time_page_init);
+
 /** Initialize the timing system. */
 __init_text void time_init(void) {
     /* Initialize the boot time. */
@@ -577,7 +675,7 @@ status_t kern_timer_stop(handle_t handle, nstime_t *_rem) {
 
     user_timer_t *timer = khandle->private;
 
-    if (!list_empty(&timer->timer.header)) {
+    if (timer_running(&timer->timer)) {
         timer_stop(&timer->timer);
         timer->fired = false;
 
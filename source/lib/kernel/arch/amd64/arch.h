@@ -73,4 +73,28 @@ static inline void arch_tls_tcb_init(tls_tcb_t *tcb) {
     tcb->tpt = tcb;
 }
 
+/** Read the time counter.
+ * @param _cpu          Where to store ID of the CPU the counter was read on.
+ * @return              Current counter value. */
+static inline uint64_t arch_time_counter(uint32_t *_cpu) {
+    uint32_t high, low;
+
+    /* RDTSCP returns the value of TSC_AUX in ECX, which the kernel sets to the
+     * CPU ID. */
+    __asm__ __volatile__("rdtscp" : "=a"(low), "=d"(high), "=c"(*_cpu));
+    return ((uint64_t)high << 32) | low;
+}
+
+/** Convert a counter value to nanoseconds.
+ * @param value         Counter value.
+ * @param cv            Conversion factor (32.32 fixed point).
+ * @return              Value in nanoseconds. */
+static inline uint64_t arch_time_convert(uint64_t value, uint64_t cv) {
+    uint64_t low, high;
+
+    __asm__("mulq %3" : "=a"(low), "=d"(high) : "a"(value), "rm"(cv) : "cc");
+    __asm__("shrdq $32, %1, %0" : "+r"(low) : "r"(high) : "cc");
+    return low;
+}
+
 extern void libkernel_relocate(process_args_t *args, elf_dyn_t *dyn);
@@ -45,6 +45,9 @@ void libkernel_init(process_args_t *args) {
     /* Get the system page size. */
     kern_system_info(SYSTEM_INFO_PAGE_SIZE, &page_size);
 
+    /* Save the time page for the kern_time_get() wrapper. */
+    time_page = args->time_page;
+
     /* Save the current process ID for the kern_process_id() wrapper. */
     _kern_process_id(PROCESS_SELF, &curr_process_id);
 
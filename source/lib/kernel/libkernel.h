@@ -26,6 +26,7 @@
 
 #include <kernel/private/process.h>
 #include <kernel/private/thread.h>
+#include <kernel/private/time.h>
 #include <kernel/status.h>
 
 #include <system/defs.h>
@@ -102,6 +103,7 @@ extern rtld_image_t *application_image;
 extern __thread thread_id_t curr_thread_id;
 extern process_id_t curr_process_id;
 extern size_t page_size;
+extern const time_page_t *time_page;
 
 extern bool libkernel_debug;
 extern bool libkernel_dry_run;
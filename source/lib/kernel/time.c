@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2009-2020 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Time functions.
+ *
+ * The kernel maps a page containing the parameters needed to convert the CPU
+ * time counter to system time into every process. This allows the current
+ * time to be read without making a kernel call, which is worthwhile given how
+ * frequently it is needed.
+ */
+
+#include <kernel/private/time.h>
+
+#include "libkernel.h"
+
+/** Time information page (NULL if not available). */
+const time_page_t *time_page;
+
+/** Reads the time from the time page.
+ * @param source        Time source to read (TIME_SYSTEM or TIME_REAL).
+ * @param _time         Where to store time.
+ * @return              Whether the time page could be used. */
+static bool time_page_read(unsigned source, nstime_t *_time) {
+    const volatile time_page_t *page = time_page;
+    nstime_t time;
+
+    while (true) {
+        /* An odd sequence count means an update is in progress. */
+        uint32_t seq = page->seq;
+        if (seq & 1)
+            continue;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        uint32_t cpu;
+        uint64_t counter = arch_time_counter(&cpu);
+        if (cpu >= page->cpu_count)
+            return false;
+
+        time = arch_time_convert(counter - page->cpus[cpu].offset, page->cpus[cpu].cv);
+        if (source == TIME_REAL)
+            time += page->boot_unix_time;
+
+        /* Retry if the page was updated while we were reading it. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (page->seq == seq)
+            break;
+    }
+
+    *_time = time;
+    return true;
+}
+
+/**
+ * Gets the current time, in nanoseconds, from the specified time source. There
+ * are currently 2 time sources defined:
+ *  - TIME_SYSTEM: A monotonic timer which gives the time since the system was
+ *    started.
+ *  - TIME_REAL: Real time given as time since the UNIX epoch. This can be
+ *    changed with kern_time_set().
+ *
+ * Where possible, the time is read in user mode from the time page, without
+ * making a kernel call.
+ *
+ * @param source        Time source to get from.
+ * @param _time         Where to store time in nanoseconds.
+ *
+ * @return              STATUS_SUCCESS on success.
+ *                      STATUS_INVALID_ARG if time source is invalid or _time
+ *                      is NULL.
+ */
+__sys_export status_t kern_time_get(unsigned source, nstime_t *_time) {
+    if (time_page && _time && (source == TIME_SYSTEM || source == TIME_REAL)) {
+        if (time_page_read(source, _time))
+            return STATUS_SUCCESS;
+    }
+
+    return _kern_time_get(source, _time);
+}
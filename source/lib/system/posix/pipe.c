@@ -19,13 +19,30 @@
  * @brief               POSIX pipe creation function.
  */
 
+#include <kernel/object.h>
+#include <kernel/pipe.h>
+#include <kernel/status.h>
+
 #include <unistd.h>
+
 #include "libsystem.h"
 
 /** Create an interprocess channel.
  * @param fds           Where to store file descriptors to each end of pipe.
+ *                      The first is the read end, the second the write end.
  * @return              0 on success, -1 on failure. */
 int pipe(int fds[2]) {
-    libsystem_stub("pipe", false);
-    return -1;
+    handle_t handles[2];
+    status_t ret = kern_pipe_create(handles);
+    if (ret != STATUS_SUCCESS) {
+        libsystem_status_to_errno(ret);
+        return -1;
+    }
+
+    kern_handle_set_flags(handles[0], HANDLE_INHERITABLE);
+    kern_handle_set_flags(handles[1], HANDLE_INHERITABLE);
+
+    fds[0] = handles[0];
+    fds[1] = handles[1];
+    return 0;
 }
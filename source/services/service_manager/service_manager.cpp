@@ -38,13 +38,20 @@ extern const char *const *environ;
 
 ServiceManager g_serviceManager;
 
+/** Maximum number of events to handle per wait. */
+static constexpr size_t kMaxPendingEvents = 32;
+
 ServiceManager::ServiceManager() :
-    m_port (INVALID_HANDLE)
+    m_port         (INVALID_HANDLE),
+    m_waitset      (INVALID_HANDLE),
+    m_pendingIndex (0)
 {}
 
 ServiceManager::~ServiceManager() {
     if (m_port != INVALID_HANDLE)
         kern_handle_close(m_port);
+    if (m_waitset != INVALID_HANDLE)
+        kern_handle_close(m_waitset);
 }
 
 int ServiceManager::run() {
@@ -57,6 +64,12 @@ int ServiceManager::run() {
 
     core_log(CORE_LOG_NOTICE, "service manager started");
 
+    ret = kern_waitset_create(&m_waitset);
+    if (ret != STATUS_SUCCESS) {
+        core_log(CORE_LOG_ERROR, "failed to create wait set: %d", ret);
+        return EXIT_FAILURE;
+    }
+
     ret = kern_port_create(&m_port);
     if (ret != STATUS_SUCCESS) {
         core_log(CORE_LOG_ERROR, "failed to create port: %d", ret);
@@ -71,37 +84,33 @@ int ServiceManager::run() {
 
     spawnProcess("/system/bin/terminal");
 
+    m_pendingEvents.resize(kMaxPendingEvents);
+
     while (true) {
-        ret = kern_object_wait(m_events.data(), m_events.size(), 0, -1);
+        size_t numEvents;
+        ret = kern_waitset_wait(m_waitset, m_pendingEvents.data(), m_pendingEvents.size(), -1, &numEvents);
         if (ret != STATUS_SUCCESS) {
             core_log(CORE_LOG_WARN, "failed to wait for events: %d", ret);
             continue;
         }
 
-        size_t numEvents = m_events.size();
-
-        for (size_t i = 0; i < numEvents; ) {
-            object_event_t &event = m_events[i];
-
-            uint32_t flags = event.flags;
-            event.flags &= ~(OBJECT_EVENT_SIGNALLED | OBJECT_EVENT_ERROR);
+        /* Only the events that were signalled are returned. Handlers may
+         * remove events which are still pending, removeEvents() clears the
+         * handler on those so that we skip them. */
+        for (m_pendingIndex = 0; m_pendingIndex < numEvents; m_pendingIndex++) {
+            const object_event_t &event = m_pendingEvents[m_pendingIndex];
+            auto handler = reinterpret_cast<EventHandler *>(event.udata);
 
-            if (flags & OBJECT_EVENT_ERROR) {
+            if (!handler) {
+                continue;
+            } else if (event.flags & OBJECT_EVENT_ERROR) {
                 core_log(CORE_LOG_WARN, "error flagged on event %u for handle %u", event.event, event.handle);
-            } else if (flags & OBJECT_EVENT_SIGNALLED) {
-                auto handler = reinterpret_cast<EventHandler *>(event.udata);
-                handler->handleEvent(&event);
-            }
-
-            /* Calling the handler may change the event array, so we have to
-             * handle this - start from the beginning. */
-            if (numEvents != m_events.size()) {
-                numEvents = m_events.size();
-                i = 0;
             } else {
-                i++;
+                handler->handleEvent(&event);
             }
         }
+
+        m_pendingIndex = 0;
     }
 }
 
@@ -178,23 +187,38 @@ void ServiceManager::handleEvent(const object_event_t *event) {
 }
 
 void ServiceManager::addEvent(handle_t handle, unsigned id, EventHandler *handler) {
-    object_event_t &event = m_events.emplace_back();
+    object_event_t event;
 
     event.handle = handle;
     event.event  = id;
     event.flags  = 0;
     event.data   = 0;
     event.udata  = handler;
+
+    status_t ret = kern_waitset_add(m_waitset, &event);
+    if (ret != STATUS_SUCCESS) {
+        core_log(CORE_LOG_ERROR, "failed to add event %u for handle %u: %d", id, handle, ret);
+        return;
+    }
+
+    m_events.emplace_back(event);
 }
 
 void ServiceManager::removeEvents(EventHandler *handler) {
     for (auto it = m_events.begin(); it != m_events.end(); ) {
         if (reinterpret_cast<EventHandler *>(it->udata) == handler) {
+            kern_waitset_remove(m_waitset, it->handle, it->event);
             it = m_events.erase(it);
         } else {
             ++it;
         }
     }
+
+    /* Don't call the handler for any events still waiting to be handled. */
+    for (size_t i = m_pendingIndex; i < m_pendingEvents.size(); i++) {
+        if (reinterpret_cast<EventHandler *>(m_pendingEvents[i].udata) == handler)
+            m_pendingEvents[i].udata = nullptr;
+    }
 }
 
 int main(int argc, char **argv) {
@@ -56,9 +56,16 @@ private:
 
 private:
     handle_t m_port;
+    handle_t m_waitset;
 
     ServiceMap m_services;
+
+    /** Events registered with the wait set. */
     std::vector<object_event_t> m_events;
+
+    /** Events returned by the current wait which have not yet been handled. */
+    std::vector<object_event_t> m_pendingEvents;
+    size_t m_pendingIndex;
 };
 
 extern ServiceManager g_serviceManager;